@@ -4,28 +4,96 @@
 #include "periodic.h"
 #include "website.h"
 #include "class.h"
+#include "rule.h"
 #include "waitq.h"
 #include "database.h"
+#include "timetable.h"
+#include "shards.h"
+#include "offload.h"
+#include "release.h"
 #include "bookings.h"
+#include "stall.h"
+#include "events.h"
 #include <ev.h>
 
 LOGSET("bookings");
 
 #define BOOKINGS_RETRY 180.0
 #define BOOKINGS_RETRY_MAX 20
+#define BOOKINGS_ARM_MAX 16
+
+/* Everything a booking pass needs, copied from the config on the
+ * default loop so the shards running it never touch shared state.
+ * The pass forks one task per matched class, any shard may run them,
+ * then the basket is committed as a second job */
+struct booking_run {
+  char *location;
+  int ndays;
+  int home;
+  bool full;
+  ev_tstamp fire_at;
+  struct class_list wanted;
+  rule_mask minutes;
+  pthread_mutex_t lock;
+  struct class_list booked;
+  struct class_list waiting;
+  int ntasks;
+  int nstolen;
+  ev_tstamp max_wait;
+  ev_tstamp max_run;
+  bool fetched;
+  bool committed;
+  bool dirty;
+  ev_tstamp requested;
+  ev_tstamp received;
+  ev_tstamp parsed;
+  ev_tstamp committed_at;
+  struct event_list events;
+  STAILQ_ENTRY(booking_run) q;
+};
+
+struct booking_task {
+  struct booking_run *run;
+  class_t cl;
+  ev_tstamp queued;
+  struct event ev;
+};
 
 static ev_timer rb = {0};
+static bool running = false;
+static bool recheck = false;
+/* Targeted passes asked for whilst another pass was running. Every pass
+ * shares the one basket on the site, so they take turns */
+static STAILQ_HEAD(, booking_run) queued = STAILQ_HEAD_INITIALIZER(queued);
 
 static void stop_rebooker(void);
 static void start_rebooker(void);
 static void recheck_bookings_event(EV_P_ ev_timer *w, int revents);
+static struct booking_run * booking_run_new(class_t *only, int n);
+static bool booking_run_want(struct booking_run *run, class_t co);
+static void booking_run_free(struct booking_run *run);
+static bool booking_wanted(struct booking_run *run, class_t co, class_t we);
+static class_t booking_match(struct booking_run *run, class_t we);
+static void booking_queue(offload_job_t job, struct booking_run *run, class_t cl);
+static void booking_event(struct booking_run *run, struct event *ev,
+                          const char *decision);
+static void booking_fire(struct booking_run *run);
+static void booking_pass(offload_job_t job, void *data);
+static void booking_task(offload_job_t job, void *data);
+static void booking_commit(offload_job_t job, void *data);
+static void booking_matched(EV_P_ void *data);
+static void booking_release_done(EV_P_ void *data);
+static void booking_done(EV_P_ void *data);
+static void booking_start(struct booking_run *run);
+static void booking_next(void);
 
 
 
 static void recheck_bookings_event(
-    EV_P_ ev_timer *w, 
+    EV_P_ ev_timer *w,
     int revents)
 {
+  STALL_TAG();
   bookings_check();
 }
 
@@ -37,6 +105,7 @@ static void start_rebooker(
     return;
 
   ev_timer_init(&rb, recheck_bookings_event, BOOKINGS_RETRY, BOOKINGS_RETRY);
+  ev_set_priority(&rb, EV_MAXPRI);
   ev_timer_start(EV_DEFAULT, &rb);
 }
 
@@ -48,18 +117,493 @@ static void stop_rebooker(
 }
 
 
-void bookings_check(
-    void)
+/* A full pass checks every config entry, otherwise just the n given */
+static struct booking_run * booking_run_new(
+    class_t *only,
+    int n)
+{
+  class_t co;
+  int i;
+  struct booking_run *run = calloc(1, sizeof(struct booking_run));
+  if (!run) {
+    ELOGERR(ERROR, "Cannot allocate booking run");
+    return NULL;
+  }
+
+  LIST_INIT(&run->wanted);
+  LIST_INIT(&run->booked);
+  LIST_INIT(&run->waiting);
+  STAILQ_INIT(&run->events);
+  pthread_mutex_init(&run->lock, NULL);
+
+  run->ndays = config_get_max_days();
+  run->location = strdup(config_get_location());
+  if (!run->location) {
+    ELOGERR(ERROR, "Cannot allocate booking run");
+    goto fail;
+  }
+
+  if (only) {
+    for (i=0; i < n; i++) {
+      if (!booking_run_want(run, only[i]))
+        goto fail;
+    }
+    return run;
+  }
+
+  run->full = true;
+  LIST_FOREACH(co, config_get_classes(), l) {
+    if (!booking_run_want(run, co))
+      goto fail;
+  }
+
+  return run;
+
+fail:
+  booking_run_free(run);
+  return NULL;
+}
+
+
+/* Adds a config entry to the run, folding its minutes into the mask */
+static bool booking_run_want(
+    struct booking_run *run,
+    class_t co)
+{
+  class_t cl = class_dup(co);
+  if (!cl)
+    return false;
+
+  if (cl->rule)
+    rule_mask_add(run->minutes, cl->rule);
+  else
+    memset(run->minutes, 0xff, sizeof(rule_mask));
+
+  LIST_INSERT_HEAD(&run->wanted, cl, l);
+  return true;
+}
+
+
+static void booking_run_free(
+    struct booking_run *run)
+{
+  if (!run)
+    return;
+
+  class_free_timetable(&run->wanted);
+  class_free_timetable(&run->booked);
+  class_free_timetable(&run->waiting);
+  event_flush(&run->events, 0.);
+  pthread_mutex_destroy(&run->lock);
+  free(run->location);
+  free(run);
+}
+
+
+/* Whether the timetable entry is one the config entry wants booked and
+ * we have not already got */
+static bool booking_wanted(
+    struct booking_run *run,
+    class_t co,
+    class_t we)
 {
-  static int bookings_retry_counter = 0;
-  class_list_t ttwe = website_get_timetable(config_get_max_days());
-  class_list_t ttco = config_get_classes();
-  class_t co = LIST_FIRST(ttco);
   class_t db = NULL;
+  class_t cl;
+  struct event ev;
+
+  if (co->rule ? !rule_match(co->rule, we) : class_compare(co, we) != 0)
+    return false;
+
+  /* Dont attempt to book on a class we are already booked on */
+  if (we->booked)
+    return false;
+
+  pthread_mutex_lock(&run->lock);
+  LIST_FOREACH(cl, &run->booked, l) {
+    if (cl->id == we->id)
+      break;
+  }
+  pthread_mutex_unlock(&run->lock);
+  if (cl)
+    return false;
+
+  /* Dont attempt to book on a class we previously cancelled */
+  if ((db = database_get(we->id))) {
+    ELOG(INFO, "%s already in the database", class_print(we));
+    event_begin(&ev, we, run->requested, run->received, run->parsed);
+    event_mark(&ev, EVENT_MATCH);
+    event_emit(&ev, "known");
+    class_destroy(db);
+    free(db);
+    return false;
+  }
+
+  return true;
+}
+
+
+/* The first config entry that wants the timetable entry. Entries at a
+ * minute no rule covers are passed over on the mask alone */
+static class_t booking_match(
+    struct booking_run *run,
+    class_t we)
+{
+  class_t co;
+
+  if (!rule_mask_test(run->minutes, we))
+    return NULL;
+
+  LIST_FOREACH(co, &run->wanted, l) {
+    if (booking_wanted(run, co, we))
+      return co;
+  }
+  return NULL;
+}
+
+
+/* Arms a booking for every wanted class already in the timetable, waits
+ * for the release then fires them. Anything not booked is left to the
+ * pass that follows */
+static void booking_fire(
+    struct booking_run *run)
+{
+  website_shot_t shots[BOOKINGS_ARM_MAX] = {0};
+  class_t armed[BOOKINGS_ARM_MAX] = {0};
+  struct event evs[BOOKINGS_ARM_MAX];
+  bool ok[BOOKINGS_ARM_MAX] = {0};
+  timetable_t tt = timetable_get(run->location, run->ndays);
+  class_list_t ttwe = tt ? timetable_classes(tt) : NULL;
+  struct website_timing timing = {0};
+  ev_tstamp lead, sent;
   class_t we;
-  bool commit = false;
+  int i, n = 0, over = 0, booked;
+
+  release_window_enter();
+
+  if (ttwe) {
+    timetable_times(tt, &run->requested, &run->received, &run->parsed);
+    LIST_FOREACH(we, ttwe, l) {
+      if (!booking_match(run, we))
+        continue;
+      if (n == BOOKINGS_ARM_MAX) {
+        over++;
+        continue;
+      }
+
+      event_begin(&evs[n], we, run->requested, run->received, run->parsed);
+      event_mark(&evs[n], EVENT_MATCH);
+
+      /* Pricing is setup work too, get it out of the way */
+      if (website_price(we) > 0.) {
+        event_mark(&evs[n], EVENT_PRICE);
+        event_emit(&evs[n], "priced");
+        continue;
+      }
+      event_mark(&evs[n], EVENT_PRICE);
+
+      if (!(armed[n] = class_dup(we)))
+        continue;
+      if (!(shots[n] = website_arm(armed[n]))) {
+        class_destroy(armed[n]);
+        free(armed[n]);
+        continue;
+      }
+      n++;
+    }
+  }
+  if (tt)
+    timetable_put(tt);
+
+  if (n)
+    website_warm(n);
+  ELOG(VERBOSE, "Armed %d bookings for release", n);
+  if (over)
+    ELOG(WARNING, "%d more released classes than the %d that can be armed, "
+         "they are booked by the pass after the release", over,
+         BOOKINGS_ARM_MAX);
+
+  /* Nothing armed means the fetch after is what needs to be on time */
+  lead = n ? release_lead() : 0.;
+  release_wait(run->fire_at - lead);
+  sent = ev_time();
+  booked = website_fire(shots, n, ok, &timing);
+
+  for (i=0; i < n; i++) {
+    if (ok[i]) {
+      ELOG(INFO, "%s has been booked", class_print(armed[i]));
+      event_mark(&evs[i], EVENT_BOOK);
+      booking_event(run, &evs[i], "booked");
+      pthread_mutex_lock(&run->lock);
+      LIST_INSERT_HEAD(&run->booked, armed[i], l);
+      pthread_mutex_unlock(&run->lock);
+    }
+    else {
+      ELOG(INFO, "%s could not be booked on release", class_print(armed[i]));
+      event_mark(&evs[i], EVENT_BOOK);
+      event_emit(&evs[i], "missed");
+      class_destroy(armed[i]);
+      free(armed[i]);
+    }
+    website_disarm(shots[i]);
+  }
+  release_window_leave();
+
+  if (n)
+    release_outcome(LIST_FIRST(&run->wanted)->class_name, run->fire_at, sent,
+                    &timing, booked, n);
+
+  /* Anything else needs to be seen as it is now */
+  timetable_invalidate();
+}
+
+
+/* Runs on the accounts shard. Matches the timetable against the config
+ * and queues a task for every class that needs booking */
+static void booking_pass(
+    offload_job_t job,
+    void *data)
+{
+  struct booking_run *run = data;
+  timetable_t tt = NULL;
+  class_list_t ttwe = NULL;
+  class_t we, cl;
+
+  /* Hold off until the exact moment it is released */
+  if (run->fire_at > 0.)
+    booking_fire(run);
+
+  tt = timetable_get(run->location, run->ndays);
+  ttwe = tt ? timetable_classes(tt) : NULL;
+  if (!ttwe)
+    return;
+  run->fetched = true;
+  timetable_times(tt, &run->requested, &run->received, &run->parsed);
+
+  /* Match each website timetable entry against the config, once each so
+   * overlapping rules never book the same class twice */
+  LIST_FOREACH(we, ttwe, l) {
+    if (!booking_match(run, we))
+      continue;
+
+    if (!(cl = class_dup(we)))
+      continue;
+
+    booking_queue(job, run, cl);
+  }
+
+  timetable_put(tt);
+}
+
+
+/* Hands a copy of the class to any shard to book, cl is consumed */
+static void booking_queue(
+    offload_job_t job,
+    struct booking_run *run,
+    class_t cl)
+{
+  struct booking_task *task;
+
+  task = calloc(1, sizeof(struct booking_task));
+  if (!task) {
+    ELOGERR(ERROR, "Cannot allocate booking task");
+    exit(EXIT_FAILURE);
+  }
+  task->run = run;
+  task->cl = cl;
+  task->queued = ev_time();
+  event_begin(&task->ev, cl, run->requested, run->received, run->parsed);
+  task->ev.at[EVENT_MATCH] = task->queued;
+  run->ntasks++;
+  offload_fork(job, booking_task, task);
+}
+
+
+/* Keeps a booking's event until we know if the basket was committed */
+static void booking_event(
+    struct booking_run *run,
+    struct event *ev,
+    const char *decision)
+{
+  struct event *cp = event_copy(ev, decision);
+  if (!cp)
+    return;
+
+  pthread_mutex_lock(&run->lock);
+  STAILQ_INSERT_TAIL(&run->events, cp, l);
+  pthread_mutex_unlock(&run->lock);
+}
+
+
+/* Runs on whichever shard picked it up. Prices and books one class */
+static void booking_task(
+    offload_job_t job,
+    void *data)
+{
+  struct booking_task *task = data;
+  struct booking_run *run = task->run;
+  class_t we = task->cl;
+  class_list_t result = NULL;
+  ev_tstamp started = ev_time();
+  ev_tstamp wait, took;
+  bool dirty = false;
+  float price;
+
+  /* Dont book items that cost money */
+  price = website_price(we);
+  event_mark(&task->ev, EVENT_PRICE);
+  if (price > 0.) {
+    ELOG(INFO, "%s has a price. Not booking", class_print(we));
+    event_emit(&task->ev, "priced");
+  }
+  /* If no slots are available */
+  else if (we->slots_available <= 0) {
+    /* And not on the waiting list */
+    if (!we->waiting) {
+      website_wait(we);
+      event_mark(&task->ev, EVENT_BOOK);
+      dirty = true;
+      ELOG(INFO, "%s is full. Put onto waiting list and will attempt to rebook",
+             class_print(we));
+    }
+    event_emit(&task->ev, we->waiting ? "waiting" : "waitlisted");
+    result = &run->waiting;
+  }
+  else {
+    /* Book the class, the db is updated once we have committed */
+    if (!website_book(we)) {
+      ELOG(INFO, "%s could not be booked: %s", class_print(we), website_errbuf());
+      event_mark(&task->ev, EVENT_BOOK);
+      event_emit(&task->ev, "failed");
+    }
+    else {
+      ELOG(INFO, "%s has been booked", class_print(we));
+      event_mark(&task->ev, EVENT_BOOK);
+      booking_event(run, &task->ev, "booked");
+      result = &run->booked;
+    }
+  }
+
+  took = ev_time() - started;
+  wait = started - task->queued;
+  ELOG(VERBOSE, "%s task waited %.3f ran %.3f seconds on shard %d",
+       class_print(we), wait, took, shards_self());
+
+  pthread_mutex_lock(&run->lock);
+  if (result) {
+    LIST_INSERT_HEAD(result, we, l);
+    we = NULL;
+  }
+  if (dirty)
+    run->dirty = true;
+  if (shards_self() != run->home)
+    run->nstolen++;
+  if (wait > run->max_wait)
+    run->max_wait = wait;
+  if (took > run->max_run)
+    run->max_run = took;
+  pthread_mutex_unlock(&run->lock);
+
+  if (we) {
+    class_destroy(we);
+    free(we);
+  }
+
+  free(task);
+}
+
+
+static void booking_commit(
+    offload_job_t job,
+    void *data)
+{
+  struct booking_run *run = data;
+  run->committed = website_commit();
+  run->committed_at = ev_time();
+}
+
+
+/* Runs on the default loop once every task of the pass is done */
+static void booking_matched(
+    EV_P_ void *data)
+{
+  struct booking_run *run = data;
+
+  STALL_TAG();
+
+  if (LIST_EMPTY(&run->booked)) {
+    booking_done(EV_A_ run);
+    return;
+  }
+
+  run->dirty = true;
+  offload(run->home, booking_commit, booking_done, run);
+}
+
 
-  if (!ttwe) {
+/* A targeted pass leaves the rest of the wait queue and the retry
+ * timer alone, a full pass will pick up anything it missed */
+static void booking_release_done(
+    EV_P_ void *data)
+{
+  struct booking_run *run = data;
+  class_t cl;
+
+  event_flush(&run->events, run->committed ? run->committed_at : 0.);
+
+  if (!run->fetched) {
+    ELOG(ERROR, "Unable to get timetable for released class");
+    goto fin;
+  }
+
+  if (!database_start())
+    goto fin;
+
+  LIST_FOREACH(cl, &run->waiting, l) {
+    if (waitq_add(cl)) {
+      ELOG(INFO, "%s is scheduled to rebook on the waiting list",
+           class_print(cl));
+    }
+  }
+
+  if (run->committed) {
+    LIST_FOREACH(cl, &run->booked, l)
+      database_add(cl);
+    database_commit();
+  }
+  else {
+    database_rollback();
+  }
+
+  if (run->dirty)
+    timetable_invalidate();
+
+fin:
+  booking_run_free(run);
+}
+
+
+/* Runs on the default loop once the pass is committed */
+static void booking_done(
+    EV_P_ void *data)
+{
+  static int bookings_retry_counter = 0;
+  struct booking_run *run = data;
+  class_t cl;
+
+  STALL_TAG();
+
+  /* The pass is over, so its request timings can go to the database */
+  website_save_timings(RELEASE_SAMPLES);
+
+  if (!run->full) {
+    booking_release_done(EV_A_ run);
+    booking_next();
+    return;
+  }
+
+  event_flush(&run->events, run->committed ? run->committed_at : 0.);
+
+  if (!run->fetched) {
     ELOG(ERROR, "Unable to get timetable");
     /* Retry the timetable every BOOKINGS_RETRY seconds until this eventually works */
     bookings_retry_counter++;
@@ -70,92 +614,132 @@ void bookings_check(
       ELOG(CRITICAL, "Failed to get timetable %d times. Giving up. Exiting!", bookings_retry_counter);
       exit(EXIT_FAILURE);
     }
-    return; 
+    goto fin;
   }
 
   /* We got there eventually. Reset the counter and periodic timer */
   stop_rebooker();
 
-  if (!ttco)
-    return;
+  ELOG(VERBOSE, "Booking pass ran %d tasks, %d stolen. Longest wait %.3f, "
+                "longest run %.3f seconds", run->ntasks, run->nstolen,
+                run->max_wait, run->max_run);
 
   if (!database_start())
-    return;
+    goto fin;
 
   /* Suspend and flush the wait queue at this point */
   waitq_flush();
 
-  /* Loop over each config entry */
-  while (co) {
-    we = LIST_FIRST(ttwe);
-
-    /* Loop over each website timetable entry */
-    while (we) {
-      if (class_compare(co, we) == 0) {
-        /* Dont attempt to book on a class we are already booked on */
-        if (we->booked) {
-          goto next;
-        }
-
-        /* Dont attempt to book on a class we previously cancelled */
-        if ((db = database_get(we->id))) {
-          ELOG(INFO, "%s already in the database", class_print(we));
-          class_destroy(db);
-          free(db);
-          db = NULL;
-          goto next;
-        }
-
-        /* Dont book items that cost money */
-        if (website_price(we) > 0.) {
-          ELOG(INFO, "%s has a price. Not booking", class_print(we));
-          goto next;
-        }
-
-        /* If no slots are available */
-        if (we->slots_available <= 0) {
-          /* And not on the waiting list */
-          if (!we->waiting) {
-            website_wait(we);
-            ELOG(INFO, "%s is full. Put onto waiting list and will attempt to rebook", 
-                   class_print(we));
-          }
-          if (waitq_add(we)) {
-            ELOG(INFO, "%s is scheduled to rebook on the waiting list", 
-                 class_print(we));
-          }
-        }
-        else {
-          /* Book the class and update the db */
-          if (!website_book(we)) {
-            ELOG(INFO, "%s could not be booked: %s", class_print(we), website_errbuf());
-          }
-          else {
-            commit = true;
-            database_add(we);
-            ELOG(INFO, "%s has been booked", class_print(we));
-          }
-        }
-      }
-    next:
-      we = LIST_NEXT(we, l);
+  LIST_FOREACH(cl, &run->waiting, l) {
+    if (waitq_add(cl)) {
+      ELOG(INFO, "%s is scheduled to rebook on the waiting list",
+           class_print(cl));
     }
-    co = LIST_NEXT(co, l);
   }
 
-  class_free_timetable(ttwe);
-  free(ttwe);
-
-  if (commit) {
-    if (!website_commit()) {
-      database_rollback();
-    }
-    else {
-      database_commit();
-    }
+  if (run->committed) {
+    LIST_FOREACH(cl, &run->booked, l)
+      database_add(cl);
+    database_commit();
   }
   else {
-    database_rollback();    
+    database_rollback();
+  }
+
+  /* Our booked/waiting state on the website has changed */
+  if (run->dirty)
+    timetable_invalidate();
+
+fin:
+  booking_run_free(run);
+  booking_next();
+}
+
+
+/* Only one pass is out at a time. A targeted one starts from a fresh
+ * timetable, whatever we have cached predates the release */
+static void booking_start(
+    struct booking_run *run)
+{
+  running = true;
+  if (!run->full)
+    timetable_invalidate();
+
+  run->home = shards_for_key(config_get_login());
+  offload(run->home, booking_pass, booking_matched, run);
+}
+
+
+/* Starts whatever was asked for whilst the last pass ran, released
+ * classes before a full pass as they are up against the clock */
+static void booking_next(
+    void)
+{
+  struct booking_run *run;
+
+  running = false;
+
+  if ((run = STAILQ_FIRST(&queued))) {
+    STAILQ_REMOVE_HEAD(&queued, q);
+    booking_start(run);
+  }
+  /* Someone asked for a check whilst we were busy */
+  else if (recheck) {
+    recheck = false;
+    bookings_check();
   }
 }
 
+
+void bookings_check(
+    void)
+{
+  struct booking_run *run = NULL;
+
+  /* Only one pass at a time, but dont lose the request */
+  if (running) {
+    ELOG(VERBOSE, "Booking pass already running. Will recheck afterwards");
+    recheck = true;
+    return;
+  }
+
+  run = booking_run_new(NULL, 0);
+  if (!run)
+    return;
+
+  booking_start(run);
+}
+
+
+/* Book just this config entry, such as the moment it is released. If at
+ * is given the pass waits for that instant on its shard */
+void bookings_check_class(
+    class_t cl,
+    double at)
+{
+  bookings_check_classes(&cl, 1, at);
+}
+
+
+/* As bookings_check_class for several entries in one pass, so classes
+ * released together are armed and fired together */
+void bookings_check_classes(
+    class_t *cls,
+    int n,
+    double at)
+{
+  struct booking_run *run = booking_run_new(cls, n);
+  if (!run)
+    return;
+
+  run->fire_at = at;
+
+  if (running) {
+    ELOG(VERBOSE, "Booking pass already running. Released classes go "
+                  "afterwards");
+    STAILQ_INSERT_TAIL(&queued, run, q);
+    return;
+  }
+
+  booking_start(run);
+}
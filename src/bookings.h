@@ -1,5 +1,9 @@
 #ifndef _BOOKINGS_H_
 #define _BOOKINGS_H_
 
+#include "class.h"
+
 void bookings_check(void);
+void bookings_check_class(class_t cl, double at);
+void bookings_check_classes(class_t *cls, int n, double at);
 #endif
@@ -1,10 +1,11 @@
 #include "common.h"
 #include "class.h"
 #include "logging.h"
+#include "rule.h"
 
 LOGSET("class");
 
-static char classbuf[1024];
+static __thread char classbuf[1024];
 
 void class_init(
      class_t cl)
@@ -28,6 +29,8 @@ void class_destroy(
 
   if (cl->class_name)
     free(cl->class_name);
+
+  rule_unref(cl->rule);
 }
 
 void class_free_timetable(
@@ -105,6 +108,7 @@ class_t class_dup(
   cl->booked = in->booked;
   cl->waiting = in->waiting;
   memcpy(&cl->time, &in->time, sizeof(struct tm));
+  cl->rule = rule_ref(in->rule);
 
   return cl;
 }
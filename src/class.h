@@ -4,6 +4,8 @@
 typedef struct class * class_t;
 typedef struct class class;
 
+struct rule;
+
 LIST_HEAD(class_list, class);
 
 typedef struct class_list * class_list_t;
@@ -19,6 +21,7 @@ struct class {
   bool booked;
   bool waiting;
   struct tm time;
+  struct rule *rule;
   LIST_ENTRY(class) l;
 };
 
@@ -3,16 +3,26 @@
 #include "iniparser.h"
 #include "config.h"
 #include "class.h"
+#include "rule.h"
 #include "database.h"
 #include "website.h"
 #include "logging.h"
 #include "periodic.h"
+#include "release.h"
+#include "bookings.h"
+#include "quiet.h"
+#include "stall.h"
+#include "events.h"
+#include "metrics.h"
+#include "control.h"
 #include <pwd.h>
 #include <grp.h>
 #include <ev.h>
 #include <sys/inotify.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
+#include <dirent.h>
 
 LOGSET("config");
 
@@ -22,10 +32,24 @@ LOGSET("config");
 #define DEFAULT_DB_PATH          "/var/lib/abbeybooker/bookings.db"
 #define DEFAULT_MAX_DAYS         8
 #define DEFAULT_COOKIES          ""
+#define DEFAULT_BASE_URL         "https://abbeycroft.legendonlineservices.co.uk"
 #define DEFAULT_WAITLIST_TIMEOUT 50 
 #define DEFAULT_VERBOSE          0
 #define DEFAULT_WAKETIME         "00:00:05"
 #define DEFAULT_LOGFILE          "stderr"
+#define DEFAULT_EVENT_LOG        ""
+#define DEFAULT_METRICS          ""
+#define DEFAULT_CONTROL          ""
+#define DEFAULT_SHARDS           0
+#define DEFAULT_RELEASE_DAYS     0
+#define DEFAULT_PRECISE_RELEASE  1
+#define DEFAULT_FIRE_MARGIN      20
+#define DEFAULT_RELEASE_WINDOW   0
+#define DEFAULT_RELEASE_CPU      -1
+#define DEFAULT_QUIET_PERIOD     30
+#define DEFAULT_STALL_WARNING    500
+#define DEFAULT_RELOAD_SETTLE    500
+#define DEFAULT_LOG_REPEAT       600
 
 struct config {
   char *path;
@@ -34,29 +58,139 @@ struct config {
   char *login;
   char *pass;
   char *cookies;
+  char *base_url;
   char *logfile;
+  char *event_log;
+  char *metrics;
+  char *control;
   int max_days;
+  int release_days;
+  int precise_release;
+  int fire_margin;
+  int release_window;
+  int release_cpu;
+  int quiet_period;
+  int stall_warning;
+  int reload_settle;
+  int log_repeat;
   int num_classes;
   int waitlist_retry_timeout;
   int verbose;
+  int shards;
   struct class_list *classes;
   struct tm waketime;
   int ifd;
-  int wd[2];
+  int wd[3];
   ev_io io;
+  ev_timer settle;
 } config = {0};
 
+/* A file the config is read from, the main file or a fragment in the
+ * confdir, with what it looked like when last parsed */
+struct source {
+  char *path;
+  dictionary *ini;
+  off_t size;
+  struct timespec mtime;
+  uint64_t hash;
+  TAILQ_ENTRY(source) l;
+};
+
+TAILQ_HEAD(source_list, source);
+
+enum source_state {
+  SOURCE_SAME,
+  SOURCE_CHANGED,
+  SOURCE_BUSY,
+  SOURCE_GONE,
+  SOURCE_ERROR,
+};
+
+static struct source *mainsrc = NULL;
+static struct source_list fragments = TAILQ_HEAD_INITIALIZER(fragments);
+static char *confdir = NULL;
+static bool sources_changed = false;
+
+/* Class sections added over the control socket, kept until restart and
+ * merged into every config built after the files are read */
+static struct class_list intents = LIST_HEAD_INITIALIZER(intents);
+
+/* What has to be redone when a setting changes on reload. Anything
+ * else is read afresh by whoever needs it */
+#define RELOAD_DATABASE  0x01
+#define RELOAD_WEBSITE   0x02
+#define RELOAD_PERIODIC  0x04
+#define RELOAD_RELEASE   0x08
+#define RELOAD_LOGFILE   0x10
+#define RELOAD_RESTART   0x20
+#define RELOAD_LOGLEVEL  0x40
+#define RELOAD_CHANGED   0x80
+#define RELOAD_EVENTLOG  0x100
+#define RELOAD_METRICS   0x200
+#define RELOAD_CONTROL   0x400
+
+enum key_type { KEY_STR, KEY_INT, KEY_TIME };
+
+struct main_key {
+  const char *name;
+  size_t off;
+  enum key_type type;
+  int reload;
+};
+
+#define MAIN_KEY(n, f, t, r) { n, offsetof(struct config, f), t, r }
+
+static const struct main_key main_keys[] = {
+  MAIN_KEY("db_path", db_path, KEY_STR, RELOAD_DATABASE),
+  MAIN_KEY("location", location, KEY_STR, RELOAD_WEBSITE),
+  MAIN_KEY("cookies", cookies, KEY_STR, RELOAD_WEBSITE),
+  MAIN_KEY("base_url", base_url, KEY_STR, RELOAD_RESTART),
+  MAIN_KEY("logfile", logfile, KEY_STR, RELOAD_LOGFILE),
+  MAIN_KEY("event_log", event_log, KEY_STR, RELOAD_EVENTLOG),
+  MAIN_KEY("metrics", metrics, KEY_STR, RELOAD_METRICS),
+  MAIN_KEY("control", control, KEY_STR, RELOAD_CONTROL),
+  MAIN_KEY("waketime", waketime, KEY_TIME, RELOAD_PERIODIC),
+  MAIN_KEY("login", login, KEY_STR, RELOAD_WEBSITE),
+  MAIN_KEY("password", pass, KEY_STR, RELOAD_WEBSITE),
+  MAIN_KEY("max_days", max_days, KEY_INT, 0),
+  MAIN_KEY("waiting_list_retry_timeout", waitlist_retry_timeout, KEY_INT, 0),
+  MAIN_KEY("verbose", verbose, KEY_INT, RELOAD_LOGLEVEL),
+  MAIN_KEY("shards", shards, KEY_INT, RELOAD_RESTART),
+  MAIN_KEY("release_days", release_days, KEY_INT, RELOAD_RELEASE),
+  MAIN_KEY("precise_release", precise_release, KEY_INT, 0),
+  MAIN_KEY("fire_margin", fire_margin, KEY_INT, 0),
+  MAIN_KEY("release_window", release_window, KEY_INT, 0),
+  MAIN_KEY("release_cpu", release_cpu, KEY_INT, 0),
+  MAIN_KEY("quiet_period", quiet_period, KEY_INT, 0),
+  MAIN_KEY("stall_warning", stall_warning, KEY_INT, 0),
+  MAIN_KEY("reload_settle", reload_settle, KEY_INT, 0),
+  MAIN_KEY("log_repeat", log_repeat, KEY_INT, RELOAD_LOGLEVEL),
+};
+
 static char keybuf[512];
 
 static char * mk(char *section, char *key);
 static void load_defaults(struct config *config);
 static void switch_error_log(char *filename);
-static int dayofweek(char *dow);
 static bool parse_main(struct config *config, dictionary *d);
 static bool parse_class(struct config *conf, dictionary *d, char *secname);
 static void update_config(struct config *new);
+static int diff_main(struct config *old, struct config *new);
+static int diff_classes(struct config *old, struct config *new, class_t *fresh);
+static struct source * source_new(const char *path);
+static void source_free(struct source *src);
+static enum source_state source_check(struct source *src, ev_tstamp settle);
+static int fragment_filter(const struct dirent *de);
+static bool scan_sources(ev_tstamp settle, bool *busy);
+static void drop_class(struct config *conf, const char *section);
+static bool config_remove_intent(const char *section);
+static bool build_config(struct config *newconf);
 static bool reread_config(void);
+static bool apply_config(void);
 static void config_changed_event(EV_P_ ev_io *w, int revents);
+static void settle_start(void);
+static void config_settled_event(EV_P_ ev_timer *w, int revents);
+static void watch_confdir(void);
 static void monitor_config_file(const char *config_path);
 
 static void load_defaults(
@@ -72,17 +206,36 @@ static void load_defaults(
   config->login = NULL;
   config->pass = NULL;
   config->logfile = strdup(DEFAULT_LOGFILE);
+  config->event_log = strdup(DEFAULT_EVENT_LOG);
+  config->metrics = strdup(DEFAULT_METRICS);
+  config->control = strdup(DEFAULT_CONTROL);
   config->cookies = strdup(DEFAULT_COOKIES);
+  config->base_url = strdup(DEFAULT_BASE_URL);
   config->waitlist_retry_timeout = DEFAULT_WAITLIST_TIMEOUT;
   config->verbose = DEFAULT_VERBOSE;
+  config->shards = DEFAULT_SHARDS;
+  config->release_days = DEFAULT_RELEASE_DAYS;
+  config->precise_release = DEFAULT_PRECISE_RELEASE;
+  config->fire_margin = DEFAULT_FIRE_MARGIN;
+  config->release_window = DEFAULT_RELEASE_WINDOW;
+  config->release_cpu = DEFAULT_RELEASE_CPU;
+  config->quiet_period = DEFAULT_QUIET_PERIOD;
+  config->stall_warning = DEFAULT_STALL_WARNING;
+  config->reload_settle = DEFAULT_RELOAD_SETTLE;
+  config->log_repeat = DEFAULT_LOG_REPEAT;
   config->ifd = -1;
   config->wd[0] = -1;
   config->wd[1] = -1;
+  config->wd[2] = -1;
 
   assert(config->db_path);
   assert(config->location);
   assert(config->cookies);
+  assert(config->base_url);
   assert(config->logfile);
+  assert(config->event_log);
+  assert(config->metrics);
+  assert(config->control);
 
   p = strptime(DEFAULT_WAKETIME, "%H:%M:%S", &config->waketime);
   assert(p && *p == 0);
@@ -104,6 +257,7 @@ static void switch_error_log(
      char *filename)
 {
   ELOG(INFO, "Switching to logfile %s", filename);
+  log_flush();
   if (!freopen(filename, "a+", stderr)) {
     ELOGERR(CRITICAL, "Cannot switch log file to %s", filename);
   }
@@ -114,43 +268,6 @@ static void switch_error_log(
 }
 
 
-static int dayofweek(
-    char *dow)
-{
-  int i, l;
-  char dayofweek[512] = {0};
-  l = strlen(dow);
-
-  if (l > 32 || l < 3)
-    return -1;
-
-  for (i=0; i < 3; i++)
-    dayofweek[i] = tolower(dow[i]);
-
-  if (strcmp(dayofweek, "sun") == 0)
-    return 0;
-
-  else if (strcmp(dayofweek, "mon") == 0)
-    return 1;
-
-  else if (strcmp(dayofweek, "tue") == 0)
-    return 2;
-
-  else if (strcmp(dayofweek, "wed") == 0)
-    return 3;
-
-  else if (strcmp(dayofweek, "thu") == 0)
-    return 4;
-
-  else if (strcmp(dayofweek, "fri") == 0)
-    return 5;
-
-  else if (strcmp(dayofweek, "sat") == 0)
-    return 6;
-
-  return -1;
-}
-
 static bool parse_main(
     struct config *config,
     dictionary *d)
@@ -192,6 +309,17 @@ static bool parse_main(
     val = NULL;
   }
 
+  val = iniparser_getstring(d, mk("main", "base_url"), NULL);
+  if (val) {
+    free(config->base_url);
+    config->base_url = strdup(val);
+    if (!config->base_url) {
+      ELOG(ERROR, "Cannot set \"base_url\" in [main]");
+      return false;
+    }
+    val = NULL;
+  }
+
   val = iniparser_getstring(d, mk("main", "logfile"), NULL);
   if (val) {
     free(config->logfile);
@@ -203,6 +331,44 @@ static bool parse_main(
     val = NULL;
   }
 
+  val = iniparser_getstring(d, mk("main", "event_log"), NULL);
+  if (val) {
+    free(config->event_log);
+    config->event_log = strdup(val);
+    if (!config->event_log) {
+      ELOG(ERROR, "Cannot set \"event_log\" in [main]");
+      return false;
+    }
+    val = NULL;
+  }
+
+  val = iniparser_getstring(d, mk("main", "metrics"), NULL);
+  if (val) {
+    free(config->metrics);
+    config->metrics = strdup(val);
+    if (!config->metrics) {
+      ELOG(ERROR, "Cannot set \"metrics\" in [main]");
+      return false;
+    }
+    val = NULL;
+  }
+
+  val = iniparser_getstring(d, mk("main", "control"), NULL);
+  if (val) {
+    free(config->control);
+    config->control = strdup(val);
+    if (!config->control) {
+      ELOG(ERROR, "Cannot set \"control\" in [main]");
+      return false;
+    }
+    /* Anyone who can reach a TCP port could run commands */
+    if (*val && *val != '/') {
+      ELOG(ERROR, "\"control\" field in [main] must be a unix socket path");
+      return false;
+    }
+    val = NULL;
+  }
+
   val = iniparser_getstring(d, mk("main", "waketime"), NULL);
   if (val) {
     p = strptime(val, "%H:%M:%S", &config->waketime);
@@ -214,26 +380,55 @@ static bool parse_main(
     val = NULL;
   }
 
-  config->login = iniparser_getstring(d, mk("main", "login"), NULL);
-  config->pass = iniparser_getstring(d, mk("main", "password"), NULL);
-
-  if (!config->login) {
-    ELOG(ERROR, "\"login\" field in [main] was not found");
-    return false;
+  /* The login may live in a fragment of its own, so we only check it
+   * is there once every file has been read */
+  val = iniparser_getstring(d, mk("main", "login"), NULL);
+  if (val) {
+    free(config->login);
+    config->login = strdup(val);
+    if (!config->login) {
+      ELOG(ERROR, "Cannot set \"login\" in [main]");
+      return false;
+    }
+    val = NULL;
   }
 
-  if (!config->pass) {
-    ELOG(ERROR, "\"password\" field in [main] was not found");
-    return false;
+  val = iniparser_getstring(d, mk("main", "password"), NULL);
+  if (val) {
+    free(config->pass);
+    config->pass = strdup(val);
+    if (!config->pass) {
+      ELOG(ERROR, "Cannot set \"password\" in [main]");
+      return false;
+    }
+    val = NULL;
   }
 
-  config->pass = strdup(config->pass);
-  config->login = strdup(config->login);
-  config->max_days = iniparser_getint(d, mk("main", "max_days"), DEFAULT_MAX_DAYS);
+  /* Anything not given keeps the value from earlier files */
+  config->max_days = iniparser_getint(d, mk("main", "max_days"), config->max_days);
   config->waitlist_retry_timeout = 
                     iniparser_getint(d, mk("main", "waiting_list_retry_timeout"), 
-                                                        DEFAULT_WAITLIST_TIMEOUT);
-  config->verbose = iniparser_getint(d, mk("main", "verbose"), DEFAULT_VERBOSE);
+                                                        config->waitlist_retry_timeout);
+  config->verbose = iniparser_getint(d, mk("main", "verbose"), config->verbose);
+  config->shards = iniparser_getint(d, mk("main", "shards"), config->shards);
+  config->release_days = iniparser_getint(d, mk("main", "release_days"),
+                                                        config->release_days);
+  config->precise_release = iniparser_getboolean(d, mk("main", "precise_release"),
+                                                        config->precise_release);
+  config->fire_margin = iniparser_getint(d, mk("main", "fire_margin"),
+                                                        config->fire_margin);
+  config->release_window = iniparser_getboolean(d, mk("main", "release_window"),
+                                                        config->release_window);
+  config->release_cpu = iniparser_getint(d, mk("main", "release_cpu"),
+                                                        config->release_cpu);
+  config->quiet_period = iniparser_getint(d, mk("main", "quiet_period"),
+                                                        config->quiet_period);
+  config->stall_warning = iniparser_getint(d, mk("main", "stall_warning"),
+                                                        config->stall_warning);
+  config->reload_settle = iniparser_getint(d, mk("main", "reload_settle"),
+                                                        config->reload_settle);
+  config->log_repeat = iniparser_getint(d, mk("main", "log_repeat"),
+                                                        config->log_repeat);
 
   return true;
 }
@@ -243,9 +438,9 @@ static bool parse_class(
     dictionary *d,
     char *secname)
 {
-  char *p;
-  struct tm tmp = {0};
-  char *tstr = NULL;
+  int i = 0;
+  char *p, *key, *val;
+  char *name = NULL, *day = NULL, *when = NULL, *location = NULL;
   class_t cl = calloc(1, sizeof(struct class));
   if (!cl) {
     ELOG(ERROR, "Cannot make class for section [%s]", secname);
@@ -260,48 +455,34 @@ static bool parse_class(
     return false;
   }
 
-  /* Class name */
-  tstr = iniparser_getstring(d, mk(secname, "name"), NULL);
-  if (!tstr) {
-    ELOG(ERROR, "Cannot create class name for section [%s]", secname);
-    return false;
+  /* Pick out the keys we know in one walk of the section */
+  while ((key = iniparser_iterkey(d, secname, &i, &val))) {
+    p = key + strlen(secname) + 1;
+    if (strcmp(p, "name") == 0)
+      name = val;
+    else if (strcmp(p, "day") == 0)
+      day = val;
+    else if (strcmp(p, "time") == 0)
+      when = val;
+    else if (strcmp(p, "location") == 0)
+      location = val;
+    else
+      ELOG(WARNING, "Ignoring unknown key \"%s\" in section [%s]", p, secname);
   }
 
-  cl->class_name = strdup(tstr);
-  if (!cl->class_name) {
-    ELOG(ERROR, "Cannot create class name for section [%s]", secname);
-    return false;
-  }
-  tstr = NULL;
-
-  /* Get day of week */
-  tstr = iniparser_getstring(d, mk(secname, "day"), NULL);
-  if (!tstr) {
-    ELOG(ERROR, "Incorrect day of week defined in section [%s]", secname);
+  /* Compile the name, day and time patterns into a rule */
+  cl->rule = rule_compile(secname, name, day, when, location);
+  if (!cl->rule)
     return false;
-  }
 
-  cl->time.tm_wday = dayofweek(tstr);
-  if (cl->time.tm_wday < 0) {
-    ELOG(ERROR, "Incorrect day of week defined in section [%s]", secname);
+  cl->class_name = strdup(name);
+  if (!cl->class_name) {
+    ELOG(ERROR, "Cannot create class name for section [%s]", secname);
     return false;
   }
-  tstr = NULL;
 
-  /* Get the time of day */
-  tstr = iniparser_getstring(d, mk(secname, "time"), NULL);
-  if (!tstr) {
-    ELOG(ERROR, "Incorrect time defined in section [%s]", secname);
-    return false;
-  }
-
-  p = strptime(tstr, "%H:%M", &tmp);
-  if (!p || *p != 0) {
-    ELOG(ERROR, "Incorrect time defined in section [%s]", secname);
-    return false;
-  }
-  cl->time.tm_min = tmp.tm_min;
-  cl->time.tm_hour = tmp.tm_hour;
+  /* Releases are timed from the first minute the rule covers */
+  rule_first(cl->rule, &cl->time);
 
   /* Append to head of queue */
   LIST_INSERT_HEAD(conf->classes, cl, l);
@@ -310,6 +491,7 @@ static bool parse_class(
   return true;
 }
 
+
 static void update_config(
     struct config *new)
 {
@@ -320,7 +502,11 @@ static void update_config(
   free(config.login);
   free(config.pass);
   free(config.cookies);
+  free(config.base_url);
   free(config.logfile);
+  free(config.event_log);
+  free(config.metrics);
+  free(config.control);
   class_free_timetable(config.classes);
 
   config.path = new->path;
@@ -329,86 +515,571 @@ static void update_config(
   config.login = new->login;
   config.pass = new->pass;
   config.cookies = new->cookies;
+  config.base_url = new->base_url;
   config.logfile = new->logfile;
+  config.event_log = new->event_log;
+  config.metrics = new->metrics;
+  config.control = new->control;
   config.max_days = new->max_days;
   config.num_classes = new->num_classes;
   config.waitlist_retry_timeout = new->waitlist_retry_timeout;
   config.verbose = new->verbose;
+  config.shards = new->shards;
+  config.release_days = new->release_days;
+  config.precise_release = new->precise_release;
+  config.fire_margin = new->fire_margin;
+  config.release_window = new->release_window;
+  config.release_cpu = new->release_cpu;
+  config.quiet_period = new->quiet_period;
+  config.stall_warning = new->stall_warning;
+  config.reload_settle = new->reload_settle;
+  config.log_repeat = new->log_repeat;
   config.classes = new->classes;
 
   memcpy(&config.waketime, &new->waketime, sizeof(struct tm));
 }
 
-static bool reread_config(
-    void)
+/* Which [main] keys differ, as the RELOAD_ flags they need plus
+ * RELOAD_CHANGED if any do */
+static int diff_main(
+    struct config *old,
+    struct config *new)
 {
-  int i, nsecs;
-  char *section = NULL;
-  dictionary *ini = NULL;
-  struct config newconf = {0};
+  int i, reload = 0;
+  const struct main_key *k;
+  char *a, *b;
+  struct tm *ta, *tb;
+  bool same;
+
+  for (i=0; i < sizeof(main_keys) / sizeof(main_keys[0]); i++) {
+    k = &main_keys[i];
+
+    switch (k->type) {
+    case KEY_STR:
+      a = *(char **)((char *)old + k->off);
+      b = *(char **)((char *)new + k->off);
+      same = (a == b) || (a && b && strcmp(a, b) == 0);
+      break;
+
+    case KEY_INT:
+      same = *(int *)((char *)old + k->off) == *(int *)((char *)new + k->off);
+      break;
+
+    case KEY_TIME:
+      ta = (struct tm *)((char *)old + k->off);
+      tb = (struct tm *)((char *)new + k->off);
+      same = ta->tm_hour == tb->tm_hour && ta->tm_min == tb->tm_min &&
+             ta->tm_sec == tb->tm_sec;
+      break;
+
+    default:
+      same = true;
+      break;
+    }
 
-  newconf.classes = calloc(1, sizeof(struct class_list));
-  if (!newconf.classes) {
-    ELOG(ERROR, "Cannot allocate memory for class list");
-    goto fail;
+    if (same)
+      continue;
+
+    ELOG(VERBOSE, "Setting \"%s\" in [main] has changed", k->name);
+    reload |= k->reload | RELOAD_CHANGED;
+  }
+
+  return reload;
+}
+
+
+/* Compare class sections by name. New and altered classes are put in
+ * fresh, returning RELOAD_RELEASE if any section came, went or changed */
+static int diff_classes(
+    struct config *old,
+    struct config *new,
+    class_t *fresh)
+{
+  int n = 0, matched = 0;
+  class_t co, cn;
+
+  LIST_FOREACH(cn, new->classes, l) {
+    LIST_FOREACH(co, old->classes, l) {
+      if (strcmp(co->entry_name, cn->entry_name) == 0)
+        break;
+    }
+
+    if (co)
+      matched++;
+    if (co && class_compare(co, cn) == 0 && rule_equal(co->rule, cn->rule))
+      continue;
+
+    ELOG(INFO, "Class section [%s] is %s", cn->entry_name,
+         co ? "changed" : "new");
+    fresh[n++] = cn;
+  }
+
+  if (matched < old->num_classes)
+    ELOG(INFO, "%d class sections removed", old->num_classes - matched);
+
+  if (n == 0 && matched == old->num_classes)
+    return 0;
+
+  return RELOAD_RELEASE;
+}
+
+
+static struct source * source_new(
+    const char *path)
+{
+  struct source *src = calloc(1, sizeof(struct source));
+  if (!src) {
+    ELOGERR(ERROR, "Cannot allocate config source");
+    return NULL;
+  }
+
+  src->path = strdup(path);
+  if (!src->path) {
+    ELOGERR(ERROR, "Cannot allocate config source");
+    free(src);
+    return NULL;
+  }
+  return src;
+}
+
+
+static void source_free(
+    struct source *src)
+{
+  if (!src)
+    return;
+  iniparser_freedict(src->ini);
+  free(src->path);
+  free(src);
+}
+
+
+/* Reparse a source only if it has really changed. A file whose size and
+ * mtime are as we last saw it is taken as is, one modified within the
+ * settle time is still being written, and one that has been touched but
+ * hashes the same is left alone */
+static enum source_state source_check(
+    struct source *src,
+    ev_tstamp settle)
+{
+  struct stat st;
+  dictionary *ini;
+  uint64_t hash = 14695981039346656037ull;
+  unsigned char buf[4096];
+  ssize_t i, len;
+  int fd;
+
+  if (stat(src->path, &st) < 0) {
+    if (errno == ENOENT)
+      return SOURCE_GONE;
+    ELOGERR(ERROR, "Cannot read config file %s", src->path);
+    return SOURCE_ERROR;
+  }
+
+  if (src->ini && st.st_size == src->size &&
+      st.st_mtim.tv_sec == src->mtime.tv_sec &&
+      st.st_mtim.tv_nsec == src->mtime.tv_nsec)
+    return SOURCE_SAME;
+
+  if (ev_time() - (st.st_mtim.tv_sec + st.st_mtim.tv_nsec / 1e9) < settle)
+    return SOURCE_BUSY;
+
+  /* FNV-1a over the whole file. It is read rather than mapped, a file
+   * cut short under a mapping would fault */
+  fd = open(src->path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0) {
+    ELOGERR(ERROR, "Cannot read config file %s", src->path);
+    return SOURCE_ERROR;
+  }
+  while ((len = read(fd, buf, sizeof(buf))) != 0) {
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len < 0) {
+      ELOGERR(ERROR, "Cannot read config file %s", src->path);
+      close(fd);
+      return SOURCE_ERROR;
+    }
+    for (i=0; i < len; i++) {
+      hash ^= buf[i];
+      hash *= 1099511628211ull;
+    }
+  }
+  close(fd);
+
+  src->size = st.st_size;
+  src->mtime = st.st_mtim;
+  if (src->ini && hash == src->hash) {
+    ELOG(VERBOSE, "Config file %s was touched but is unchanged", src->path);
+    return SOURCE_SAME;
   }
-  LIST_INIT(newconf.classes);
 
-  assert(config.path);
-  /* Load the INI file */
-  ini = iniparser_load(config.path);
+  ini = iniparser_load(src->path);
   if (!ini) {
-    ELOG(ERROR, "INI file parsing error");
-    goto fail;
+    ELOG(ERROR, "INI file parsing error in %s", src->path);
+    /* Make sure we look at it again next time */
+    src->size = -1;
+    return SOURCE_ERROR;
+  }
+
+  ELOG(VERBOSE, "Read config file %s", src->path);
+  iniparser_freedict(src->ini);
+  src->ini = ini;
+  src->hash = hash;
+  return SOURCE_CHANGED;
+}
+
+
+/* Fragments are visible files named *.ini or *.conf */
+static int fragment_filter(
+    const struct dirent *de)
+{
+  const char *ext = strrchr(de->d_name, '.');
+
+  if (de->d_name[0] == '.' || !ext)
+    return 0;
+  return strcmp(ext, ".ini") == 0 || strcmp(ext, ".conf") == 0;
+}
+
+
+/* Bring every source up to date, noting in sources_changed whether any
+ * of them differ from what the running config was built from. The
+ * confdir is named in the main file, fragments are read in name order */
+static bool scan_sources(
+    ev_tstamp settle,
+    bool *busy)
+{
+  struct source_list old;
+  struct source *src;
+  struct dirent **names = NULL;
+  char path[PATH_MAX];
+  char *dir;
+  int i, n = 0;
+  bool ok = true;
+
+  *busy = false;
+
+  switch (source_check(mainsrc, settle)) {
+  case SOURCE_CHANGED:
+    sources_changed = true;
+    break;
+  case SOURCE_BUSY:
+    *busy = true;
+    break;
+  case SOURCE_GONE:
+    ELOG(ERROR, "Config file %s has gone", mainsrc->path);
+    return false;
+  case SOURCE_ERROR:
+    return false;
+  default:
+    break;
+  }
+
+  if (!mainsrc->ini)
+    return false;
+
+  dir = iniparser_getstring(mainsrc->ini, mk("main", "confdir"), NULL);
+  if ((dir == NULL) != (confdir == NULL) ||
+      (dir && strcmp(dir, confdir) != 0)) {
+    free(confdir);
+    confdir = dir ? strdup(dir) : NULL;
+    sources_changed = true;
+    watch_confdir();
+  }
+
+  if (confdir) {
+    n = scandir(confdir, &names, fragment_filter, alphasort);
+    if (n < 0) {
+      ELOGERR(WARNING, "Cannot read config directory %s", confdir);
+      n = 0;
+    }
+  }
+
+  /* Rebuild the fragment list in name order, keeping what we have */
+  TAILQ_INIT(&old);
+  TAILQ_CONCAT(&old, &fragments, l);
+
+  for (i=0; i < n; i++) {
+    snprintf(path, sizeof(path), "%s/%s", confdir, names[i]->d_name);
+    free(names[i]);
+
+    TAILQ_FOREACH(src, &old, l) {
+      if (strcmp(src->path, path) == 0)
+        break;
+    }
+    if (src)
+      TAILQ_REMOVE(&old, src, l);
+    else if (!(src = source_new(path)))
+      continue;
+
+    switch (source_check(src, settle)) {
+    case SOURCE_CHANGED:
+      sources_changed = true;
+      break;
+    case SOURCE_BUSY:
+      *busy = true;
+      break;
+    case SOURCE_ERROR:
+      ok = false;
+      break;
+    case SOURCE_GONE:
+      source_free(src);
+      sources_changed = true;
+      continue;
+    default:
+      break;
+    }
+
+    /* Not yet readable, leave it out until it is */
+    if (!src->ini) {
+      source_free(src);
+      continue;
+    }
+    TAILQ_INSERT_TAIL(&fragments, src, l);
+  }
+  free(names);
+
+  while ((src = TAILQ_FIRST(&old))) {
+    ELOG(INFO, "Config fragment %s has gone", src->path);
+    TAILQ_REMOVE(&old, src, l);
+    source_free(src);
+    sources_changed = true;
+  }
+
+  return ok;
+}
+
+
+/* Make a config from the main file overlaid by each fragment in turn */
+static void drop_class(
+    struct config *conf,
+    const char *section)
+{
+  class_t cl;
+
+  LIST_FOREACH(cl, conf->classes, l) {
+    if (strcmp(cl->entry_name, section) == 0)
+      break;
+  }
+  if (!cl)
+    return;
+
+  LIST_REMOVE(cl, l);
+  class_destroy(cl);
+  free(cl);
+  conf->num_classes--;
+}
+
+
+static bool config_remove_intent(
+    const char *section)
+{
+  class_t cl;
+
+  LIST_FOREACH(cl, &intents, l) {
+    if (strcasecmp(cl->entry_name, section) == 0)
+      break;
+  }
+  if (!cl)
+    return false;
+
+  LIST_REMOVE(cl, l);
+  class_destroy(cl);
+  free(cl);
+  return true;
+}
+
+
+static bool build_config(
+    struct config *newconf)
+{
+  int i;
+  char *section;
+  struct source *src;
+  dictionary *seen;
+  class_t cl, in;
+
+  newconf->classes = calloc(1, sizeof(struct class_list));
+  if (!newconf->classes) {
+    ELOG(ERROR, "Cannot allocate memory for class list");
+    return false;
+  }
+  LIST_INIT(newconf->classes);
+
+  /* Keys missing from every file revert to their defaults */
+  load_defaults(newconf);
+
+  newconf->path = strdup(mainsrc->path);
+  if (!newconf->path) {
+    ELOG(ERROR, "Cannot set config path in config object");
+    return false;
   }
 
-  if ((nsecs = iniparser_getnsec(ini)) < 1) {
+  if (iniparser_getnsec(mainsrc->ini) < 1) {
     ELOG(ERROR, "Config file contains no [main] section. Aborting.");
-    goto fail;
+    return false;
+  }
+
+  /* Which file each class section came from */
+  seen = dictionary_new(0);
+  if (!seen) {
+    ELOG(ERROR, "Cannot allocate memory for class list");
+    return false;
   }
 
-  for (i=0; i < nsecs; i++) {
-    section = iniparser_getsecname(ini, i);
-    if (strcmp(section, "main") == 0) {
-      if (!parse_main(&newconf, ini))
+  for (src = mainsrc; src; src = (src == mainsrc) ? TAILQ_FIRST(&fragments)
+                                                  : TAILQ_NEXT(src, l)) {
+    i = 0;
+    while ((section = iniparser_itersec(src->ini, &i))) {
+      if (strcmp(section, "main") == 0) {
+        if (!parse_main(newconf, src->ini))
+          goto fail;
+        continue;
+      }
+
+      /* A later file wins over an earlier one */
+      if (dictionary_get(seen, section, NULL)) {
+        ELOG(WARNING, "Section [%s] in %s replaces the one in %s", section,
+             src->path, dictionary_get(seen, section, NULL));
+        drop_class(newconf, section);
+      }
+      dictionary_set(seen, section, src->path);
+
+      if (!parse_class(newconf, src->ini, section))
         goto fail;
     }
-    else {
-      if (!parse_class(&newconf, ini, section))
-        goto fail;
+  }
+
+  /* Then whatever was added over the control socket */
+  LIST_FOREACH(in, &intents, l) {
+    if (dictionary_get(seen, in->entry_name, NULL)) {
+      ELOG(WARNING, "Section [%s] added over the control socket replaces "
+           "the one in %s", in->entry_name,
+           dictionary_get(seen, in->entry_name, NULL));
+      drop_class(newconf, in->entry_name);
     }
+
+    cl = class_dup(in);
+    if (!cl)
+      goto fail;
+    LIST_INSERT_HEAD(newconf->classes, cl, l);
+    newconf->num_classes++;
   }
+  dictionary_del(seen);
 
-  newconf.path = strdup(config.path);
-  if (!newconf.path) {
-    ELOG(ERROR, "Cannot set config path in config object");
+  if (!newconf->login) {
+    ELOG(ERROR, "\"login\" field in [main] was not found");
+    return false;
+  }
+
+  if (!newconf->pass) {
+    ELOG(ERROR, "\"password\" field in [main] was not found");
+    return false;
+  }
+
+  return true;
+
+fail:
+  dictionary_del(seen);
+  return false;
+}
+
+
+static bool reread_config(
+    void)
+{
+  bool busy;
+
+  assert(mainsrc);
+  if (!scan_sources(config.reload_settle / 1000., &busy))
+    return false;
+
+  /* Someone is still writing, come back once they have finished */
+  if (busy) {
+    ELOG(VERBOSE, "Config is still being written, waiting for it to settle");
+    settle_start();
+    return true;
+  }
+
+  if (!sources_changed) {
+    ELOG(INFO, "Configuration is unchanged");
+    return true;
+  }
+
+  return apply_config();
+}
+
+
+/* Build a config from the sources as last read and switch to it, redoing
+ * only what changed */
+static bool apply_config(
+    void)
+{
+  int i = 0, nfresh = 0, reload;
+  class_t *fresh = NULL;
+  struct config newconf = {0};
+
+  if (!build_config(&newconf))
+    goto fail;
+
+  /* Work out what changed whilst we still have the old config */
+  fresh = calloc(newconf.num_classes + 1, sizeof(class_t));
+  if (!fresh) {
+    ELOGERR(ERROR, "Cannot allocate class list");
     goto fail;
   }
 
+  reload = diff_main(&config, &newconf);
+  reload |= diff_classes(&config, &newconf, fresh);
+  for (nfresh=0; fresh[nfresh]; nfresh++);
+
   /* Overwrite old config */
   update_config(&newconf);
 
-  /* Do post steps */
-  if (strcmp(config.logfile, "stderr") != 0) {
+  /* Only redo what depends on what changed */
+  if (reload & RELOAD_LOGFILE && strcmp(config.logfile, "stderr") != 0)
     switch_error_log(config.logfile);
+
+  if (reload & RELOAD_LOGLEVEL) {
+    log_setlevel(config.verbose ? VERBOSE : INFO);
+    log_setrepeat(config.log_repeat);
   }
 
-  if (config.verbose)
-    log_setlevel(VERBOSE);
-  else
-    log_setlevel(INFO);
+  if (reload & RELOAD_EVENTLOG)
+    events_open(config.event_log);
+
+  if (reload & RELOAD_METRICS)
+    metrics_listen(config.metrics);
+
+  if (reload & RELOAD_CONTROL)
+    control_listen(config.control);
+
+  if (reload & RELOAD_DATABASE) {
+    database_destroy();
+    database_init();
+  }
+
+  if (reload & RELOAD_WEBSITE)
+    website_update_config();
 
-  /* Fix the database */
-  database_destroy();
-  database_init();
+  /* Resetting the wake time reschedules releases too */
+  if (reload & RELOAD_PERIODIC)
+    periodic_reset();
+  else if (reload & RELOAD_RELEASE)
+    release_reset();
 
-  /* Fix the cookie path */
-  website_update_config();
+  if (reload & RELOAD_RESTART)
+    ELOG(WARNING, "Changing shards or base_url takes effect on restart");
 
-  /* Reset the periodic wake time */
-  periodic_reset();
+  if (!reload && !nfresh)
+    ELOG(INFO, "Configuration is unchanged");
 
-  iniparser_freedict(ini);
+  /* Give new and altered classes their chance now rather than waiting
+   * for the next wake up */
+  for (i=0; i < nfresh; i++)
+    bookings_check_class(fresh[i], 0);
+
+  free(fresh);
+  sources_changed = false;
   return true;
 
 fail:
@@ -424,10 +1095,21 @@ fail:
     free(newconf.pass);
   if (newconf.cookies)
     free(newconf.cookies);
+  if (newconf.base_url)
+    free(newconf.base_url);
   if (newconf.logfile)
     free(newconf.logfile);
-  class_free_timetable(newconf.classes);
-  iniparser_freedict(ini);
+  if (newconf.event_log)
+    free(newconf.event_log);
+  if (newconf.metrics)
+    free(newconf.metrics);
+  if (newconf.control)
+    free(newconf.control);
+  if (newconf.classes) {
+    class_free_timetable(newconf.classes);
+    free(newconf.classes);
+  }
+  free(fresh);
   return false;
 }
 
@@ -444,6 +1126,8 @@ static void config_changed(
   int rc;
   bool reread_conf = false;
 
+  STALL_TAG();
+
   strncpy(bn, config.path, 4096);
   base = basename(bn);
 
@@ -457,6 +1141,17 @@ static void config_changed(
   while (len < rc) {
     len += sizeof(struct inotify_event) + ev->len;
 
+    /* Anything happening in the confdir, the scan sorts out what */
+    if (ev->wd == config.wd[2]) {
+      ELOG(VERBOSE, "Reading Inotify event %#x in config directory (%s)",
+                    ev->mask, ev->len ? ev->name : "");
+      if (ev->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_IGNORED))
+        config.wd[2] = -1;
+      reread_conf = true;
+      ev = (struct inotify_event *)(buf + len);
+      continue;
+    }
+
     if (ev->mask & IN_CREATE) {
       ELOG(VERBOSE, "Reading Inotify CREATE for file watcher %d (%s want: %s)",
                     ev->wd, ev->name, base);
@@ -523,11 +1218,58 @@ static void config_changed(
     ev = (struct inotify_event *)(buf + len);
   }
 
-  if (reread_conf) {
-    ELOG(INFO, "Detected configuration file change. Re-reading configuration");
-    if (!reread_config())
-      ELOG(ERROR, "Configuration file error. Config not applied");
-  }
+  /* Editors and config tools write in bursts, wait for it to go quiet */
+  if (reread_conf)
+    settle_start();
+}
+
+
+/* (Re)start the wait for the config files to stop changing */
+static void settle_start(
+    void)
+{
+  config.settle.repeat = config.reload_settle > 0 ?
+                         config.reload_settle / 1000. : 0.001;
+  ev_timer_again(EV_DEFAULT, &config.settle);
+}
+
+
+static void config_settled_event(
+    EV_P_ ev_timer *w,
+    int revents)
+{
+  STALL_TAG();
+
+  ev_timer_stop(EV_A_ w);
+  if (quiet_defer("config reload", config_reload))
+    return;
+  ELOG(INFO, "Detected configuration file change. Re-reading configuration");
+  if (!reread_config())
+    ELOG(ERROR, "Configuration file error. Config not applied");
+}
+
+
+/* Follow the confdir named in the main file, if there is one */
+static void watch_confdir(
+    void)
+{
+  if (config.ifd < 0)
+    return;
+
+  if (config.wd[2] > -1)
+    inotify_rm_watch(config.ifd, config.wd[2]);
+  config.wd[2] = -1;
+
+  if (!confdir)
+    return;
+
+  config.wd[2] = inotify_add_watch(config.ifd, confdir,
+                     IN_CREATE|IN_DELETE|IN_MODIFY|IN_CLOSE_WRITE|IN_MOVED_TO|
+                     IN_MOVED_FROM|IN_DELETE_SELF|IN_MOVE_SELF);
+  if (config.wd[2] < 0)
+    ELOGERR(WARNING, "Cannot monitor config directory %s", confdir);
+  else
+    ELOG(VERBOSE, "Monitoring config directory %s", confdir);
 }
 
 static void monitor_config_file(
@@ -563,53 +1305,35 @@ static void monitor_config_file(
     err(EXIT_FAILURE, "Cannot add monitor to file %s", config_path);  
   ELOG(VERBOSE, "Monitoring config file %s", config_path);
 
+  watch_confdir();
+
   /* Setup event handler */
   ev_io_init(&config.io, config_changed, config.ifd, EV_READ);
+  ev_set_priority(&config.io, EV_MINPRI);
   ev_io_start(EV_DEFAULT, &config.io);
+
+  ev_init(&config.settle, config_settled_event);
+  ev_set_priority(&config.settle, EV_MINPRI);
 }
 
 void config_parse(
     const char *path)
 {
-  int i, nsecs;
-  char *section = NULL;
-  dictionary *ini = NULL;
+  bool busy;
   struct config newconf = {0};
 
-  newconf.classes = calloc(1, sizeof(struct class_list));
-  if (!newconf.classes)
-    err(EXIT_FAILURE, "Cannot allocate memory for class list");
-  LIST_INIT(newconf.classes);
-
-  load_defaults(&newconf);
-
-  /* Load the INI file */
-  ini = iniparser_load(path);
-  if (!ini)
-    exit(EXIT_FAILURE);
-
   config.path = strdup(path);
   if (!config.path)
     err(EXIT_FAILURE, "Invalid config file path");
 
-  newconf.path = strdup(path);
-  if (!newconf.path)
-    err(EXIT_FAILURE, "Invalid config file path");
-
-  if ((nsecs = iniparser_getnsec(ini)) < 1)
-    err(EXIT_FAILURE, "Config file contains no [main] section. Aborting.");
+  /* Load the INI files */
+  mainsrc = source_new(path);
+  if (!mainsrc || !scan_sources(0., &busy))
+    exit(EXIT_FAILURE);
 
-  for (i=0; i < nsecs; i++) {
-    section = iniparser_getsecname(ini, i);
-    if (strcmp(section, "main") == 0) {
-      if (!parse_main(&newconf, ini))
-        exit(EXIT_FAILURE);
-    }
-    else {
-      if (!parse_class(&newconf, ini, section))
-        exit(EXIT_FAILURE);
-    }
-  }
+  if (!build_config(&newconf))
+    exit(EXIT_FAILURE);
+  sources_changed = false;
 
   update_config(&newconf);
 
@@ -622,8 +1346,8 @@ void config_parse(
     log_setlevel(VERBOSE);
   else
     log_setlevel(INFO);
+  log_setrepeat(config.log_repeat);
 
-  iniparser_freedict(ini);
   monitor_config_file(path);
   return;
 }
@@ -670,6 +1394,13 @@ char * config_get_cookies(
   return config.cookies;
 }
 
+/* Where the site is, website.c takes it once at start */
+char * config_get_base_url(
+    void)
+{
+  return config.base_url;
+}
+
 class_list_t config_get_classes(
     void)
 {
@@ -688,6 +1419,77 @@ int config_get_verbose(
   return config.verbose;
 }
 
+int config_get_shards(
+    void)
+{
+  return config.shards;
+}
+
+int config_get_release_days(
+    void)
+{
+  return config.release_days;
+}
+
+int config_get_precise_release(
+    void)
+{
+  return config.precise_release;
+}
+
+/* Milliseconds */
+int config_get_fire_margin(
+    void)
+{
+  return config.fire_margin;
+}
+
+int config_get_release_window(
+    void)
+{
+  return config.release_window;
+}
+
+int config_get_release_cpu(
+    void)
+{
+  return config.release_cpu;
+}
+
+int config_get_quiet_period(
+    void)
+{
+  return config.quiet_period;
+}
+
+/* Empty when no event log is kept */
+char * config_get_event_log(
+    void)
+{
+  return config.event_log;
+}
+
+/* A unix socket path or [host:]port, empty when not serving metrics */
+char * config_get_metrics(
+    void)
+{
+  return config.metrics;
+}
+
+/* A unix socket path, empty when there is no control socket */
+char * config_get_control(
+    void)
+{
+  return config.control;
+}
+
+/* Milliseconds */
+int config_get_stall_warning(
+    void)
+{
+  return config.stall_warning;
+}
+
 struct tm * config_get_waketime(
     void)
 {
@@ -718,6 +1520,7 @@ void config_unload(
     void)
 {
   int i;
+  struct source *src;
 
   if (config.path)
     free(config.path);
@@ -731,16 +1534,35 @@ void config_unload(
     free(config.pass);
   if (config.cookies)
     free(config.cookies);
+  if (config.base_url)
+    free(config.base_url);
   if (config.logfile)
     free(config.logfile);
+  if (config.event_log)
+    free(config.event_log);
+  if (config.metrics)
+    free(config.metrics);
+  if (config.control)
+    free(config.control);
 
   if (config.classes) {
     class_free_timetable(config.classes);
     free(config.classes);
   }
 
+  source_free(mainsrc);
+  mainsrc = NULL;
+  while ((src = TAILQ_FIRST(&fragments))) {
+    TAILQ_REMOVE(&fragments, src, l);
+    source_free(src);
+  }
+  free(confdir);
+  confdir = NULL;
+  class_free_timetable(&intents);
+
+  ev_timer_stop(EV_DEFAULT, &config.settle);
   ev_io_stop(EV_DEFAULT, &config.io);
-  for (i=0; i < 2; i++) {
+  for (i=0; i < 3; i++) {
     if (config.wd[i] > -1)
       inotify_rm_watch(config.ifd, config.wd[i]);
   }
@@ -751,6 +1573,7 @@ void config_unload(
   config.ifd = -1;
   config.wd[0] = -1;
   config.wd[1] = -1;
+  config.wd[2] = -1;
 
   ELOG(VERBOSE, "Config unloaded");
 }
@@ -760,3 +1583,110 @@ void config_reload(
 {
   reread_config();
 }
+
+
+/* Add or replace a class section that lasts until restart, as though it
+ * came from a file read after all the others. Like a reload only what it
+ * changes is redone, and only it is checked for a booking */
+bool config_add_class(
+    const char *section,
+    const char *name,
+    const char *day,
+    const char *when,
+    const char *location)
+{
+  struct class_list list = LIST_HEAD_INITIALIZER(list);
+  struct config tmp = {0};
+  char secname[256];
+  dictionary *d;
+  class_t cl, old;
+  bool ok = false;
+  int i;
+
+  /* Sections read from files are lower cased, so these are too */
+  for (i=0; section[i] && i < (int)sizeof(secname) - 1; i++)
+    secname[i] = tolower(section[i]);
+  secname[i] = 0;
+  if (!*secname || strchr(secname, ':'))
+    return false;
+
+  d = dictionary_new(0);
+  if (!d) {
+    ELOG(ERROR, "Cannot allocate class section [%s]", secname);
+    return false;
+  }
+
+  iniparser_set(d, secname, NULL);
+  if (name)
+    iniparser_set(d, mk(secname, "name"), name);
+  if (day)
+    iniparser_set(d, mk(secname, "day"), day);
+  if (when)
+    iniparser_set(d, mk(secname, "time"), when);
+  if (location)
+    iniparser_set(d, mk(secname, "location"), location);
+
+  tmp.classes = &list;
+  if (!parse_class(&tmp, d, secname))
+    goto fin;
+
+  /* Set aside any section it replaces until the new one is in use */
+  LIST_FOREACH(old, &intents, l) {
+    if (strcasecmp(old->entry_name, secname) == 0)
+      break;
+  }
+  if (old)
+    LIST_REMOVE(old, l);
+
+  cl = LIST_FIRST(&list);
+  LIST_REMOVE(cl, l);
+  LIST_INSERT_HEAD(&intents, cl, l);
+
+  ok = apply_config();
+  if (!ok) {
+    ELOG(ERROR, "Class section [%s] could not be added", secname);
+    LIST_REMOVE(cl, l);
+    LIST_INSERT_HEAD(&list, cl, l);
+    if (old)
+      LIST_INSERT_HEAD(&intents, old, l);
+    goto fin;
+  }
+
+  ELOG(INFO, "Class section [%s] added over the control socket", secname);
+  if (old) {
+    class_destroy(old);
+    free(old);
+  }
+
+fin:
+  class_free_timetable(&list);
+  dictionary_del(d);
+  return ok;
+}
+
+
+/* Forget a section added over the control socket, false if there was no
+ * such section */
+bool config_remove_class(
+    const char *section)
+{
+  if (!config_remove_intent(section))
+    return false;
+
+  ELOG(INFO, "Class section [%s] removed over the control socket", section);
+  return apply_config();
+}
+
+
+/* The class section of this name in the config in use */
+class_t config_find_class(
+    const char *section)
+{
+  class_t cl;
+
+  LIST_FOREACH(cl, config.classes, l) {
+    if (strcasecmp(cl->entry_name, section) == 0)
+      return cl;
+  }
+  return NULL;
+}
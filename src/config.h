@@ -5,6 +5,10 @@
 void config_parse(const char *conf);
 void config_unload(void);
 void config_reload(void);
+bool config_add_class(const char *section, const char *name, const char *day,
+                      const char *when, const char *location);
+bool config_remove_class(const char *section);
+class_t config_find_class(const char *section);
 
 char * config_get_login(void);
 char * config_get_password(void);
@@ -12,7 +16,19 @@ char * config_get_db_path(void);
 char * config_get_location(void);
 int config_get_max_days(void);
 char * config_get_cookies(void);
+char * config_get_base_url(void);
+char * config_get_event_log(void);
+char * config_get_metrics(void);
+char * config_get_control(void);
 int config_get_waitlist_timeout(void);
+int config_get_shards(void);
+int config_get_release_days(void);
+int config_get_precise_release(void);
+int config_get_fire_margin(void);
+int config_get_release_window(void);
+int config_get_release_cpu(void);
+int config_get_quiet_period(void);
+int config_get_stall_warning(void);
 
 int config_get_num_classes(void);
 class_list_t config_get_classes(void);
@@ -0,0 +1,320 @@
+#include "common.h"
+#include "config.h"
+#include "class.h"
+#include "logging.h"
+#include "bookings.h"
+#include "periodic.h"
+#include "release.h"
+#include "quiet.h"
+#include "shards.h"
+#include "waitq.h"
+#include "website.h"
+#include "listener.h"
+#include "control.h"
+
+LOGSET("control");
+
+#define CONTROL_ARGS 16
+
+/* Commands on a local socket, one per line, each answered with any
+ * output and then "ok" or "error: why". Each does only the work it
+ * needs, unlike the signals which recheck or reread everything.
+ * Arguments with spaces in them are quoted */
+struct command {
+  const char *name;
+  const char *usage;
+  int minargs;
+  void (*fn)(client_t c, int argc, char **argv);
+};
+
+static listener_t listener = NULL;
+
+static int control_split(char *line, char **argv);
+static void control_time(client_t c, const char *what, ev_tstamp at);
+static void cmd_help(client_t c, int argc, char **argv);
+static void cmd_recheck(client_t c, int argc, char **argv);
+static void cmd_add(client_t c, int argc, char **argv);
+static void cmd_remove(client_t c, int argc, char **argv);
+static void waitq_line(class_t cl, void *data);
+static void cmd_waitq(client_t c, int argc, char **argv);
+static void cmd_status(client_t c, int argc, char **argv);
+static void cmd_quit(client_t c, int argc, char **argv);
+static void control_request(client_t c, char *line, void *data);
+
+static const struct command commands[] = {
+  { "help", "help", 0, cmd_help },
+  { "recheck", "recheck [section]", 0, cmd_recheck },
+  { "add", "add section name=... day=... time=... [location=...]", 1,
+    cmd_add },
+  { "remove", "remove section", 1, cmd_remove },
+  { "waitq", "waitq", 0, cmd_waitq },
+  { "status", "status", 0, cmd_status },
+  { "quit", "quit", 0, cmd_quit },
+};
+#define NCOMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+
+
+/* Split in place on spaces, double quotes keep spaces in a word and can
+ * start part way through one as in name="Gym Session" */
+static int control_split(
+    char *line,
+    char **argv)
+{
+  char *in = line, *out;
+  bool quoted;
+  int argc = 0;
+
+  while (*in) {
+    while (isspace(*in))
+      in++;
+    if (!*in)
+      break;
+    if (argc == CONTROL_ARGS)
+      return -1;
+
+    argv[argc++] = out = in;
+    quoted = false;
+    while (*in && (quoted || !isspace(*in))) {
+      if (*in == '"')
+        quoted = !quoted;
+      else
+        *out++ = *in;
+      in++;
+    }
+    if (quoted)
+      return -1;
+    if (*in)
+      in++;
+    *out = 0;
+  }
+  return argc;
+}
+
+
+static void control_time(
+    client_t c,
+    const char *what,
+    ev_tstamp at)
+{
+  char buf[64];
+  struct tm tm;
+  time_t t = at;
+
+  if (at <= 0.) {
+    client_printf(c, "%s -\n", what);
+    return;
+  }
+  localtime_r(&t, &tm);
+  strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+  client_printf(c, "%s %s\n", what, buf);
+}
+
+
+static void cmd_help(
+    client_t c,
+    int argc,
+    char **argv)
+{
+  size_t i;
+
+  for (i=0; i < NCOMMANDS; i++)
+    client_printf(c, "%s\n", commands[i].usage);
+  client_printf(c, "ok\n");
+}
+
+
+/* One section is checked on its own, without a section everything is */
+static void cmd_recheck(
+    client_t c,
+    int argc,
+    char **argv)
+{
+  class_t cl;
+
+  if (argc < 2) {
+    ELOG(INFO, "Rechecking bookings for the control socket");
+    bookings_check();
+    client_printf(c, "ok\n");
+    return;
+  }
+
+  cl = config_find_class(argv[1]);
+  if (!cl) {
+    client_printf(c, "error: no class section [%s]\n", argv[1]);
+    return;
+  }
+
+  ELOG(INFO, "Rechecking [%s] for the control socket", cl->entry_name);
+  bookings_check_class(cl, 0);
+  client_printf(c, "ok\n");
+}
+
+
+static void cmd_add(
+    client_t c,
+    int argc,
+    char **argv)
+{
+  const char *name = NULL, *day = NULL, *when = NULL, *location = NULL;
+  char *eq;
+  int i;
+
+  for (i=2; i < argc; i++) {
+    eq = strchr(argv[i], '=');
+    if (!eq) {
+      client_printf(c, "error: expected key=value, not %s\n", argv[i]);
+      return;
+    }
+    *eq++ = 0;
+
+    if (strcmp(argv[i], "name") == 0)
+      name = eq;
+    else if (strcmp(argv[i], "day") == 0)
+      day = eq;
+    else if (strcmp(argv[i], "time") == 0)
+      when = eq;
+    else if (strcmp(argv[i], "location") == 0)
+      location = eq;
+    else {
+      client_printf(c, "error: unknown key %s\n", argv[i]);
+      return;
+    }
+  }
+
+  if (!config_add_class(argv[1], name, day, when, location)) {
+    client_printf(c, "error: cannot add [%s], see the log\n", argv[1]);
+    return;
+  }
+  client_printf(c, "ok\n");
+}
+
+
+static void cmd_remove(
+    client_t c,
+    int argc,
+    char **argv)
+{
+  if (!config_remove_class(argv[1])) {
+    client_printf(c, "error: [%s] was not added over the control socket\n",
+                  argv[1]);
+    return;
+  }
+  client_printf(c, "ok\n");
+}
+
+
+static void waitq_line(
+    class_t cl,
+    void *data)
+{
+  client_printf(data, "%d %s\n", cl->id, class_print(cl));
+}
+
+
+static void cmd_waitq(
+    client_t c,
+    int argc,
+    char **argv)
+{
+  waitq_foreach(waitq_line, c);
+  client_printf(c, "ok\n");
+}
+
+
+/* There is one account, the one the config logs in with */
+static void cmd_status(
+    client_t c,
+    int argc,
+    char **argv)
+{
+  client_printf(c, "account %s\n", config_get_login());
+  client_printf(c, "shard %d of %d\n", shards_for_key(config_get_login()),
+                shards_count());
+  client_printf(c, "classes %d\n", config_get_num_classes());
+  client_printf(c, "waiting %d\n", waitq_size());
+  control_time(c, "next_wake", periodic_next_at());
+  control_time(c, "next_release", release_next_at());
+  client_printf(c, "clock_offset %d\n", website_clock_skew());
+  client_printf(c, "quiet %s\n", quiet_now() ? "yes" : "no");
+  client_printf(c, "ok\n");
+}
+
+
+static void cmd_quit(
+    client_t c,
+    int argc,
+    char **argv)
+{
+  client_printf(c, "ok\n");
+  client_end(c);
+}
+
+
+static void control_request(
+    client_t c,
+    char *line,
+    void *data)
+{
+  char *argv[CONTROL_ARGS];
+  int argc;
+  size_t i;
+
+  argc = control_split(line, argv);
+  if (argc == 0)
+    return;
+  if (argc < 0) {
+    client_printf(c, "error: cannot read command\n");
+    return;
+  }
+
+  for (i=0; i < NCOMMANDS; i++) {
+    if (strcasecmp(argv[0], commands[i].name) == 0)
+      break;
+  }
+  if (i == NCOMMANDS) {
+    client_printf(c, "error: unknown command %s, try help\n", argv[0]);
+    return;
+  }
+  if (argc - 1 < commands[i].minargs) {
+    client_printf(c, "error: usage is %s\n", commands[i].usage);
+    return;
+  }
+
+  ELOG(VERBOSE, "Control command %s", argv[0]);
+  commands[i].fn(c, argc, argv);
+}
+
+
+
+void control_init(
+    void)
+{
+  control_listen(config_get_control());
+}
+
+
+/* Serve on another address, an empty one closes the socket */
+void control_listen(
+    const char *addr)
+{
+  listener_close(listener);
+  listener = NULL;
+
+  if (!addr || !*addr)
+    return;
+
+  if (*addr != '/') {
+    ELOG(ERROR, "Control socket %s is not a unix socket path", addr);
+    return;
+  }
+  listener = listener_open("control", addr, control_request, NULL);
+}
+
+
+void control_destroy(
+    void)
+{
+  listener_close(listener);
+  listener = NULL;
+}
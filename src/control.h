@@ -0,0 +1,7 @@
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+void control_init(void);
+void control_listen(const char *addr);
+void control_destroy(void);
+#endif
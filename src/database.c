@@ -2,6 +2,9 @@
 #include "config.h"
 #include "class.h"
 #include "logging.h"
+#include "metrics.h"
+#include "database.h"
+#include <ev.h>
 #include <sqlite3.h>
 
 #define DB_START    "BEGIN"
@@ -9,17 +12,40 @@
 #define DB_COMMIT   "COMMIT"
 #define DB_GET      "SELECT bookingid, name, date FROM BOOKINGS WHERE bookingid = ?" 
 #define DB_ADD      "INSERT INTO bookings (username, bookingid, name, date, booked, slots) VALUES (?, ?, ?, ?, ?, ?)"
-
+#define DB_LATENCY_TABLE "CREATE TABLE IF NOT EXISTS latency (endpoint text, at int, connect int, pretransfer int, ttfb int, total int)"
+#define DB_LATENCY_ADD   "INSERT INTO latency (endpoint, at, connect, pretransfer, ttfb, total) VALUES (?, ?, ?, ?, ?, ?)"
+#define DB_LATENCY_GET   "SELECT pretransfer, ttfb FROM latency WHERE endpoint = ? ORDER BY at DESC LIMIT ?"
+#define DB_LATENCY_INDEX "CREATE INDEX IF NOT EXISTS latency_endpoint_at ON latency (endpoint, at)"
+#define DB_LATENCY_TRIM  "DELETE FROM latency WHERE endpoint = ?1 AND rowid NOT IN (SELECT rowid FROM latency WHERE endpoint = ?1 ORDER BY at DESC LIMIT ?2)"
+#define DB_LATENCY_ENDPOINTS 8
+
+/* Shards look bookings up whilst the default loop may be reopening the
+ * database on a config reload, so the handle is only used under lock */
 static sqlite3 *db = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 LOGSET("database");
 
+static int database_step(sqlite3_stmt *st);
+
+/* Each statement is timed for the metrics */
+static int database_step(
+    sqlite3_stmt *st)
+{
+  ev_tstamp started = ev_time();
+  int rc = sqlite3_step(st);
+
+  metric_db(ev_time() - started);
+  return rc;
+}
+
 static int database_simple_exec(
     const char *sql)
 {
   sqlite3_stmt *st = NULL;
   int rc;
 
+  pthread_mutex_lock(&lock);
   rc = sqlite3_prepare_v2(db, sql, -1, &st, NULL);
   if (rc != SQLITE_OK) {
     ELOG(WARNING, "Cannot execute SQL statement \"%s\": %s", sql, sqlite3_errmsg(db));
@@ -27,11 +53,13 @@ static int database_simple_exec(
   }
 
   sqlite3_finalize(st);
+  pthread_mutex_unlock(&lock);
   return 1;
 
 fail:
   if (st)
     sqlite3_finalize(st);
+  pthread_mutex_unlock(&lock);
   return 0;
 }
 
@@ -41,9 +69,10 @@ void database_init(
     void)
 {
   int rc;
+  pthread_mutex_lock(&lock);
   rc = sqlite3_open_v2(config_get_db_path(),
                        &db,
-                       SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE,
+                       SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE|SQLITE_OPEN_FULLMUTEX,
                        NULL);
   if (rc != SQLITE_OK) {
     ELOG(ERROR, "Cannot initialize database: %s (%s)", sqlite3_errmsg(db),
@@ -51,15 +80,23 @@ void database_init(
     exit(EXIT_FAILURE);
   }
   sqlite3_busy_timeout(db, 5000);
+
+  /* Request timings are ours to keep, so make room for them */
+  if (sqlite3_exec(db, DB_LATENCY_TABLE, NULL, NULL, NULL) != SQLITE_OK ||
+      sqlite3_exec(db, DB_LATENCY_INDEX, NULL, NULL, NULL) != SQLITE_OK)
+    ELOG(WARNING, "Cannot create latency table: %s", sqlite3_errmsg(db));
+  pthread_mutex_unlock(&lock);
 }
 
 
 void database_destroy(
     void)
 {
+  pthread_mutex_lock(&lock);
   assert(db);
   sqlite3_close_v2(db);
   db = NULL;
+  pthread_mutex_unlock(&lock);
   ELOG(VERBOSE, "Database closed");
 }
 
@@ -98,6 +135,7 @@ class_t database_get(
 
   class_init(&cl);
 
+  pthread_mutex_lock(&lock);
   rc = sqlite3_prepare_v2(db, DB_GET, -1, &st, NULL);
   if (rc != SQLITE_OK) {
     ELOG(WARNING, "Cannot execute SQL statement \"%s\": %s", DB_GET,
@@ -112,7 +150,7 @@ class_t database_get(
   }
 
   /* Fetch parameter */
-  rc = sqlite3_step(st);
+  rc = database_step(st);
 
   if (rc == SQLITE_DONE) {
     /* No rows */
@@ -155,6 +193,7 @@ class_t database_get(
   memcpy(ret, &cl, sizeof(struct class));
 
   sqlite3_finalize(st);
+  pthread_mutex_unlock(&lock);
   return ret;
 
 fail:
@@ -162,6 +201,7 @@ fail:
 
   if (st)
     sqlite3_finalize(st);
+  pthread_mutex_unlock(&lock);
   return NULL;
 }
 
@@ -176,6 +216,7 @@ int database_add(
   struct tm *now = localtime(&tnow);
   int rc;
 
+  pthread_mutex_lock(&lock);
   rc = sqlite3_prepare_v2(db, DB_ADD, -1, &st, NULL);
   if (rc != SQLITE_OK) {
     ELOG(WARNING, "Cannot execute SQL statement \"%s\": %s", DB_ADD,
@@ -229,7 +270,7 @@ int database_add(
   }
 
   /* Fetch parameter */
-  rc = sqlite3_step(st);
+  rc = database_step(st);
   if (rc != SQLITE_DONE) {
     ELOG(WARNING, "Cannot execute SQL statement (step) \"%s\": %s", DB_ADD,
          sqlite3_errmsg(db));
@@ -237,11 +278,146 @@ int database_add(
   }
 
   sqlite3_finalize(st);
+  pthread_mutex_unlock(&lock);
   return 1;
 
 
 fail:
   if (st)
     sqlite3_finalize(st);
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+
+/* Saves n timings in one transaction, then trims each endpoint they
+ * were for to its keep most recent */
+int database_add_latency(
+    const struct latency *l,
+    int n,
+    int keep)
+{
+  const char *endpoints[DB_LATENCY_ENDPOINTS];
+  sqlite3_stmt *st = NULL;
+  int i, j, nendpoints = 0, rc;
+
+  if (n <= 0)
+    return 1;
+
+  pthread_mutex_lock(&lock);
+  if (sqlite3_exec(db, DB_START, NULL, NULL, NULL) != SQLITE_OK) {
+    ELOG(WARNING, "Cannot save latencies: %s", sqlite3_errmsg(db));
+    pthread_mutex_unlock(&lock);
+    return 0;
+  }
+
+  rc = sqlite3_prepare_v2(db, DB_LATENCY_ADD, -1, &st, NULL);
+  if (rc != SQLITE_OK) {
+    ELOG(WARNING, "Cannot execute SQL statement \"%s\": %s", DB_LATENCY_ADD,
+         sqlite3_errmsg(db));
+    goto fail;
+  }
+
+  for (i=0; i < n; i++) {
+    if (sqlite3_bind_text(st, 1, l[i].endpoint, -1, NULL) != SQLITE_OK ||
+        sqlite3_bind_int64(st, 2, l[i].at) != SQLITE_OK ||
+        sqlite3_bind_int64(st, 3, l[i].connect) != SQLITE_OK ||
+        sqlite3_bind_int64(st, 4, l[i].pretransfer) != SQLITE_OK ||
+        sqlite3_bind_int64(st, 5, l[i].ttfb) != SQLITE_OK ||
+        sqlite3_bind_int64(st, 6, l[i].total) != SQLITE_OK) {
+      ELOG(WARNING, "Cannot execute SQL statement (bind) \"%s\": %s",
+           DB_LATENCY_ADD, sqlite3_errmsg(db));
+      goto fail;
+    }
+
+    rc = database_step(st);
+    if (rc != SQLITE_DONE) {
+      ELOG(WARNING, "Cannot execute SQL statement (step) \"%s\": %s",
+           DB_LATENCY_ADD, sqlite3_errmsg(db));
+      goto fail;
+    }
+    sqlite3_reset(st);
+
+    for (j=0; j < nendpoints; j++) {
+      if (strcmp(endpoints[j], l[i].endpoint) == 0)
+        break;
+    }
+    if (j == nendpoints && nendpoints < DB_LATENCY_ENDPOINTS)
+      endpoints[nendpoints++] = l[i].endpoint;
+  }
+  sqlite3_finalize(st);
+  st = NULL;
+
+  rc = sqlite3_prepare_v2(db, DB_LATENCY_TRIM, -1, &st, NULL);
+  if (rc != SQLITE_OK) {
+    ELOG(WARNING, "Cannot execute SQL statement \"%s\": %s", DB_LATENCY_TRIM,
+         sqlite3_errmsg(db));
+    goto fail;
+  }
+
+  for (j=0; j < nendpoints; j++) {
+    if (sqlite3_bind_text(st, 1, endpoints[j], -1, NULL) != SQLITE_OK ||
+        sqlite3_bind_int(st, 2, keep) != SQLITE_OK ||
+        database_step(st) != SQLITE_DONE) {
+      ELOG(WARNING, "Cannot execute SQL statement \"%s\": %s",
+           DB_LATENCY_TRIM, sqlite3_errmsg(db));
+      goto fail;
+    }
+    sqlite3_reset(st);
+  }
+  sqlite3_finalize(st);
+
+  if (sqlite3_exec(db, DB_COMMIT, NULL, NULL, NULL) != SQLITE_OK) {
+    ELOG(WARNING, "Cannot save latencies: %s", sqlite3_errmsg(db));
+    st = NULL;
+    goto fail;
+  }
+  pthread_mutex_unlock(&lock);
+  return 1;
+
+fail:
+  if (st)
+    sqlite3_finalize(st);
+  sqlite3_exec(db, DB_ROLLBACK, NULL, NULL, NULL);
+  pthread_mutex_unlock(&lock);
   return 0;
 }
+
+
+/* Fills oneway with up to max of the most recent one way latencies in
+ * seconds for the endpoint, taken as half the time from the request
+ * going out to the first byte back. Returns how many */
+int database_get_latency(
+    const char *endpoint,
+    double *oneway,
+    int max)
+{
+  sqlite3_stmt *st = NULL;
+  int rc, n = 0;
+
+  pthread_mutex_lock(&lock);
+  rc = sqlite3_prepare_v2(db, DB_LATENCY_GET, -1, &st, NULL);
+  if (rc != SQLITE_OK) {
+    ELOG(WARNING, "Cannot execute SQL statement \"%s\": %s", DB_LATENCY_GET,
+         sqlite3_errmsg(db));
+    goto fin;
+  }
+
+  if (sqlite3_bind_text(st, 1, endpoint, -1, NULL) != SQLITE_OK ||
+      sqlite3_bind_int(st, 2, max) != SQLITE_OK) {
+    ELOG(WARNING, "Cannot execute SQL statement (bind) \"%s\": %s",
+         DB_LATENCY_GET, sqlite3_errmsg(db));
+    goto fin;
+  }
+
+  while (n < max && (rc = database_step(st)) == SQLITE_ROW) {
+    oneway[n++] = (sqlite3_column_int64(st, 1) -
+                   sqlite3_column_int64(st, 0)) / 2000000.;
+  }
+
+fin:
+  if (st)
+    sqlite3_finalize(st);
+  pthread_mutex_unlock(&lock);
+  return n;
+}
@@ -12,5 +12,17 @@ int database_commit(void);
 
 class_t database_get(int classid);
 int database_add(class_t cl);
+/* A request's timing, in microseconds as curl reports them */
+struct latency {
+  const char *endpoint;
+  time_t at;
+  int64_t connect;
+  int64_t pretransfer;
+  int64_t ttfb;
+  int64_t total;
+};
+
+int database_add_latency(const struct latency *l, int n, int keep);
+int database_get_latency(const char *endpoint, double *oneway, int max);
 
 #endif
@@ -0,0 +1,191 @@
+#include "common.h"
+#include "config.h"
+#include "logging.h"
+#include "website.h"
+#include "events.h"
+#include "metrics.h"
+#include <ev.h>
+#include <sys/uio.h>
+#include <json-c/json.h>
+
+LOGSET("events");
+
+/* Booking decisions as JSON lines, one object per decision, so timings
+ * and outcomes can be read back without picking apart the log. Phase
+ * times are milliseconds from when the timetable was asked for */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int fd = -1;
+
+static const char *phases[EVENT_PHASES] = {
+  "fetch", "parse", "match", "price", "book", "commit",
+};
+
+
+
+void events_init(
+    void)
+{
+  events_open(config_get_event_log());
+}
+
+
+/* Switch to another file, an empty path stops the event log */
+void events_open(
+    const char *path)
+{
+  int nfd = -1, ofd;
+
+  if (path && *path) {
+    nfd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0640);
+    if (nfd < 0) {
+      ELOGERR(ERROR, "Cannot open event log %s", path);
+      return;
+    }
+    ELOG(INFO, "Writing booking events to %s", path);
+  }
+
+  pthread_mutex_lock(&lock);
+  ofd = fd;
+  fd = nfd;
+  pthread_mutex_unlock(&lock);
+
+  if (ofd > -1)
+    close(ofd);
+}
+
+
+void events_destroy(
+    void)
+{
+  events_open(NULL);
+}
+
+
+/* The fetch and parse times come from the timetable the entry was in */
+void event_begin(
+    struct event *ev,
+    class_t cl,
+    double t0,
+    double fetched,
+    double parsed)
+{
+  memset(ev, 0, sizeof(struct event));
+  ev->classid = cl->id;
+  snprintf(ev->name, sizeof(ev->name), "%s", cl->class_name);
+  memcpy(&ev->start, &cl->time, sizeof(struct tm));
+  ev->t0 = t0;
+  ev->at[EVENT_FETCH] = fetched;
+  ev->at[EVENT_PARSE] = parsed;
+}
+
+
+void event_mark(
+    struct event *ev,
+    enum event_phase phase)
+{
+  ev->at[phase] = ev_time();
+}
+
+
+/* A decision is written when it is final. A NULL decision is the one
+ * given when the event was copied */
+void event_emit(
+    struct event *ev,
+    const char *decision)
+{
+  json_object *obj, *ms;
+  struct iovec iov[2];
+  const char *line;
+  char start[32];
+  int i;
+
+  if (decision)
+    ev->decision = decision;
+  metric_decision(ev->decision);
+
+  /* Not worth building the line if no one is reading it */
+  if (__atomic_load_n(&fd, __ATOMIC_RELAXED) < 0)
+    return;
+
+  strftime(start, sizeof(start), "%Y-%m-%d %H:%M", &ev->start);
+
+  obj = json_object_new_object();
+  ms = json_object_new_object();
+  if (!obj || !ms) {
+    ELOG(WARNING, "Cannot allocate booking event");
+    json_object_put(obj);
+    json_object_put(ms);
+    return;
+  }
+
+  json_object_object_add(obj, "ts", json_object_new_double(ev_time()));
+  json_object_object_add(obj, "id", json_object_new_int(ev->classid));
+  json_object_object_add(obj, "class", json_object_new_string(ev->name));
+  json_object_object_add(obj, "start", json_object_new_string(start));
+  json_object_object_add(obj, "decision",
+                         json_object_new_string(ev->decision));
+  json_object_object_add(obj, "offset",
+                         json_object_new_int(website_clock_skew()));
+
+  for (i=0; i < EVENT_PHASES; i++) {
+    if (ev->at[i] <= 0. || ev->t0 <= 0.)
+      continue;
+    json_object_object_add(ms, phases[i],
+                    json_object_new_double((ev->at[i] - ev->t0) * 1000.));
+  }
+  json_object_object_add(obj, "ms", ms);
+
+  line = json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN);
+  iov[0].iov_base = (char *)line;
+  iov[0].iov_len = strlen(line);
+  iov[1].iov_base = "\n";
+  iov[1].iov_len = 1;
+
+  /* Each line goes in one append */
+  pthread_mutex_lock(&lock);
+  if (fd > -1 && writev(fd, iov, 2) < 0)
+    ELOGERR(WARNING, "Cannot write booking event");
+  pthread_mutex_unlock(&lock);
+
+  json_object_put(obj);
+}
+
+
+/* Keep an event whose outcome waits on a commit */
+struct event * event_copy(
+    struct event *ev,
+    const char *decision)
+{
+  struct event *cp = malloc(sizeof(struct event));
+  if (!cp) {
+    ELOGERR(WARNING, "Cannot allocate booking event");
+    return NULL;
+  }
+
+  memcpy(cp, ev, sizeof(struct event));
+  cp->decision = decision;
+  return cp;
+}
+
+
+/* Write out and free events waiting on a commit. A commit time of zero
+ * means the commit failed */
+void event_flush(
+    struct event_list *list,
+    double committed)
+{
+  struct event *ev;
+
+  while ((ev = STAILQ_FIRST(list))) {
+    STAILQ_REMOVE_HEAD(list, l);
+    if (committed > 0.) {
+      ev->at[EVENT_COMMIT] = committed;
+      event_emit(ev, NULL);
+    }
+    else {
+      event_emit(ev, "uncommitted");
+    }
+    free(ev);
+  }
+}
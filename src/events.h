@@ -0,0 +1,42 @@
+#ifndef _EVENTS_H_
+#define _EVENTS_H_
+
+#include "common.h"
+#include "class.h"
+
+/* The stages a booking decision passes through, in order */
+enum event_phase {
+  EVENT_FETCH,
+  EVENT_PARSE,
+  EVENT_MATCH,
+  EVENT_PRICE,
+  EVENT_BOOK,
+  EVENT_COMMIT,
+  EVENT_PHASES,
+};
+
+/* One decision about one timetable entry, filled in as it goes and
+ * written out as a single line once it is decided */
+struct event {
+  int classid;
+  char name[64];
+  struct tm start;
+  const char *decision;
+  double t0;
+  double at[EVENT_PHASES];
+  STAILQ_ENTRY(event) l;
+};
+
+STAILQ_HEAD(event_list, event);
+
+void events_init(void);
+void events_open(const char *path);
+void events_destroy(void);
+
+void event_begin(struct event *ev, class_t cl, double t0, double fetched,
+                 double parsed);
+void event_mark(struct event *ev, enum event_phase phase);
+void event_emit(struct event *ev, const char *decision);
+struct event * event_copy(struct event *ev, const char *decision);
+void event_flush(struct event_list *list, double committed);
+#endif
@@ -0,0 +1,193 @@
+#include "common.h"
+#include "series.h"
+#include <json-c/json.h>
+
+/* Reads the booking event log written by abbeyd (event_log in [main])
+ * and prints how many of each decision were made and the latency
+ * percentiles of each stage, in milliseconds.
+ *
+ *   abbeyd-eventstat [-d decision] [file ...]
+ *
+ * Each stage is timed from the one before it that the event reached,
+ * total is from asking for the timetable to the last stage reached */
+
+#define LINE_MAX_LEN 65536
+
+static const char *stages[] = {
+  "fetch", "parse", "match", "price", "book", "commit", "total",
+};
+#define NSTAGES (sizeof(stages) / sizeof(stages[0]))
+
+struct tally {
+  char *decision;
+  int count;
+  struct tally *next;
+};
+
+static struct series series[NSTAGES];
+static struct tally *tallies = NULL;
+static int offset_min = INT32_MAX;
+static int offset_max = INT32_MIN;
+
+static void tally_add(const char *decision);
+static bool read_event(const char *line, const char *only);
+static bool read_file(FILE *f, const char *name, const char *only);
+
+
+
+static void tally_add(
+    const char *decision)
+{
+  struct tally *t;
+
+  for (t = tallies; t; t = t->next) {
+    if (strcmp(t->decision, decision) == 0)
+      break;
+  }
+
+  if (!t) {
+    t = calloc(1, sizeof(struct tally));
+    if (!t || !(t->decision = strdup(decision)))
+      err(EXIT_FAILURE, "Cannot allocate decision");
+    t->next = tallies;
+    tallies = t;
+  }
+  t->count++;
+}
+
+
+static bool read_event(
+    const char *line,
+    const char *only)
+{
+  json_object *json, *val, *ms;
+  const char *decision;
+  double prev = 0., at;
+  bool any = false;
+  size_t i;
+
+  json = json_tokener_parse(line);
+  if (!json)
+    return false;
+
+  if (!json_object_object_get_ex(json, "decision", &val) ||
+      !json_object_is_type(val, json_type_string) ||
+      !json_object_object_get_ex(json, "ms", &ms)) {
+    json_object_put(json);
+    return false;
+  }
+
+  decision = json_object_get_string(val);
+  if (only && strcmp(only, decision) != 0) {
+    json_object_put(json);
+    return true;
+  }
+  tally_add(decision);
+
+  if (json_object_object_get_ex(json, "offset", &val)) {
+    if (json_object_get_int(val) < offset_min)
+      offset_min = json_object_get_int(val);
+    if (json_object_get_int(val) > offset_max)
+      offset_max = json_object_get_int(val);
+  }
+
+  for (i=0; i < NSTAGES - 1; i++) {
+    if (!json_object_object_get_ex(ms, stages[i], &val))
+      continue;
+    at = json_object_get_double(val);
+    series_add(&series[i], at - prev);
+    prev = at;
+    any = true;
+  }
+  if (any)
+    series_add(&series[NSTAGES - 1], prev);
+
+  json_object_put(json);
+  return true;
+}
+
+
+static bool read_file(
+    FILE *f,
+    const char *name,
+    const char *only)
+{
+  char *line;
+  int lineno = 0;
+
+  line = malloc(LINE_MAX_LEN);
+  if (!line)
+    err(EXIT_FAILURE, "Cannot allocate line");
+
+  while (fgets(line, LINE_MAX_LEN, f)) {
+    lineno++;
+    if (line[0] == '\n')
+      continue;
+    if (!read_event(line, only))
+      warnx("%s:%d: not a booking event", name, lineno);
+  }
+
+  free(line);
+  return !ferror(f);
+}
+
+
+int main(
+    int argc,
+    char **argv)
+{
+  const char *only = NULL;
+  struct tally *t;
+  FILE *f;
+  size_t i;
+  int c, rc = EXIT_SUCCESS;
+
+  while ((c = getopt(argc, argv, "d:h")) != -1) {
+    switch (c) {
+    case 'd':
+      only = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-d decision] [file ...]\n", argv[0]);
+      return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (optind == argc) {
+    if (!read_file(stdin, "stdin", only))
+      rc = EXIT_FAILURE;
+  }
+
+  for (; optind < argc; optind++) {
+    f = fopen(argv[optind], "r");
+    if (!f) {
+      warn("Cannot open %s", argv[optind]);
+      rc = EXIT_FAILURE;
+      continue;
+    }
+    if (!read_file(f, argv[optind], only))
+      rc = EXIT_FAILURE;
+    fclose(f);
+  }
+
+  printf("%-12s %8s\n", "decision", "count");
+  for (t = tallies; t; t = t->next)
+    printf("%-12s %8d\n", t->decision, t->count);
+
+  if (offset_min <= offset_max)
+    printf("\nserver offset %d to %d seconds\n", offset_min, offset_max);
+
+  printf("\n%-12s %8s %10s %10s %10s %10s\n", "stage (ms)", "count", "p50",
+         "p90", "p99", "max");
+  for (i=0; i < NSTAGES; i++) {
+    if (!series[i].n)
+      continue;
+    series_sort(&series[i]);
+    printf("%-12s %8zu %10.2f %10.2f %10.2f %10.2f\n", stages[i], series[i].n,
+           series_quantile(&series[i], 0.50),
+           series_quantile(&series[i], 0.90),
+           series_quantile(&series[i], 0.99), series[i].v[series[i].n - 1]);
+  }
+
+  return rc;
+}
@@ -0,0 +1,73 @@
+#include "common.h"
+#include "hist.h"
+
+/* Adds are lockless so any shard can record into the same histogram,
+ * readers may see a sample counted in one field but not yet another */
+
+void hist_init(
+    struct hist *h,
+    const char *name)
+{
+  memset(h, 0, sizeof(struct hist));
+  h->name = name;
+}
+
+
+void hist_add(
+    struct hist *h,
+    double seconds)
+{
+  uint64_t us = seconds > 0. ? (uint64_t)(seconds * 1000000.) : 0;
+  uint64_t max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+  int b = 0;
+
+  while (b < HIST_BUCKETS-1 && us >= (2ull << b))
+    b++;
+
+  __atomic_add_fetch(&h->buckets[b], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->sum_us, us, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+
+  while (us > max &&
+         !__atomic_compare_exchange_n(&h->max_us, &max, us, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+/* The upper bound in seconds of the bucket holding the qth sample */
+double hist_quantile(
+    struct hist *h,
+    double q)
+{
+  uint64_t n = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+  uint64_t want = (uint64_t)(q * n);
+  uint64_t seen = 0;
+  int b;
+
+  if (n == 0)
+    return 0.;
+
+  for (b=0; b < HIST_BUCKETS; b++) {
+    seen += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+    if (seen > want)
+      break;
+  }
+
+  return (double)(2ull << b) / 1000000.;
+}
+
+
+char * hist_print(
+    struct hist *h,
+    char *buf,
+    size_t len)
+{
+  uint64_t n = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+
+  snprintf(buf, len, "%s: n=%lu mean=%.6f p50<%.6f p99<%.6f max=%.6f",
+           h->name, (unsigned long)n,
+           n ? (double)h->sum_us / n / 1000000. : 0.,
+           hist_quantile(h, 0.5), hist_quantile(h, 0.99),
+           (double)h->max_us / 1000000.);
+  return buf;
+}
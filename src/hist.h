@@ -0,0 +1,21 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#include "common.h"
+
+/* Log2 buckets of microseconds, bucket i holds [2^i, 2^(i+1)) */
+#define HIST_BUCKETS 32
+
+struct hist {
+  const char *name;
+  uint64_t count;
+  uint64_t sum_us;
+  uint64_t max_us;
+  uint64_t buckets[HIST_BUCKETS];
+};
+
+void hist_init(struct hist *h, const char *name);
+void hist_add(struct hist *h, double seconds);
+double hist_quantile(struct hist *h, double q);
+char * hist_print(struct hist *h, char *buf, size_t len);
+#endif
@@ -29,6 +29,25 @@
 /** Invalid key token */
 #define DICT_INVALID_KEY    ((char*)-1)
 
+/** Smallest block of string space */
+#define DICT_BLOCKSZ    4096
+
+/** Index table markers for a never used and a deleted slot */
+#define DICT_EMPTY      -1
+#define DICT_DELETED    -2
+
+/*---------------------------------------------------------------------------
+                                New types
+ ---------------------------------------------------------------------------*/
+
+/** Block of string space handed out by dictionary_alloc */
+typedef struct _dictblock_ {
+    struct _dictblock_ * next ;
+    size_t          size ;
+    size_t          used ;
+    char            data[] ;
+} dictblock ;
+
 /*---------------------------------------------------------------------------
                             Private functions
  ---------------------------------------------------------------------------*/
@@ -70,6 +89,210 @@ static char * xstrdup(const char * s)
     return t ;
 }
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Rebuild the index table from the stored entries
+  @param    d   Dictionary to index
+  @return   int 0 if Ok, -1 if the table could not be allocated
+
+  The table is kept at least twice the storage size so that, counting
+  deleted markers, it is never more than half full and probing ends.
+ */
+/*--------------------------------------------------------------------------*/
+static int dictionary_reindex(dictionary * d)
+{
+    unsigned    isize ;
+    unsigned    j ;
+    int         i ;
+
+    for (isize=1 ; isize < 2*(unsigned)d->size ; isize <<= 1) ;
+
+    if (d->index==NULL || isize != d->mask+1) {
+        free(d->index);
+        d->index = (int *)malloc(isize * sizeof(int));
+        if (d->index==NULL)
+            return -1 ;
+        d->mask = isize-1 ;
+    }
+
+    for (j=0 ; j<isize ; j++)
+        d->index[j] = DICT_EMPTY ;
+
+    for (i=0 ; i<d->used ; i++) {
+        if (d->key[i]==NULL)
+            continue ;
+        for (j=d->hash[i] & d->mask ; d->index[j]!=DICT_EMPTY ; j=(j+1) & d->mask) ;
+        d->index[j] = i ;
+    }
+    return 0 ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Find the index table position holding a key
+  @param    d       Dictionary to search
+  @param    key     Key to look for
+  @param    hash    Hash of the key
+  @return   Position in d->index, or -1 if the key is not present
+ */
+/*--------------------------------------------------------------------------*/
+static int dictionary_find(dictionary * d, const char * key, unsigned hash)
+{
+    unsigned    j ;
+    int         i ;
+
+    for (j=hash & d->mask ; (i=d->index[j])!=DICT_EMPTY ; j=(j+1) & d->mask) {
+        if (i==DICT_DELETED)
+            continue ;
+        /* Compare string, to avoid hash collisions */
+        if (hash==d->hash[i] && !strcmp(key, d->key[i]))
+            return (int)j ;
+    }
+    return -1 ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Free a key or value unless it lives in the dictionary blocks
+  @param    d   Dictionary holding the string
+  @param    s   String to release, may be NULL
+  @return   void
+ */
+/*--------------------------------------------------------------------------*/
+static void dictionary_release(dictionary * d, char * s)
+{
+    dictblock * b ;
+
+    if (s==NULL) return ;
+    for (b=d->arena ; b ; b=b->next) {
+        if (s>=b->data && s<b->data+b->size)
+            return ;
+    }
+    free(s);
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Forget the section index kept for iniparser
+  @param    d   Dictionary whose entries are about to move
+  @return   void
+ */
+/*--------------------------------------------------------------------------*/
+static void dictionary_dropsec(dictionary * d)
+{
+    free(d->sec);
+    free(d->secof);
+    free(d->seckey);
+    free(d->secpos);
+    d->sec = d->secof = d->seckey = d->secpos = NULL ;
+    d->nsec = -1 ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Make room for one more entry
+  @param    d   Dictionary to grow
+  @return   int 0 if Ok, -1 on allocation failure
+
+  Slots freed by dictionary_unset are reclaimed by packing the storage,
+  keeping the insertion order, before the storage is doubled.
+ */
+/*--------------------------------------------------------------------------*/
+static int dictionary_grow(dictionary * d)
+{
+    int     i, j ;
+
+    if (d->n < d->used) {
+        for (i=0, j=0 ; i<d->used ; i++) {
+            if (d->key[i]==NULL)
+                continue ;
+            d->key[j]  = d->key[i] ;
+            d->val[j]  = d->val[i] ;
+            d->hash[j] = d->hash[i] ;
+            j++ ;
+        }
+        for (i=j ; i<d->used ; i++) {
+            d->key[i]  = NULL ;
+            d->val[i]  = NULL ;
+            d->hash[i] = 0 ;
+        }
+        d->used = j ;
+    }
+
+    if (d->used==d->size) {
+        d->val  = (char **)mem_double(d->val,  d->size * sizeof(char*)) ;
+        d->key  = (char **)mem_double(d->key,  d->size * sizeof(char*)) ;
+        d->hash = (unsigned int *)mem_double(d->hash, d->size * sizeof(unsigned)) ;
+        if ((d->val==NULL) || (d->key==NULL) || (d->hash==NULL)) {
+            /* Cannot grow dictionary */
+            return -1 ;
+        }
+        /* Double size */
+        d->size *= 2 ;
+    }
+
+    return dictionary_reindex(d) ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Add a key or change its value
+  @param    d       Dictionary to modify
+  @param    key     Key to modify or add
+  @param    val     Value to store, may be NULL
+  @param    copy    Non-zero to store duplicates of key and val
+  @return   int 0 if Ok, -1 otherwise
+ */
+/*--------------------------------------------------------------------------*/
+static int dictionary_store(
+    dictionary * d,
+    const char * key,
+    const char * val,
+    int copy)
+{
+    int         i, j ;
+    unsigned    hash ;
+
+    /* Compute hash for this key */
+    hash = dictionary_hash(key) ;
+    /* Find if value is already in dictionary */
+    j = dictionary_find(d, key, hash);
+    if (j>=0) {
+        /* Found a value: modify and return */
+        i = d->index[j] ;
+        dictionary_release(d, d->val[i]);
+        if (copy)
+            d->val[i] = val ? xstrdup(val) : NULL ;
+        else
+            d->val[i] = (char *)val ;
+        /* Value has been modified: return */
+        return 0 ;
+    }
+    /* Add a new value */
+    dictionary_dropsec(d);
+    /* See if dictionary needs to grow */
+    if (d->used==d->size) {
+        if (dictionary_grow(d))
+            return -1 ;
+    }
+
+    /* Append to storage, keeping insertion order, and index it at the
+       first free or deleted position on its probe path */
+    i = d->used++ ;
+    if (copy) {
+        d->key[i]  = xstrdup(key);
+        d->val[i]  = val ? xstrdup(val) : NULL ;
+    } else {
+        d->key[i]  = (char *)key ;
+        d->val[i]  = (char *)val ;
+    }
+    d->hash[i] = hash;
+    for (j=hash & d->mask ; d->index[j]>=0 ; j=(j+1) & d->mask) ;
+    d->index[j] = i ;
+    d->n ++ ;
+    return 0 ;
+}
+
 /*---------------------------------------------------------------------------
                             Function codes
  ---------------------------------------------------------------------------*/
@@ -125,9 +348,14 @@ dictionary * dictionary_new(int size)
         return NULL;
     }
     d->size = size ;
+    d->nsec = -1 ;
     d->val  = (char **)calloc(size, sizeof(char*));
     d->key  = (char **)calloc(size, sizeof(char*));
     d->hash = (unsigned int *)calloc(size, sizeof(unsigned));
+    if (d->val==NULL || d->key==NULL || d->hash==NULL || dictionary_reindex(d)) {
+        dictionary_del(d);
+        return NULL ;
+    }
     return d ;
 }
 
@@ -142,18 +370,23 @@ dictionary * dictionary_new(int size)
 /*--------------------------------------------------------------------------*/
 void dictionary_del(dictionary * d)
 {
+    dictblock * b ;
     int     i ;
 
     if (d==NULL) return ;
-    for (i=0 ; i<d->size ; i++) {
-        if (d->key[i]!=NULL)
-            free(d->key[i]);
-        if (d->val[i]!=NULL)
-            free(d->val[i]);
+    for (i=0 ; i<d->size && d->key && d->val ; i++) {
+        dictionary_release(d, d->key[i]);
+        dictionary_release(d, d->val[i]);
+    }
+    while ((b=d->arena)!=NULL) {
+        d->arena = b->next ;
+        free(b);
     }
     free(d->val);
     free(d->key);
     free(d->hash);
+    free(d->index);
+    dictionary_dropsec(d);
     free(d);
     return ;
 }
@@ -174,22 +407,35 @@ void dictionary_del(dictionary * d)
 /*--------------------------------------------------------------------------*/
 char * dictionary_get(dictionary * d, const char * key, char * def)
 {
-    unsigned    hash ;
-    int         i ;
+    int         j ;
 
-    hash = dictionary_hash(key);
-    for (i=0 ; i<d->size ; i++) {
-        if (d->key[i]==NULL)
-            continue ;
-        /* Compare hash */
-        if (hash==d->hash[i]) {
-            /* Compare string, to avoid hash collisions */
-            if (!strcmp(key, d->key[i])) {
-                return d->val[i] ;
-            }
-        }
-    }
-    return def ;
+    j = dictionary_find(d, key, dictionary_hash(key));
+    if (j<0)
+        return def ;
+    return d->val[d->index[j]] ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the storage slot of a key in a dictionary.
+  @param    d       dictionary object to search.
+  @param    key     Key to look for in the dictionary.
+  @return   Index into d->key and d->val, or -1 if the key is not found.
+
+  Slots stay valid until an entry is added to or removed from the
+  dictionary.
+ */
+/*--------------------------------------------------------------------------*/
+int dictionary_slot(dictionary * d, const char * key)
+{
+    int         j ;
+
+    if (d==NULL || key==NULL) return -1 ;
+
+    j = dictionary_find(d, key, dictionary_hash(key));
+    if (j<0)
+        return -1 ;
+    return d->index[j] ;
 }
 
 /*-------------------------------------------------------------------------*/
@@ -220,58 +466,62 @@ char * dictionary_get(dictionary * d, const char * key, char * def)
 /*--------------------------------------------------------------------------*/
 int dictionary_set(dictionary * d, const char * key, const char * val)
 {
-    int         i ;
-    unsigned    hash ;
-
     if (d==NULL || key==NULL) return -1 ;
-    
-    /* Compute hash for this key */
-    hash = dictionary_hash(key) ;
-    /* Find if value is already in dictionary */
-    if (d->n>0) {
-        for (i=0 ; i<d->size ; i++) {
-            if (d->key[i]==NULL)
-                continue ;
-            if (hash==d->hash[i]) { /* Same hash value */
-                if (!strcmp(key, d->key[i])) {   /* Same key */
-                    /* Found a value: modify and return */
-                    if (d->val[i]!=NULL)
-                        free(d->val[i]);
-                    d->val[i] = val ? xstrdup(val) : NULL ;
-                    /* Value has been modified: return */
-                    return 0 ;
-                }
-            }
-        }
-    }
-    /* Add a new value */
-    /* See if dictionary needs to grow */
-    if (d->n==d->size) {
+    return dictionary_store(d, key, val, 1) ;
+}
 
-        /* Reached maximum size: reallocate dictionary */
-        d->val  = (char **)mem_double(d->val,  d->size * sizeof(char*)) ;
-        d->key  = (char **)mem_double(d->key,  d->size * sizeof(char*)) ;
-        d->hash = (unsigned int *)mem_double(d->hash, d->size * sizeof(unsigned)) ;
-        if ((d->val==NULL) || (d->key==NULL) || (d->hash==NULL)) {
-            /* Cannot grow dictionary */
-            return -1 ;
-        }
-        /* Double size */
-        d->size *= 2 ;
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Allocate string space that lives as long as the dictionary.
+  @param    d       dictionary object to allocate from.
+  @param    len     Number of bytes wanted.
+  @return   Pointer to the space, or NULL on allocation failure.
+
+  Space is carved out of large blocks owned by the dictionary, which are
+  all released by dictionary_del. Each new block is at least twice the
+  size of the last so a file of any size needs only a few of them.
+ */
+/*--------------------------------------------------------------------------*/
+char * dictionary_alloc(dictionary * d, size_t len)
+{
+    dictblock * b ;
+    size_t      size ;
+
+    if (d==NULL) return NULL ;
+
+    b = d->arena ;
+    if (b==NULL || b->size - b->used < len) {
+        size = b ? 2*b->size : DICT_BLOCKSZ ;
+        if (size<len)
+            size = len ;
+        if ((b=(dictblock *)malloc(sizeof(dictblock) + size))==NULL)
+            return NULL ;
+        b->size = size ;
+        b->used = 0 ;
+        b->next = d->arena ;
+        d->arena = b ;
     }
+    b->used += len ;
+    return b->data + b->used - len ;
+}
 
-    /* Insert key in the first empty slot. Start at d->n and wrap at
-       d->size. Because d->n < d->size this will necessarily
-       terminate. */
-    for (i=d->n ; d->key[i] ; ) {
-        if(++i == d->size) i = 0;
-    }
-    /* Copy key */
-    d->key[i]  = xstrdup(key);
-    d->val[i]  = val ? xstrdup(val) : NULL ;
-    d->hash[i] = hash;
-    d->n ++ ;
-    return 0 ;
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Set a value in a dictionary without copying it.
+  @param    d       dictionary object to modify.
+  @param    key     Key to modify or add, from dictionary_alloc.
+  @param    val     Value to add, from dictionary_alloc, or NULL.
+  @return   int     0 if Ok, anything else otherwise
+
+  Behaves like dictionary_set, except that the key and value are stored
+  as given rather than duplicated. Both must have been obtained from
+  dictionary_alloc on the same dictionary.
+ */
+/*--------------------------------------------------------------------------*/
+int dictionary_put(dictionary * d, char * key, char * val)
+{
+    if (d==NULL || key==NULL) return -1 ;
+    return dictionary_store(d, key, val, 0) ;
 }
 
 /*-------------------------------------------------------------------------*/
@@ -287,36 +537,26 @@ int dictionary_set(dictionary * d, const char * key, const char * val)
 /*--------------------------------------------------------------------------*/
 void dictionary_unset(dictionary * d, const char * key)
 {
-    unsigned    hash ;
-    int         i ;
+    int         i, j ;
 
     if (key == NULL) {
         return;
     }
 
-    hash = dictionary_hash(key);
-    for (i=0 ; i<d->size ; i++) {
-        if (d->key[i]==NULL)
-            continue ;
-        /* Compare hash */
-        if (hash==d->hash[i]) {
-            /* Compare string, to avoid hash collisions */
-            if (!strcmp(key, d->key[i])) {
-                /* Found key */
-                break ;
-            }
-        }
-    }
-    if (i>=d->size)
+    j = dictionary_find(d, key, dictionary_hash(key));
+    if (j<0)
         /* Key not found */
         return ;
 
-    free(d->key[i]);
+    /* Leave a marker so probes for other keys carry on past it */
+    i = d->index[j] ;
+    d->index[j] = DICT_DELETED ;
+    dictionary_dropsec(d);
+
+    dictionary_release(d, d->key[i]);
     d->key[i] = NULL ;
-    if (d->val[i]!=NULL) {
-        free(d->val[i]);
-        d->val[i] = NULL ;
-    }
+    dictionary_release(d, d->val[i]);
+    d->val[i] = NULL ;
     d->hash[i] = 0 ;
     d->n -- ;
     return ;
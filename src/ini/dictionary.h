@@ -33,9 +33,12 @@
   @brief    Dictionary object
 
   This object contains a list of string/string associations. Each
-  association is identified by a unique string key. Looking up values
-  in the dictionary is speeded up by the use of a (hopefully collision-free)
-  hash function.
+  association is identified by a unique string key. Entries are stored
+  in insertion order in key/val/hash, and found through an open
+  addressing index table probed linearly from the key hash.
+
+  The section index is built and used by iniparser; the dictionary only
+  drops it whenever an entry is added or removed.
  */
 /*-------------------------------------------------------------------------*/
 typedef struct _dictionary_ {
@@ -44,6 +47,15 @@ typedef struct _dictionary_ {
     char        **  val ;   /** List of string values */
     char        **  key ;   /** List of string keys */
     unsigned     *  hash ;  /** List of hash values for keys */
+    int             used ;  /** Slots filled since the storage was packed */
+    int         *   index ; /** Open addressing table of slots by hash */
+    unsigned        mask ;  /** Size of index table less one */
+    int             nsec ;  /** Sections in the section index, -1 if stale */
+    int         *   sec ;   /** Slot of each section, in order */
+    int         *   secof ; /** Section number owning each slot, or -1 */
+    int         *   seckey ;/** Slots of keys grouped by section */
+    int         *   secpos ;/** Start of each section in seckey, nsec+1 */
+    struct _dictblock_ * arena ; /** Blocks of strings freed in one go */
 } dictionary ;
 
 
@@ -106,6 +118,19 @@ void dictionary_del(dictionary * vd);
 char * dictionary_get(dictionary * d, const char * key, char * def);
 
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Get the storage slot of a key in a dictionary.
+  @param    d       dictionary object to search.
+  @param    key     Key to look for in the dictionary.
+  @return   Index into d->key and d->val, or -1 if the key is not found.
+
+  Slots stay valid until an entry is added to or removed from the
+  dictionary.
+ */
+/*--------------------------------------------------------------------------*/
+int dictionary_slot(dictionary * d, const char * key);
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Set a value in a dictionary.
@@ -134,6 +159,34 @@ char * dictionary_get(dictionary * d, const char * key, char * def);
 /*--------------------------------------------------------------------------*/
 int dictionary_set(dictionary * vd, const char * key, const char * val);
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Allocate string space that lives as long as the dictionary.
+  @param    d       dictionary object to allocate from.
+  @param    len     Number of bytes wanted.
+  @return   Pointer to the space, or NULL on allocation failure.
+
+  Space is carved out of large blocks owned by the dictionary, which are
+  all released by dictionary_del. It is never freed individually.
+ */
+/*--------------------------------------------------------------------------*/
+char * dictionary_alloc(dictionary * d, size_t len);
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Set a value in a dictionary without copying it.
+  @param    d       dictionary object to modify.
+  @param    key     Key to modify or add, from dictionary_alloc.
+  @param    val     Value to add, from dictionary_alloc, or NULL.
+  @return   int     0 if Ok, anything else otherwise
+
+  Behaves like dictionary_set, except that the key and value are stored
+  as given rather than duplicated. Both must have been obtained from
+  dictionary_alloc on the same dictionary.
+ */
+/*--------------------------------------------------------------------------*/
+int dictionary_put(dictionary * d, char * key, char * val);
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Delete a key in a dictionary
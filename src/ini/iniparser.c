@@ -8,6 +8,10 @@
 /*--------------------------------------------------------------------------*/
 /*---------------------------- Includes ------------------------------------*/
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "iniparser.h"
 
 /*---------------------------- Defines -------------------------------------*/
@@ -29,6 +33,14 @@ typedef enum _line_status_ {
     LINE_VALUE
 } line_status ;
 
+/**
+ * A run of characters that is not nul terminated (internal use only).
+ */
+typedef struct _slice_ {
+    const char  *   p ;
+    size_t          len ;
+} slice ;
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Convert a string to lowercase.
@@ -59,36 +71,88 @@ static char * strlwc(const char * s)
 
 /*-------------------------------------------------------------------------*/
 /**
-  @brief    Remove blanks at the beginning and the end of a string.
-  @param    s   String to parse.
-  @return   ptr to statically allocated string.
+  @brief    Build the section index of a dictionary.
+  @param    d   Dictionary to index
+  @return   int 0 if Ok, -1 otherwise
+
+  Lists the sections in the order they were first seen and, for each
+  one, the slots of its keys, so that walking every section and every
+  key is linear in the size of the dictionary. A key belongs to the
+  section named by everything before its first colon.
 
-  This function returns a pointer to a statically allocated string,
-  which is identical to the input string, except that all blank
-  characters at the end and the beg. of the string have been removed.
-  Do not free or modify the returned string! Since the returned string
-  is statically allocated, it will be modified at each function call
-  (not re-entrant).
+  The index is kept in the dictionary until an entry is added or
+  removed, after which it is rebuilt on next use.
  */
 /*--------------------------------------------------------------------------*/
-static char * strstrip(const char * s)
+static int iniparser_index(dictionary * d)
 {
-    static char l[ASCIILINESZ+1];
-    char * last ;
-    
-    if (s==NULL) return NULL ;
-    
-    while (isspace((int)*s) && *s) s++;
-    memset(l, 0, ASCIILINESZ+1);
-    strcpy(l, s);
-    last = l + strlen(l);
-    while (last > l) {
-        if (!isspace((int)*(last-1)))
-            break ;
-        last -- ;
+    char    *   colon ;
+    char    *   name=NULL ;
+    int         namesz=0 ;
+    int         i, j, s, len ;
+
+    if (d->nsec>=0) return 0 ;
+
+    d->sec    = (int *)malloc((d->n+1) * sizeof(int));
+    d->secof  = (int *)malloc((d->size+1) * sizeof(int));
+    d->seckey = (int *)malloc((d->n+1) * sizeof(int));
+    d->secpos = (int *)calloc(d->n+2, sizeof(int));
+    if (!d->sec || !d->secof || !d->seckey || !d->secpos)
+        goto fail ;
+
+    d->nsec = 0 ;
+    for (i=0 ; i<d->size ; i++) {
+        d->secof[i] = -1 ;
+        if (d->key[i]!=NULL && strchr(d->key[i], ':')==NULL)
+            d->sec[d->nsec++] = i ;
+    }
+    for (s=0 ; s<d->nsec ; s++)
+        d->secof[d->sec[s]] = s ;
+
+    /* Find the owner of each key and count the keys per section */
+    for (i=0 ; i<d->size ; i++) {
+        if (d->key[i]==NULL || (colon=strchr(d->key[i], ':'))==NULL)
+            continue ;
+        len = (int)(colon - d->key[i]) ;
+        if (len>=namesz) {
+            free(name);
+            namesz = len+1 ;
+            if ((name=(char *)malloc(namesz))==NULL)
+                goto fail ;
+        }
+        memcpy(name, d->key[i], len);
+        name[len] = 0 ;
+
+        j = dictionary_slot(d, name);
+        if (j<0 || strchr(d->key[j], ':')!=NULL)
+            continue ;
+        d->secof[i] = d->secof[j] ;
+        d->secpos[d->secof[i]+1]++ ;
+    }
+    free(name);
+
+    /* Lay the keys out section by section, in insertion order */
+    for (s=0 ; s<d->nsec ; s++)
+        d->secpos[s+1] += d->secpos[s] ;
+    for (i=0 ; i<d->size ; i++) {
+        if (d->secof[i]<0 || d->sec[d->secof[i]]==i)
+            continue ;
+        d->seckey[d->secpos[d->secof[i]]++] = i ;
     }
-    *last = (char)0;
-    return (char*)l ;
+    for (s=d->nsec ; s>0 ; s--)
+        d->secpos[s] = d->secpos[s-1] ;
+    d->secpos[0] = 0 ;
+    return 0 ;
+
+fail:
+    free(name);
+    free(d->sec);
+    free(d->secof);
+    free(d->seckey);
+    free(d->secpos);
+    d->sec = d->secof = d->seckey = d->secpos = NULL ;
+    d->nsec = -1 ;
+    return -1 ;
 }
 
 /*-------------------------------------------------------------------------*/
@@ -111,19 +175,8 @@ static char * strstrip(const char * s)
 /*--------------------------------------------------------------------------*/
 int iniparser_getnsec(dictionary * d)
 {
-    int i ;
-    int nsec ;
-
-    if (d==NULL) return -1 ;
-    nsec=0 ;
-    for (i=0 ; i<d->size ; i++) {
-        if (d->key[i]==NULL)
-            continue ;
-        if (strchr(d->key[i], ':')==NULL) {
-            nsec ++ ;
-        }
-    }
-    return nsec ;
+    if (d==NULL || iniparser_index(d)) return -1 ;
+    return d->nsec ;
 }
 
 /*-------------------------------------------------------------------------*/
@@ -142,23 +195,60 @@ int iniparser_getnsec(dictionary * d)
 /*--------------------------------------------------------------------------*/
 char * iniparser_getsecname(dictionary * d, int n)
 {
-    int i ;
-    int foundsec ;
+    if (d==NULL || n<0 || iniparser_index(d)) return NULL ;
+    if (n>=d->nsec) return NULL ;
+    return d->key[d->sec[n]] ;
+}
 
-    if (d==NULL || n<0) return NULL ;
-    foundsec=0 ;
-    for (i=0 ; i<d->size ; i++) {
-        if (d->key[i]==NULL)
-            continue ;
-        if (strchr(d->key[i], ':')==NULL) {
-            foundsec++ ;
-            if (foundsec>n)
-                break ;
-        }
-    }
-    if (foundsec<=n) {
-        return NULL ;
-    }
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Iterate over the sections of a dictionary.
+  @param    d   Dictionary to examine
+  @param    pos Iterator position, set to 0 before the first call
+  @return   Pointer to char string
+
+  Each call returns the name of the next section, in the order the
+  sections appear in the ini file, and NULL once there are no more.
+  Do not free or modify the returned string!
+ */
+/*--------------------------------------------------------------------------*/
+char * iniparser_itersec(dictionary * d, int * pos)
+{
+    char * name ;
+
+    name = iniparser_getsecname(d, *pos);
+    if (name)
+        (*pos)++ ;
+    return name ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Iterate over the keys of a section.
+  @param    d   Dictionary to examine
+  @param    s   Section name of dictionary to examine
+  @param    pos Iterator position, set to 0 before the first call
+  @param    val If not NULL, set to the value of the returned key
+  @return   Pointer to char string
+
+  Each call returns the next key of the section, as "section:key", in
+  the order the keys appear in the ini file, and NULL once there are no
+  more. Do not free or modify the returned strings!
+ */
+/*--------------------------------------------------------------------------*/
+char * iniparser_iterkey(dictionary * d, const char * s, int * pos, char ** val)
+{
+    int sec, i ;
+
+    if (d==NULL || s==NULL || *pos<0 || iniparser_index(d)) return NULL ;
+    if ((i=dictionary_slot(d, s))<0 || (sec=d->secof[i])<0) return NULL ;
+    if (d->sec[sec]!=i) return NULL ;
+
+    if (d->secpos[sec] + *pos >= d->secpos[sec+1]) return NULL ;
+    i = d->seckey[d->secpos[sec] + *pos] ;
+    (*pos)++ ;
+    if (val)
+        *val = d->val[i] ;
     return d->key[i] ;
 }
 
@@ -277,27 +367,13 @@ void iniparser_dumpsection_ini(dictionary * d, char * s, FILE * f)
 /*--------------------------------------------------------------------------*/
 int iniparser_getsecnkeys(dictionary * d, char * s)
 {
-    int     seclen, nkeys ;
-    char    keym[ASCIILINESZ+1];
-    int j ;
-
-    nkeys = 0;
-
-    if (d==NULL) return nkeys;
-    if (! iniparser_find_entry(d, s)) return nkeys;
-
-    seclen  = (int)strlen(s);
-    sprintf(keym, "%s:", s);
-
-    for (j=0 ; j<d->size ; j++) {
-        if (d->key[j]==NULL)
-            continue ;
-        if (!strncmp(d->key[j], keym, seclen+1)) 
-            nkeys++;
-    }
+    int i ;
 
-    return nkeys;
+    if (d==NULL || s==NULL || iniparser_index(d)) return 0 ;
+    if ((i=dictionary_slot(d, s))<0 || d->secof[i]<0) return 0 ;
+    if (d->sec[d->secof[i]]!=i) return 0 ;
 
+    return d->secpos[d->secof[i]+1] - d->secpos[d->secof[i]] ;
 }
 
 /*-------------------------------------------------------------------------*/
@@ -316,35 +392,21 @@ int iniparser_getsecnkeys(dictionary * d, char * s)
 /*--------------------------------------------------------------------------*/
 char ** iniparser_getseckeys(dictionary * d, char * s)
 {
+    char ** keys ;
+    char *  key ;
+    int     i, nkeys ;
 
-    char **keys;
-
-    int i, j ;
-    char    keym[ASCIILINESZ+1];
-    int     seclen, nkeys ;
-
-    keys = NULL;
-
-    if (d==NULL) return keys;
-    if (! iniparser_find_entry(d, s)) return keys;
+    if (d==NULL) return NULL ;
+    if (! iniparser_find_entry(d, s)) return NULL ;
 
     nkeys = iniparser_getsecnkeys(d, s);
 
-    keys = (char**) malloc(nkeys*sizeof(char*));
+    keys = (char**) malloc((nkeys+1)*sizeof(char*));
+    if (keys==NULL) return NULL ;
 
-    seclen  = (int)strlen(s);
-    sprintf(keym, "%s:", s);
-    
-    i = 0;
-
-    for (j=0 ; j<d->size ; j++) {
-        if (d->key[j]==NULL)
-            continue ;
-        if (!strncmp(d->key[j], keym, seclen+1)) {
-            keys[i] = d->key[j];
-            i++;
-        }
-    }
+    i = 0 ;
+    while ((key=iniparser_iterkey(d, s, &i, NULL))!=NULL)
+        keys[i-1] = key ;
 
     return keys;
 
@@ -544,72 +606,132 @@ void iniparser_unset(dictionary * ini, const char * entry)
 
 /*-------------------------------------------------------------------------*/
 /**
-  @brief    Load a single line from an INI file
-  @param    input_line  Input line, may be concatenated multi-line input
-  @param    section     Output space to store section
-  @param    key         Output space to store key
-  @param    value       Output space to store value
+  @brief    Remove blanks at both ends of a slice of text.
+  @param    t   Slice to trim in place.
+  @return   void
+ */
+/*--------------------------------------------------------------------------*/
+static void slice_strip(slice * t)
+{
+    while (t->len>0 && isspace((unsigned char)t->p[0])) {
+        t->p++ ;
+        t->len-- ;
+    }
+    while (t->len>0 && isspace((unsigned char)t->p[t->len-1]))
+        t->len-- ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Copy a slice into the dictionary, lowercased if asked.
+  @param    d       Dictionary to allocate from.
+  @param    prefix  Optional slice to copy first, followed by a colon.
+  @param    t       Slice to copy.
+  @param    lower   Non-zero to lowercase the copy.
+  @return   Nul terminated copy, or NULL on allocation failure.
+ */
+/*--------------------------------------------------------------------------*/
+static char * slice_copy(
+    dictionary * d,
+    const slice * prefix,
+    const slice * t,
+    int lower)
+{
+    char  * s, * o ;
+    size_t  i, len ;
+
+    len = t->len + 1 ;
+    if (prefix)
+        len += prefix->len + 1 ;
+    if ((s=o=dictionary_alloc(d, len))==NULL)
+        return NULL ;
+
+    if (prefix) {
+        memcpy(o, prefix->p, prefix->len);
+        o += prefix->len ;
+        *o++ = ':' ;
+    }
+    for (i=0 ; i<t->len ; i++)
+        o[i] = lower ? (char)tolower((unsigned char)t->p[i]) : t->p[i] ;
+    o[t->len] = 0 ;
+    return s ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Split a single line of an INI file
+  @param    line    Slice holding the line, may be joined multi-line input
+  @param    key     Output slice for the section or key name
+  @param    value   Output slice for the value
   @return   line_status value
+
+  The line is never copied: key and value point into it. A section
+  line without a name returns LINE_SECTION with a NULL key.
  */
 /*--------------------------------------------------------------------------*/
 static line_status iniparser_line(
-    const char * input_line,
-    char * section,
-    char * key,
-    char * value)
-{   
-    line_status sta ;
-    char        line[ASCIILINESZ+1];
-    int         len ;
-
-    strcpy(line, strstrip(input_line));
-    len = (int)strlen(line);
-
-    sta = LINE_UNPROCESSED ;
-    if (len<1) {
+    slice   line,
+    slice * key,
+    slice * value)
+{
+    const char * eq, * end ;
+
+    slice_strip(&line);
+    key->p = value->p = NULL ;
+    key->len = value->len = 0 ;
+
+    if (line.len<1) {
         /* Empty line */
-        sta = LINE_EMPTY ;
-    } else if (line[0]=='#' || line[0]==';') {
+        return LINE_EMPTY ;
+    }
+    if (line.p[0]=='#' || line.p[0]==';') {
         /* Comment line */
-        sta = LINE_COMMENT ; 
-    } else if (line[0]=='[' && line[len-1]==']') {
-        /* Section name */
-        sscanf(line, "[%[^]]", section);
-        strcpy(section, strstrip(section));
-        strcpy(section, strlwc(section));
-        sta = LINE_SECTION ;
-    } else if (sscanf (line, "%[^=] = \"%[^\"]\"", key, value) == 2
-           ||  sscanf (line, "%[^=] = '%[^\']'",   key, value) == 2
-           ||  sscanf (line, "%[^=] = %[^;#]",     key, value) == 2) {
-        /* Usual key=value, with or without comments */
-        strcpy(key, strstrip(key));
-        strcpy(key, strlwc(key));
-        strcpy(value, strstrip(value));
-        /*
-         * sscanf cannot handle '' or "" as empty values
-         * this is done here
-         */
-        if (!strcmp(value, "\"\"") || (!strcmp(value, "''"))) {
-            value[0]=0 ;
+        return LINE_COMMENT ;
+    }
+    if (line.p[0]=='[' && line.p[line.len-1]==']') {
+        /* Section name, up to the first closing bracket */
+        end = memchr(line.p+1, ']', line.len-1);
+        if (end > line.p+1) {
+            key->p = line.p+1 ;
+            key->len = end - key->p ;
+            slice_strip(key);
         }
-        sta = LINE_VALUE ;
-    } else if (sscanf(line, "%[^=] = %[;#]", key, value)==2
-           ||  sscanf(line, "%[^=] %[=]", key, value) == 2) {
-        /*
-         * Special cases:
-         * key=
-         * key=;
-         * key=#
-         */
-        strcpy(key, strstrip(key));
-        strcpy(key, strlwc(key));
-        value[0]=0 ;
-        sta = LINE_VALUE ;
-    } else {
+        return LINE_SECTION ;
+    }
+
+    eq = memchr(line.p, '=', line.len);
+    if (eq==NULL || eq==line.p) {
         /* Generate syntax error */
-        sta = LINE_ERROR ;
+        return LINE_ERROR ;
+    }
+    key->p = line.p ;
+    key->len = eq - line.p ;
+    slice_strip(key);
+
+    value->p = eq+1 ;
+    value->len = line.p + line.len - value->p ;
+    slice_strip(value);
+
+    /* Quoted values run to the closing quote, others to a comment */
+    if (value->len>1 && (value->p[0]=='"' || value->p[0]=='\'')
+            && value->p[1]!=value->p[0]) {
+        end = memchr(value->p+1, value->p[0], value->len-1);
+        value->p++ ;
+        value->len = end ? (size_t)(end - value->p) : value->len-1 ;
+    } else {
+        for (end=value->p ; end<value->p+value->len ; end++)
+            if (*end==';' || *end=='#')
+                break ;
+        value->len = end - value->p ;
+    }
+    slice_strip(value);
+
+    /* An empty pair of quotes is an empty value */
+    if (value->len==2 && (!strncmp(value->p, "\"\"", 2) ||
+                          !strncmp(value->p, "''", 2))) {
+        value->len = 0 ;
     }
-    return sta ;
+    return LINE_VALUE ;
 }
 
 /*-------------------------------------------------------------------------*/
@@ -623,109 +745,167 @@ static line_status iniparser_line(
   should not be accessed directly, but through accessor functions
   instead.
 
+  The file is read whole into one buffer and scanned where it lies, with
+  no limit on line length. It is not mapped, as a file cut short while
+  mapped would fault. Keys and values are copied once into string
+  blocks owned by the dictionary, so there is no allocation per entry.
+
   The returned dictionary must be freed using iniparser_freedict().
  */
 /*--------------------------------------------------------------------------*/
 dictionary * iniparser_load(const char * ininame)
 {
-    FILE * in ;
-
-    char line    [ASCIILINESZ+1] ;
-    char section [ASCIILINESZ+1] ;
-    char key     [ASCIILINESZ+1] ;
-    char tmp     [ASCIILINESZ+1] ;
-    char val     [ASCIILINESZ+1] ;
-
-    int  last=0 ;
-    int  len ;
-    int  lineno=0 ;
-    int  errs=0;
+    struct stat st ;
+    char    *   map=NULL ;
+    char    *   p, * eol, * end ;
+    size_t      size, len=0 ;
+    ssize_t     rc ;
+    char    *   join=NULL ;
+    char    *   k, * v ;
+    size_t      joinlen=0, joinsz=0 ;
+    slice       line, key, val, section ;
+    int         fd, cont ;
+    int         lineno=0 ;
+    int         errs=0 ;
 
     dictionary * dict ;
 
-    if ((in=fopen(ininame, "r"))==NULL) {
+    if ((fd=open(ininame, O_RDONLY))<0) {
         fprintf(stderr, "iniparser: cannot open %s\n", ininame);
         return NULL ;
     }
+    if (fstat(fd, &st)<0) {
+        fprintf(stderr, "iniparser: cannot stat %s\n", ininame);
+        close(fd);
+        return NULL ;
+    }
+    /* Sized from the stat, grown only if the file grew since */
+    size = st.st_size + 1 ;
+    if ((map=(char *)malloc(size))==NULL) {
+        fprintf(stderr, "iniparser: memory allocation failure\n");
+        close(fd);
+        return NULL ;
+    }
+    while ((rc=read(fd, map+len, size-len))!=0) {
+        if (rc<0 && errno==EINTR)
+            continue ;
+        if (rc<0) {
+            fprintf(stderr, "iniparser: cannot read %s\n", ininame);
+            free(map);
+            close(fd);
+            return NULL ;
+        }
+        len += rc ;
+        if (len==size) {
+            size *= 2 ;
+            if ((p=(char *)realloc(map, size))==NULL) {
+                fprintf(stderr, "iniparser: memory allocation failure\n");
+                free(map);
+                close(fd);
+                return NULL ;
+            }
+            map = p ;
+        }
+    }
+    close(fd);
 
     dict = dictionary_new(0) ;
     if (!dict) {
-        fclose(in);
+        free(map);
         return NULL ;
     }
 
-    memset(line,    0, ASCIILINESZ);
-    memset(section, 0, ASCIILINESZ);
-    memset(key,     0, ASCIILINESZ);
-    memset(val,     0, ASCIILINESZ);
-    last=0 ;
+    section.p = "" ;
+    section.len = 0 ;
+    end = map + len ;
 
-    while (fgets(line+last, ASCIILINESZ-last, in)!=NULL) {
+    for (p=map ; p<end && errs>=0 ; p=eol+1) {
         lineno++ ;
-        len = (int)strlen(line)-1;
-        if (len==0)
-            continue;
-        /* Safety check against buffer overflows */
-        if (line[len]!='\n') {
-            fprintf(stderr,
-                    "iniparser: input line too long in %s (%d)\n",
-                    ininame,
-                    lineno);
-            dictionary_del(dict);
-            fclose(in);
-            return NULL ;
-        }
-        /* Get rid of \n and spaces at end of line */
-        while ((len>=0) &&
-                ((line[len]=='\n') || (isspace(line[len])))) {
-            line[len]=0 ;
-            len-- ;
+        if ((eol=memchr(p, '\n', end-p))==NULL)
+            eol = end ;
+        line.p = p ;
+        line.len = eol - p ;
+
+        /* Detect multi-line, gathering the pieces without their
+           backslashes until a line that does not continue */
+        cont = 0 ;
+        while (line.len>0 && isspace((unsigned char)line.p[line.len-1]))
+            line.len-- ;
+        if (line.len>0 && line.p[line.len-1]=='\\') {
+            line.len-- ;
+            cont = 1 ;
         }
-        /* Detect multi-line */
-        if (line[len]=='\\') {
-            /* Multi-line value */
-            last=len ;
-            continue ;
-        } else {
-            last=0 ;
+        if (cont || joinlen>0) {
+            if (joinlen + line.len > joinsz) {
+                joinsz = 2*(joinlen + line.len) ;
+                if ((k=(char *)realloc(join, joinsz))==NULL) {
+                    errs = -1 ;
+                    break ;
+                }
+                join = k ;
+            }
+            memcpy(join+joinlen, line.p, line.len);
+            joinlen += line.len ;
+            if (cont && eol<end)
+                continue ;
+            line.p = join ;
+            line.len = joinlen ;
+            joinlen = 0 ;
         }
-        switch (iniparser_line(line, section, key, val)) {
+
+        switch (iniparser_line(line, &key, &val)) {
             case LINE_EMPTY:
             case LINE_COMMENT:
             break ;
 
             case LINE_SECTION:
-            errs = dictionary_set(dict, section, NULL);
+            if (key.p==NULL) {
+                /* No name, stay in the current section */
+                errs = dictionary_set(dict, section.p, NULL) ;
+                break ;
+            }
+            if ((k=slice_copy(dict, NULL, &key, 1))==NULL
+                    || dictionary_put(dict, k, NULL)) {
+                errs = -1 ;
+                break ;
+            }
+            section.p = k ;
+            section.len = key.len ;
             break ;
 
             case LINE_VALUE:
-            sprintf(tmp, "%s:%s", section, key);
-            errs = dictionary_set(dict, tmp, val) ;
+            k = slice_copy(dict, &section, &key, 1);
+            v = slice_copy(dict, NULL, &val, 0);
+            if (k==NULL || v==NULL || dictionary_put(dict, k, v))
+                errs = -1 ;
             break ;
 
             case LINE_ERROR:
             fprintf(stderr, "iniparser: syntax error in %s (%d):\n",
                     ininame,
                     lineno);
-            fprintf(stderr, "-> %s\n", line);
+            fprintf(stderr, "-> %.*s\n", (int)line.len, line.p);
             errs++ ;
             break;
 
             default:
             break ;
         }
-        memset(line, 0, ASCIILINESZ);
-        last=0;
-        if (errs<0) {
-            fprintf(stderr, "iniparser: memory allocation failure\n");
-            break ;
-        }
+    }
+    if (errs<0) {
+        fprintf(stderr, "iniparser: memory allocation failure\n");
+    }
+    free(join);
+    free(map);
+
+    if (!errs && iniparser_index(dict)) {
+        fprintf(stderr, "iniparser: memory allocation failure\n");
+        errs = -1 ;
     }
     if (errs) {
         dictionary_del(dict);
         dict = NULL ;
     }
-    fclose(in);
     return dict ;
 }
 
@@ -745,4 +925,75 @@ void iniparser_freedict(dictionary * d)
     dictionary_del(d);
 }
 
+
+/* Benchmark code */
+#ifdef TESTINI
+#include <time.h>
+#define NSECS 10000
+
+static double elapsed(struct timespec * t0)
+{
+    struct timespec t1 ;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9 ;
+}
+
+int main(int argc, char *argv[])
+{
+    dictionary  *   d ;
+    struct timespec t0 ;
+    char        path[] = "/tmp/iniparser-XXXXXX" ;
+    char    *   name ;
+    char    *   key ;
+    FILE    *   f ;
+    int         i, j, fd, nsec, nkeys ;
+
+    if ((fd=mkstemp(path))<0 || (f=fdopen(fd, "w"))==NULL) {
+        perror("iniparser: cannot create test file");
+        return 1 ;
+    }
+    fprintf(f, "[main]\nlogin = someone\n");
+    for (i=0 ; i<NSECS ; i++)
+        fprintf(f, "\n[class%05d]\nname = Class %d\nday = Monday\ntime = 18:00\n",
+                i, i);
+    fclose(f);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    d = iniparser_load(path);
+    unlink(path);
+    if (d==NULL) {
+        printf("cannot load %d sections\n", NSECS+1);
+        return 1 ;
+    }
+    printf("load %d sections: %.3f ms\n", NSECS+1, elapsed(&t0) * 1e3);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    nsec = iniparser_getnsec(d);
+    for (i=0 ; i<nsec ; i++)
+        if (iniparser_getsecname(d, i)==NULL)
+            printf("cannot get section %d\n", i);
+    printf("getsecname %d sections: %.3f ms\n", nsec, elapsed(&t0) * 1e3);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    i = 0 ;
+    nkeys = 0 ;
+    while ((name=iniparser_itersec(d, &i))!=NULL) {
+        j = 0 ;
+        while ((key=iniparser_iterkey(d, name, &j, NULL))!=NULL)
+            nkeys++ ;
+    }
+    printf("iterate %d sections, %d keys: %.3f ms\n", i, nkeys,
+           elapsed(&t0) * 1e3);
+
+    /* Adding an entry drops the index, the next call rebuilds it */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    iniparser_set(d, "extra", NULL);
+    nsec = iniparser_getnsec(d);
+    printf("reindex %d sections: %.3f ms\n", nsec, elapsed(&t0) * 1e3);
+
+    iniparser_freedict(d);
+    return 0 ;
+}
+#endif
 /* vim: set ts=4 et sw=4 tw=75 */
@@ -67,6 +67,43 @@ int iniparser_getnsec(dictionary * d);
 char * iniparser_getsecname(dictionary * d, int n);
 
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Iterate over the sections of a dictionary.
+  @param    d   Dictionary to examine
+  @param    pos Iterator position, set to 0 before the first call
+  @return   Pointer to char string
+
+  Each call returns the name of the next section, in the order the
+  sections appear in the ini file, and NULL once there are no more.
+  Do not free or modify the returned string!
+
+  Sections are found through an index built when the file is loaded,
+  so walking all of them takes time linear in their number.
+ */
+/*--------------------------------------------------------------------------*/
+
+char * iniparser_itersec(dictionary * d, int * pos);
+
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Iterate over the keys of a section.
+  @param    d   Dictionary to examine
+  @param    s   Section name of dictionary to examine
+  @param    pos Iterator position, set to 0 before the first call
+  @param    val If not NULL, set to the value of the returned key
+  @return   Pointer to char string
+
+  Each call returns the next key of the section, as "section:key", in
+  the order the keys appear in the ini file, and NULL once there are no
+  more. Do not free or modify the returned strings!
+ */
+/*--------------------------------------------------------------------------*/
+
+char * iniparser_iterkey(dictionary * d, const char * s, int * pos, char ** val);
+
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Save a dictionary to a loadable ini file
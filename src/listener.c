@@ -0,0 +1,451 @@
+#include "common.h"
+#include "logging.h"
+#include "listener.h"
+#include "stall.h"
+#include <ev.h>
+#include <stdarg.h>
+#include <netdb.h>
+#include <sys/un.h>
+
+LOGSET("listener");
+
+#define LISTENER_LINE_MAX    4096
+#define LISTENER_CLIENTS_MAX 16
+#define LISTENER_IDLE        30.
+
+/* A local socket served from the default loop, a path for a unix socket
+ * or [host:]port for tcp, localhost unless a host is given and never
+ * anything but a loopback address. Clients send
+ * lines and get back whatever the handler writes. Everything runs at
+ * the lowest priority so it never holds up booking work */
+struct listener {
+  char *name;
+  char *path;
+  listener_fn fn;
+  void *data;
+  int nclients;
+  ev_io io;
+  LIST_HEAD(client_list, client) clients;
+};
+
+struct client {
+  listener_t owner;
+  int fd;
+  bool ending;
+  size_t inlen;
+  char in[LISTENER_LINE_MAX];
+  char *out;
+  size_t outlen;
+  size_t outpos;
+  size_t outsize;
+  ev_io rio;
+  ev_io wio;
+  ev_timer idle;
+  LIST_ENTRY(client) l;
+};
+
+static int listener_bind_unix(const char *path);
+static bool listener_loopback(const struct sockaddr *sa);
+static int listener_bind_tcp(const char *addr);
+static void client_free(client_t c);
+static void client_lines(client_t c, bool eof);
+static void listener_accept_event(EV_P_ ev_io *w, int revents);
+static void client_read_event(EV_P_ ev_io *w, int revents);
+static void client_write_event(EV_P_ ev_io *w, int revents);
+static void client_idle_event(EV_P_ ev_timer *w, int revents);
+
+
+
+static int listener_bind_unix(
+    const char *path)
+{
+  struct sockaddr_un sun = {0};
+  struct stat st;
+  int fd;
+
+  if (strlen(path) >= sizeof(sun.sun_path)) {
+    ELOG(ERROR, "Socket path %s is too long", path);
+    return -1;
+  }
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path);
+
+  /* Left behind by an earlier run */
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+      chmod(path, 0600) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+static bool listener_loopback(
+    const struct sockaddr *sa)
+{
+  if (sa->sa_family == AF_INET)
+    return (ntohl(((const struct sockaddr_in *)sa)->sin_addr.s_addr) >> 24)
+           == IN_LOOPBACKNET;
+  if (sa->sa_family == AF_INET6)
+    return IN6_IS_ADDR_LOOPBACK(&((const struct sockaddr_in6 *)sa)->sin6_addr);
+  return false;
+}
+
+
+/* Whatever is served says too much to be seen off the host */
+static int listener_bind_tcp(
+    const char *addr)
+{
+  struct addrinfo hints = {0}, *res = NULL;
+  char host[256] = "127.0.0.1";
+  const char *port = addr, *colon;
+  int fd = -1, one = 1;
+
+  colon = strrchr(addr, ':');
+  if (colon) {
+    if (colon - addr >= (int)sizeof(host)) {
+      errno = EINVAL;
+      return -1;
+    }
+    memcpy(host, addr, colon - addr);
+    host[colon - addr] = 0;
+    port = colon + 1;
+  }
+
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV;
+  if (getaddrinfo(host, port, &hints, &res) != 0 || !res) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (!listener_loopback(res->ai_addr)) {
+    ELOG(ERROR, "%s is not a loopback address", host);
+    errno = EADDRNOTAVAIL;
+    goto fin;
+  }
+
+  fd = socket(res->ai_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    goto fin;
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, res->ai_addr, res->ai_addrlen) < 0) {
+    close(fd);
+    fd = -1;
+  }
+
+fin:
+  freeaddrinfo(res);
+  return fd;
+}
+
+
+static void client_free(
+    client_t c)
+{
+  ev_io_stop(EV_DEFAULT, &c->rio);
+  ev_io_stop(EV_DEFAULT, &c->wio);
+  ev_timer_stop(EV_DEFAULT, &c->idle);
+  close(c->fd);
+
+  LIST_REMOVE(c, l);
+  c->owner->nclients--;
+  free(c->out);
+  free(c);
+}
+
+
+/* Hand each whole line to the handler. At the end of input whatever is
+ * left counts as a line too */
+static void client_lines(
+    client_t c,
+    bool eof)
+{
+  char *nl, *line = c->in;
+  size_t len;
+
+  while (!c->ending && (nl = memchr(line, '\n', c->inlen - (line - c->in)))) {
+    *nl = 0;
+    len = nl - line;
+    if (len && line[len-1] == '\r')
+      line[len-1] = 0;
+    c->owner->fn(c, line, c->owner->data);
+    line = nl + 1;
+  }
+
+  len = c->inlen - (line - c->in);
+  if (!c->ending && eof && len) {
+    line[len] = 0;
+    c->owner->fn(c, line, c->owner->data);
+    len = 0;
+  }
+  memmove(c->in, line, len);
+  c->inlen = len;
+}
+
+
+static void listener_accept_event(
+    EV_P_ ev_io *w,
+    int revents)
+{
+  listener_t l = w->data;
+  client_t c;
+  int fd;
+
+  STALL_TAG();
+
+  while ((fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) > -1) {
+    if (l->nclients >= LISTENER_CLIENTS_MAX) {
+      ELOG(WARNING, "Too many %s clients, refusing another", l->name);
+      close(fd);
+      continue;
+    }
+
+    c = calloc(1, sizeof(struct client));
+    if (!c) {
+      ELOGERR(WARNING, "Cannot allocate %s client", l->name);
+      close(fd);
+      continue;
+    }
+    c->owner = l;
+    c->fd = fd;
+
+    ev_io_init(&c->rio, client_read_event, fd, EV_READ);
+    ev_io_init(&c->wio, client_write_event, fd, EV_WRITE);
+    ev_timer_init(&c->idle, client_idle_event, 0., LISTENER_IDLE);
+    ev_set_priority(&c->rio, EV_MINPRI);
+    ev_set_priority(&c->wio, EV_MINPRI);
+    ev_set_priority(&c->idle, EV_MINPRI);
+    c->rio.data = c->wio.data = c->idle.data = c;
+
+    LIST_INSERT_HEAD(&l->clients, c, l);
+    l->nclients++;
+    ev_io_start(EV_A_ &c->rio);
+    ev_timer_again(EV_A_ &c->idle);
+  }
+
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    ELOGERR(WARNING, "Cannot accept %s client", l->name);
+}
+
+
+static void client_read_event(
+    EV_P_ ev_io *w,
+    int revents)
+{
+  client_t c = w->data;
+  ssize_t rc;
+
+  STALL_TAG();
+
+  rc = read(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen - 1);
+  if (rc < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return;
+    client_free(c);
+    return;
+  }
+
+  ev_timer_again(EV_A_ &c->idle);
+  c->inlen += rc;
+  client_lines(c, rc == 0);
+
+  if (rc == 0 || c->ending) {
+    client_end(c);
+    return;
+  }
+
+  if (c->inlen == sizeof(c->in) - 1) {
+    ELOG(WARNING, "Line from %s client too long, closing it", c->owner->name);
+    client_free(c);
+  }
+}
+
+
+static void client_write_event(
+    EV_P_ ev_io *w,
+    int revents)
+{
+  client_t c = w->data;
+  ssize_t rc;
+
+  STALL_TAG();
+
+  while (c->outpos < c->outlen) {
+    rc = write(c->fd, c->out + c->outpos, c->outlen - c->outpos);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (rc <= 0) {
+      client_free(c);
+      return;
+    }
+    c->outpos += rc;
+  }
+
+  c->outpos = c->outlen = 0;
+  ev_io_stop(EV_A_ &c->wio);
+  if (c->ending)
+    client_free(c);
+}
+
+
+static void client_idle_event(
+    EV_P_ ev_timer *w,
+    int revents)
+{
+  STALL_TAG();
+  client_free(w->data);
+}
+
+
+
+listener_t listener_open(
+    const char *name,
+    const char *addr,
+    listener_fn fn,
+    void *data)
+{
+  listener_t l;
+  int fd;
+
+  l = calloc(1, sizeof(struct listener));
+  if (!l) {
+    ELOGERR(ERROR, "Cannot allocate %s listener", name);
+    return NULL;
+  }
+  l->fn = fn;
+  l->data = data;
+  LIST_INIT(&l->clients);
+
+  l->name = strdup(name);
+  if (!l->name)
+    goto fail;
+
+  if (addr[0] == '/') {
+    l->path = strdup(addr);
+    if (!l->path)
+      goto fail;
+    fd = listener_bind_unix(addr);
+  }
+  else {
+    fd = listener_bind_tcp(addr);
+  }
+
+  if (fd < 0 || listen(fd, LISTENER_CLIENTS_MAX) < 0) {
+    ELOGERR(ERROR, "Cannot listen for %s on %s", name, addr);
+    if (fd > -1)
+      close(fd);
+    free(l->path);
+    l->path = NULL;
+    goto fail;
+  }
+
+  ev_io_init(&l->io, listener_accept_event, fd, EV_READ);
+  ev_set_priority(&l->io, EV_MINPRI);
+  l->io.data = l;
+  ev_io_start(EV_DEFAULT, &l->io);
+
+  ELOG(INFO, "Serving %s on %s", name, addr);
+  return l;
+
+fail:
+  free(l->path);
+  free(l->name);
+  free(l);
+  return NULL;
+}
+
+
+void listener_close(
+    listener_t l)
+{
+  client_t c;
+
+  if (!l)
+    return;
+
+  while ((c = LIST_FIRST(&l->clients)))
+    client_free(c);
+
+  ev_io_stop(EV_DEFAULT, &l->io);
+  close(l->io.fd);
+  if (l->path)
+    unlink(l->path);
+
+  free(l->path);
+  free(l->name);
+  free(l);
+}
+
+
+/* Queue output for the client, written as the socket takes it */
+void client_write(
+    client_t c,
+    const char *buf,
+    size_t len)
+{
+  size_t size;
+  char *p;
+
+  if (c->outlen + len > c->outsize) {
+    size = c->outsize ? c->outsize : 4096;
+    while (size < c->outlen + len)
+      size *= 2;
+    p = realloc(c->out, size);
+    if (!p) {
+      ELOGERR(WARNING, "Cannot allocate %s output", c->owner->name);
+      c->ending = true;
+      return;
+    }
+    c->out = p;
+    c->outsize = size;
+  }
+
+  memcpy(c->out + c->outlen, buf, len);
+  c->outlen += len;
+  ev_io_start(EV_DEFAULT, &c->wio);
+}
+
+
+void client_printf(
+    client_t c,
+    const char *fmt,
+    ...)
+{
+  char *buf = NULL;
+  va_list ap;
+  int len;
+
+  va_start(ap, fmt);
+  len = vasprintf(&buf, fmt, ap);
+  va_end(ap);
+
+  if (len < 0) {
+    ELOG(WARNING, "Cannot format %s output", c->owner->name);
+    return;
+  }
+  client_write(c, buf, len);
+  free(buf);
+}
+
+
+/* Close the client once its output is written, no more of its lines are
+ * handled */
+void client_end(
+    client_t c)
+{
+  c->ending = true;
+  ev_io_stop(EV_DEFAULT, &c->rio);
+  ev_io_start(EV_DEFAULT, &c->wio);
+}
@@ -0,0 +1,20 @@
+#ifndef _LISTENER_H_
+#define _LISTENER_H_
+
+#include "common.h"
+
+typedef struct listener * listener_t;
+typedef struct client * client_t;
+
+/* Given each line a client sends, without its line ending */
+typedef void (*listener_fn)(client_t c, char *line, void *data);
+
+listener_t listener_open(const char *name, const char *addr, listener_fn fn,
+                         void *data);
+void listener_close(listener_t l);
+
+void client_write(client_t c, const char *buf, size_t len);
+void client_printf(client_t c, const char *fmt, ...)
+                   __attribute__((format(printf, 2, 3)));
+void client_end(client_t c);
+#endif
@@ -1,18 +1,81 @@
 #include "common.h"
 
 #include <stdarg.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include "logging.h"
 
 LOGSET("logging")
 
-static int loglevel = 0;
+#define LOG_SLOTS 1024
+#define LOG_LINE_MAX 1024
+#define LOG_BATCH 64
+#define LOG_REPEATS 64
+#define LOG_REPEAT_MSG 256
+
+/* Lines are formatted by whoever logs them into a ring of slots and
+ * written out by one thread in batches. Each slot carries a sequence
+ * number so producers claim slots with a compare and swap and never
+ * wait on each other or on the disk */
+struct log_slot {
+  size_t seq;
+  int len;
+  char line[LOG_LINE_MAX];
+};
+
+/* A message logged with ELOGKEY, kept while it repeats */
+struct log_repeat {
+  uint64_t hash;
+  const char *file;
+  const char *func;
+  const char *type;
+  int lineno;
+  int level;
+  int key;
+  time_t first;
+  unsigned long repeats;
+  char msg[LOG_REPEAT_MSG];
+};
+
+int log_level = 0;
+
+static struct log_slot ring[LOG_SLOTS];
+static int running = 0;
+static size_t head = 0;
+static size_t tail = 0;
+static int wakefd = -1;
+static int sleeping = 0;
+static int stopping = 0;
+static uint64_t dropped = 0;
+static pthread_t writer;
+
+static pthread_mutex_t repeat_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_repeat repeats[LOG_REPEATS];
+static int repeat_interval = 0;
+static uint64_t suppressed = 0;
+
+static __thread time_t stampsec = 0;
+static __thread char stamp[32];
+
+static const char * log_stamp(void);
+static void log_write(const char *line, int len);
+static void log_wake(void);
+static void log_push(int level, const char *line, int len);
+static int log_drain(void);
+static void * log_writer(void *data);
+static uint64_t log_repeat_hash(const char *file, int lineno, int key,
+                                const char *msg);
+static void log_repeat_summary(struct log_repeat *r, time_t now);
+static void log_repeat_sweep(time_t now, bool all);
 
 
 /* Retrieve the currently set log level */
 int log_getlevel(
     void)
 {
-  return loglevel;
+  return log_level;
 }
 
 
@@ -22,12 +85,341 @@ int log_getlevel(
 void log_setlevel(
     int level)
 {
-  loglevel = level;
+  __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
   ELOG(VERBOSE, "Log level set to %d", level);
 }
 
 
 
+/* Repeats of an ELOGKEY line are summed up once every this many
+ * seconds, zero writes every line */
+void log_setrepeat(
+    int seconds)
+{
+  pthread_mutex_lock(&repeat_lock);
+  log_repeat_sweep(time(NULL), true);
+  __atomic_store_n(&repeat_interval, seconds > 0 ? seconds : 0,
+                   __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&repeat_lock);
+}
+
+
+/* How many lines have been left out as repeats */
+uint64_t log_suppressed(
+    void)
+{
+  return __atomic_load_n(&suppressed, __ATOMIC_RELAXED);
+}
+
+
+
+/* The time is only formatted again when the second changes */
+static const char * log_stamp(
+    void)
+{
+  struct tm tmnow;
+  time_t now = time(NULL);
+
+  if (now != stampsec) {
+    localtime_r(&now, &tmnow);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tmnow);
+    stampsec = now;
+  }
+  return stamp;
+}
+
+
+static void log_write(
+    const char *line,
+    int len)
+{
+  int fd = fileno(stderr);
+  ssize_t rc;
+
+  while (len > 0) {
+    rc = write(fd, line, len);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc <= 0)
+      return;
+    line += rc;
+    len -= rc;
+  }
+}
+
+
+static void log_wake(
+    void)
+{
+  uint64_t one = 1;
+
+  if (write(wakefd, &one, sizeof(one)) < 0)
+    return;
+}
+
+
+/* Queue a line for the writer. When the ring is full anything worse
+ * than INFO is written straight away and the rest is dropped */
+static void log_push(
+    int level,
+    const char *line,
+    int len)
+{
+  struct log_slot *slot;
+  size_t pos;
+  intptr_t diff;
+
+  pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  for (;;) {
+    slot = &ring[pos % LOG_SLOTS];
+    diff = (intptr_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&head, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (diff < 0) {
+      if (level <= WARNING)
+        log_write(line, len);
+      else
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    else {
+      pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    }
+  }
+
+  memcpy(slot->line, line, len);
+  slot->len = len;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+  if (__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST))
+    log_wake();
+}
+
+
+/* Write every line that is ready with as few calls as we can, returns
+ * how many were written */
+static int log_drain(
+    void)
+{
+  struct iovec iov[LOG_BATCH + 1];
+  struct log_slot *slot;
+  char note[128];
+  uint64_t lost;
+  size_t pos = tail;
+  int n, i, total = 0;
+  ssize_t rc;
+
+  for (;;) {
+    n = 0;
+    lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+    if (lost) {
+      iov[n].iov_base = note;
+      iov[n++].iov_len = snprintf(note, sizeof(note),
+                                  "%s: (%s) %lu log lines dropped\n",
+                                  log_stamp(), __logtype, (unsigned long)lost);
+    }
+
+    for (i=0; i < LOG_BATCH; i++) {
+      slot = &ring[(pos + i) % LOG_SLOTS];
+      if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + i + 1)
+        break;
+      iov[n].iov_base = slot->line;
+      iov[n++].iov_len = slot->len;
+    }
+    if (n == 0)
+      break;
+
+    do {
+      rc = writev(fileno(stderr), iov, n);
+    } while (rc < 0 && errno == EINTR);
+
+    /* Whatever a short write left is finished off a line at a time */
+    for (; rc >= 0 && n > 0; n--) {
+      if (rc >= (ssize_t)iov[0].iov_len) {
+        rc -= iov[0].iov_len;
+      }
+      else {
+        log_write((char *)iov[0].iov_base + rc, iov[0].iov_len - rc);
+        rc = 0;
+      }
+      memmove(iov, iov + 1, sizeof(struct iovec) * (n - 1));
+    }
+
+    /* Hand the slots back to the producers */
+    while (i-- > 0) {
+      slot = &ring[pos % LOG_SLOTS];
+      __atomic_store_n(&slot->seq, pos + LOG_SLOTS, __ATOMIC_RELEASE);
+      pos++;
+      total++;
+    }
+    __atomic_store_n(&tail, pos, __ATOMIC_RELEASE);
+  }
+  return total;
+}
+
+
+static void * log_writer(
+    void *data)
+{
+  uint64_t val;
+  sigset_t all;
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, NULL);
+  pthread_setname_np(pthread_self(), "abbeyd/log");
+
+  while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+    if (log_drain())
+      continue;
+
+    /* Look once more after saying we are going to sleep, so a line
+     * pushed in between is either seen here or wakes us */
+    __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+    if (!log_drain() && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+      if (read(wakefd, &val, sizeof(val)) < 0 && errno != EINTR)
+        break;
+    }
+    __atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+  }
+
+  log_drain();
+  return NULL;
+}
+
+
+/* FNV-1a over the call site, the key and the message */
+static uint64_t log_repeat_hash(
+    const char *file,
+    int lineno,
+    int key,
+    const char *msg)
+{
+  uint64_t h = 0xcbf29ce484222325ull;
+  uintptr_t site = (uintptr_t)file;
+  int i;
+
+  for (i=0; i < (int)sizeof(site); i++)
+    h = (h ^ ((site >> (i * 8)) & 0xff)) * 0x100000001b3ull;
+  h = (h ^ (uint32_t)lineno) * 0x100000001b3ull;
+  h = (h ^ (uint32_t)key) * 0x100000001b3ull;
+  for (; *msg; msg++)
+    h = (h ^ (unsigned char)*msg) * 0x100000001b3ull;
+  return h;
+}
+
+
+static void log_repeat_summary(
+    struct log_repeat *r,
+    time_t now)
+{
+  if (!r->repeats)
+    return;
+  log_err(r->file, r->func, r->lineno, r->level, r->type, -1,
+          "%s (repeated %lu times in %ld seconds)", r->msg, r->repeats,
+          (long)(now - r->first));
+}
+
+
+/* Sum up whatever has repeated for a whole interval and forget messages
+ * that have stopped. Called with the repeat lock held */
+static void log_repeat_sweep(
+    time_t now,
+    bool all)
+{
+  struct log_repeat *r;
+  int i;
+
+  for (i=0; i < LOG_REPEATS; i++) {
+    r = &repeats[i];
+    if (!r->file)
+      continue;
+    if (!all && now - r->first < repeat_interval)
+      continue;
+
+    log_repeat_summary(r, now);
+    if (r->repeats && !all) {
+      r->repeats = 0;
+      r->first = now;
+    }
+    else {
+      r->file = NULL;
+    }
+  }
+}
+
+
+
+/* Start the writer thread, until then lines are written directly */
+void log_init(
+    void)
+{
+  size_t i;
+
+  if (running)
+    return;
+
+  for (i=0; i < LOG_SLOTS; i++)
+    ring[(head + i) % LOG_SLOTS].seq = head + i;
+  tail = head;
+
+  wakefd = eventfd(0, EFD_CLOEXEC);
+  if (wakefd < 0)
+    return;
+
+  if (pthread_create(&writer, NULL, log_writer, NULL)) {
+    close(wakefd);
+    wakefd = -1;
+    return;
+  }
+
+  __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+  atexit(log_destroy);
+}
+
+
+/* Wait until everything queued so far is written */
+void log_flush(
+    void)
+{
+  size_t want;
+
+  if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    return;
+
+  want = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+  while ((intptr_t)(__atomic_load_n(&tail, __ATOMIC_ACQUIRE) - want) < 0) {
+    if (__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST))
+      log_wake();
+    sched_yield();
+  }
+}
+
+
+/* Write out whatever is left and stop the writer. Lines logged from
+ * here on are written directly */
+void log_destroy(
+    void)
+{
+  pthread_mutex_lock(&repeat_lock);
+  log_repeat_sweep(time(NULL), true);
+  pthread_mutex_unlock(&repeat_lock);
+
+  if (!__atomic_exchange_n(&running, 0, __ATOMIC_ACQ_REL))
+    return;
+
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+  log_wake();
+  pthread_join(writer, NULL);
+
+  close(wakefd);
+  wakefd = -1;
+  stopping = 0;
+}
+
+
 /* Print an error */
 void log_err(
     const char *file,
@@ -39,56 +431,124 @@ void log_err(
     char *fmt,
     ...)
 {
-  int rc;
-  time_t now;
-  char fmtstr[1024];
-  struct tm tmnow;
-  char thetime[96];
+  int len, rc;
+  char line[LOG_LINE_MAX];
   char errbuf[96];
-
-  memset(fmtstr, 0, sizeof(fmtstr));
+  const char *thetime;
+  va_list ap;
 
   if (level > log_getlevel())
     return;
 
-  va_list ap;
+  thetime = log_stamp();
 
-  /* Format the time */
-  now = time(NULL);
-  memset(thetime, 0, sizeof(thetime));
-  localtime_r(&now, &tmnow);
-  strftime(thetime, 95, "%Y-%m-%d %H:%M:%S", &tmnow);
+  if (level >= DEBUG)
+    len = snprintf(line, sizeof(line), "%s: (%s) <%s:%s:%d> ",
+                   thetime, type, file, func, lineno);
+  else
+    len = snprintf(line, sizeof(line), "%s: (%s) ", thetime, type);
+  assert(len > 0);
+
+  va_start(ap, fmt);
+  rc = vsnprintf(line + len, sizeof(line) - len, fmt, ap);
+  va_end(ap);
+  if (rc > 0)
+    len += rc;
+  if (len > (int)sizeof(line) - 1)
+    len = sizeof(line) - 1;
 
   if (err > -1) {
-    memset(errbuf, 0, sizeof(errbuf));
+    errbuf[0] = 0;
     strerror_r(err, errbuf, sizeof(errbuf)-1);
+    rc = snprintf(line + len, sizeof(line) - len, ": %s", errbuf);
+    if (rc > 0)
+      len += rc;
+    if (len > (int)sizeof(line) - 1)
+      len = sizeof(line) - 1;
   }
 
-  if (level >= DEBUG) {
-    if (err > -1) {
-      rc = snprintf(fmtstr, sizeof(fmtstr), "%s: (%s) <%s:%s:%d> %s: %s",
-             thetime, type, file, func, lineno, fmt, errbuf);
-    }
-    else {
-      rc = snprintf(fmtstr, sizeof(fmtstr), "%s: (%s) <%s:%s:%d> %s\n",
-             thetime, type, file, func, lineno, fmt);
-    }
+  /* Some callers end their message with a newline of their own */
+  if (len == sizeof(line) - 1)
+    len--;
+  if (line[len-1] != '\n')
+    line[len++] = '\n';
+
+  /* Until the writer is running, or once it is gone, write directly */
+  if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    log_write(line, len);
+    return;
   }
-  else {
-    if (err > -1) {
-      rc = snprintf(fmtstr, sizeof(fmtstr), "%s: (%s) %s: %s\n",
-               thetime, type, fmt, errbuf);
+
+  log_push(level, line, len);
+}
+
+
+/* Print an error, unless the same message from the same place about the
+ * same key was printed less than an interval ago */
+void log_key(
+    const char *file,
+    const char *func,
+    int lineno,
+    int level,
+    const char *type,
+    int key,
+    char *fmt,
+    ...)
+{
+  char msg[LOG_REPEAT_MSG];
+  struct log_repeat *r, *slot = NULL;
+  time_t now;
+  uint64_t hash;
+  va_list ap;
+  int i;
+
+  va_start(ap, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+
+  if (!__atomic_load_n(&repeat_interval, __ATOMIC_RELAXED))
+    goto print;
+
+  now = time(NULL);
+  hash = log_repeat_hash(file, lineno, key, msg);
+
+  pthread_mutex_lock(&repeat_lock);
+  log_repeat_sweep(now, false);
+
+  for (i=0; i < LOG_REPEATS; i++) {
+    r = &repeats[i];
+    if (!r->file) {
+      if (!slot || slot->file)
+        slot = r;
+      continue;
     }
-    else {
-      rc = snprintf(fmtstr, sizeof(fmtstr), "%s: (%s) %s\n",
-             thetime, type, fmt);
+    if (r->hash == hash && r->file == file && r->lineno == lineno &&
+        r->key == key && strcmp(r->msg, msg) == 0) {
+      r->repeats++;
+      __atomic_add_fetch(&suppressed, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&repeat_lock);
+      return;
     }
+    if (!slot || (slot->file && r->first < slot->first))
+      slot = r;
   }
-  assert(rc > 0);
 
-  va_start(ap, fmt);
-  vfprintf(stderr, fmtstr, ap);
-  va_end(ap);
+  /* With no room, the oldest message is summed up early */
+  if (slot->file)
+    log_repeat_summary(slot, now);
+
+  slot->hash = hash;
+  slot->file = file;
+  slot->func = func;
+  slot->type = type;
+  slot->lineno = lineno;
+  slot->level = level;
+  slot->key = key;
+  slot->first = now;
+  slot->repeats = 0;
+  memcpy(slot->msg, msg, sizeof(msg));
+  pthread_mutex_unlock(&repeat_lock);
 
-  return;
+print:
+  log_err(file, func, lineno, level, type, -1, "%s", msg);
 }
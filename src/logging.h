@@ -4,8 +4,11 @@
 #include "common.h"
 
 #define LOGSET(type) static const char * __logtype = type;
-#define ELOG(levl, fmt, ...) log_err(__FILE__, __func__, __LINE__, levl, __logtype, -1, fmt, ##__VA_ARGS__)
-#define ELOGERR(levl, fmt, ...) log_err(__FILE__, __func__, __LINE__, levl, __logtype, errno, fmt, ##__VA_ARGS__)
+#define ELOG(levl, fmt, ...) do { if (log_wants(levl)) log_err(__FILE__, __func__, __LINE__, levl, __logtype, -1, fmt, ##__VA_ARGS__); } while (0)
+#define ELOGERR(levl, fmt, ...) do { if (log_wants(levl)) log_err(__FILE__, __func__, __LINE__, levl, __logtype, errno, fmt, ##__VA_ARGS__); } while (0)
+/* For lines logged over and over, repeats of the same message from the
+ * same place about the same key are counted rather than written */
+#define ELOGKEY(levl, key, fmt, ...) do { if (log_wants(levl)) log_key(__FILE__, __func__, __LINE__, levl, __logtype, key, fmt, ##__VA_ARGS__); } while (0)
 
 #define DEBUG3 800
 #define DEBUG2 400
@@ -16,9 +19,31 @@
 #define ERROR 0
 #define CRITICAL -100
 
+/* Anything less important than this is compiled out altogether, build
+ * with -DLOG_MAXLEVEL=DEBUG3 to keep the debug logging */
+#ifndef LOG_MAXLEVEL
+#define LOG_MAXLEVEL VERBOSE
+#endif
+
+extern int log_level;
+
+/* Checked before the arguments are evaluated, with a constant level the
+ * first half folds away */
+static inline bool log_wants(
+    int level)
+{
+  return level <= LOG_MAXLEVEL &&
+         level <= __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+}
 
+void log_init(void);
+void log_flush(void);
+void log_destroy(void);
 void log_setlevel(int level);
 int log_getlevel(void);
+void log_setrepeat(int seconds);
+uint64_t log_suppressed(void);
 
 void log_err(const char *file, const char *func, int lineno, int level, const char *type, int err, char *fmt, ...);
+void log_key(const char *file, const char *func, int lineno, int level, const char *type, int key, char *fmt, ...);
 #endif
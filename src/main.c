@@ -5,7 +5,16 @@
 #include "website.h"
 #include "logging.h"
 #include "periodic.h"
+#include "release.h"
+#include "quiet.h"
+#include "stall.h"
 #include "bookings.h"
+#include "timetable.h"
+#include "shards.h"
+#include "signals.h"
+#include "events.h"
+#include "metrics.h"
+#include "control.h"
 #include <ev.h>
 
 LOGSET("abbeyd")
@@ -23,26 +32,44 @@ int main(
   else
     configfile = argv[1];
 
+  log_init();
   config_parse(configfile);
+  events_init();
   database_init();
   website_init();
+  timetable_init();
+  shards_init(config_get_shards());
   periodic_init();
+  release_init();
+  quiet_init();
   waitq_init();
   signals_init();
+  metrics_init();
+  control_init();
 
+  stall_attach(EV_DEFAULT, "main");
   bookings_check();
 
   ev_run(EV_DEFAULT, 0);
 
   ELOG(VERBOSE, "Exited main loop");
 
+  stall_detach(EV_DEFAULT);
+  shards_destroy();
   waitq_flush();
   signals_destroy();
+  quiet_destroy();
+  release_destroy();
   periodic_destroy();
+  timetable_destroy();
   database_destroy();
   website_destroy();
+  events_destroy();
+  control_destroy();
+  metrics_destroy();
   config_unload();
 
   ELOG(INFO, "Service is finished");
+  log_destroy();
   return 0;
 }
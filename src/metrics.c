@@ -0,0 +1,334 @@
+#include "common.h"
+#include "config.h"
+#include "class.h"
+#include "logging.h"
+#include "hist.h"
+#include "stall.h"
+#include "quiet.h"
+#include "waitq.h"
+#include "website.h"
+#include "listener.h"
+#include "metrics.h"
+
+LOGSET("metrics");
+
+/* Counters and histograms are kept per thread, each threads set on its
+ * own cache lines, so the shards and the default loop record without
+ * sharing a line. A scrape adds the threads together and reads the
+ * gauges it wants from the modules that own them, in the Prometheus text
+ * format */
+static const char *endpoints[METRIC_ENDPOINTS] = {
+  "login", "sendlogin", "logout", "locations", "club", "configuration",
+  "subtypes", "timetable", "price", "book", "wait", "commit",
+  "warm",
+};
+
+/* The decisions events.c writes, anything else is counted as other */
+static const char *decisions[] = {
+  "known", "priced", "waiting", "waitlisted", "failed", "booked",
+  "missed", "rebooked", "uncommitted", "other",
+};
+#define METRIC_DECISIONS (sizeof(decisions) / sizeof(decisions[0]))
+
+struct metrics_thread {
+  uint64_t requests[METRIC_ENDPOINTS];
+  uint64_t errors[METRIC_ENDPOINTS];
+  uint64_t decisions[METRIC_DECISIONS];
+  struct hist http[METRIC_ENDPOINTS];
+  struct hist db;
+  LIST_ENTRY(metrics_thread) l;
+} __attribute__((aligned(64)));
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(metrics_threads, metrics_thread) threads =
+                                          LIST_HEAD_INITIALIZER(threads);
+static __thread struct metrics_thread *mine = NULL;
+static listener_t listener = NULL;
+
+static struct metrics_thread * metrics_self(void);
+static inline void metric_bump(uint64_t *c);
+static void metrics_hist(FILE *f, const char *name, const char *label,
+                         const char *value, struct hist *h);
+static char * metrics_render(size_t *len);
+static void metrics_request(client_t c, char *line, void *data);
+
+
+
+/* The calling threads counters, made the first time it records */
+static struct metrics_thread * metrics_self(
+    void)
+{
+  struct metrics_thread *m;
+  int i;
+
+  if (mine)
+    return mine;
+
+  m = aligned_alloc(64, sizeof(struct metrics_thread));
+  if (!m) {
+    ELOGERR(CRITICAL, "Cannot allocate metrics");
+    exit(EXIT_FAILURE);
+  }
+  memset(m, 0, sizeof(struct metrics_thread));
+  for (i=0; i < METRIC_ENDPOINTS; i++)
+    hist_init(&m->http[i], endpoints[i]);
+  hist_init(&m->db, "db");
+
+  pthread_mutex_lock(&lock);
+  LIST_INSERT_HEAD(&threads, m, l);
+  pthread_mutex_unlock(&lock);
+
+  mine = m;
+  return m;
+}
+
+
+/* Only the owning thread writes, so no locked add is needed, only a
+ * store a scrape cannot see torn */
+static inline void metric_bump(
+    uint64_t *c)
+{
+  __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + 1,
+                   __ATOMIC_RELAXED);
+}
+
+
+static void metrics_hist(
+    FILE *f,
+    const char *name,
+    const char *label,
+    const char *value,
+    struct hist *h)
+{
+  char sel[128] = "";
+  uint64_t seen = 0;
+  int b;
+
+  if (label)
+    snprintf(sel, sizeof(sel), "%s=\"%s\",", label, value);
+
+  for (b=0; b < HIST_BUCKETS; b++) {
+    seen += h->buckets[b];
+    fprintf(f, "%s_bucket{%sle=\"%g\"} %lu\n", name, sel,
+            (double)(2ull << b) / 1000000., (unsigned long)seen);
+  }
+  fprintf(f, "%s_bucket{%sle=\"+Inf\"} %lu\n", name, sel,
+          (unsigned long)h->count);
+
+  if (label)
+    sel[strlen(sel) - 1] = 0;
+  fprintf(f, "%s_sum%s%s%s %.6f\n", name, *sel ? "{" : "", sel,
+          *sel ? "}" : "", (double)h->sum_us / 1000000.);
+  fprintf(f, "%s_count%s%s%s %lu\n", name, *sel ? "{" : "", sel,
+          *sel ? "}" : "", (unsigned long)h->count);
+}
+
+
+/* Sum every thread into one set and write it out */
+static char * metrics_render(
+    size_t *len)
+{
+  struct metrics_thread *m, sum;
+  struct hist *lag = stall_hist();
+  char *buf = NULL;
+  FILE *f;
+  size_t i;
+  int b;
+
+  memset(&sum, 0, sizeof(sum));
+  pthread_mutex_lock(&lock);
+  LIST_FOREACH(m, &threads, l) {
+    for (i=0; i < METRIC_ENDPOINTS; i++) {
+      sum.requests[i] += __atomic_load_n(&m->requests[i], __ATOMIC_RELAXED);
+      sum.errors[i] += __atomic_load_n(&m->errors[i], __ATOMIC_RELAXED);
+      sum.http[i].count += __atomic_load_n(&m->http[i].count, __ATOMIC_RELAXED);
+      sum.http[i].sum_us += __atomic_load_n(&m->http[i].sum_us, __ATOMIC_RELAXED);
+      for (b=0; b < HIST_BUCKETS; b++)
+        sum.http[i].buckets[b] += __atomic_load_n(&m->http[i].buckets[b],
+                                                  __ATOMIC_RELAXED);
+    }
+    for (i=0; i < METRIC_DECISIONS; i++)
+      sum.decisions[i] += __atomic_load_n(&m->decisions[i], __ATOMIC_RELAXED);
+
+    sum.db.count += __atomic_load_n(&m->db.count, __ATOMIC_RELAXED);
+    sum.db.sum_us += __atomic_load_n(&m->db.sum_us, __ATOMIC_RELAXED);
+    for (b=0; b < HIST_BUCKETS; b++)
+      sum.db.buckets[b] += __atomic_load_n(&m->db.buckets[b], __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&lock);
+
+  f = open_memstream(&buf, len);
+  if (!f) {
+    ELOGERR(WARNING, "Cannot render metrics");
+    return NULL;
+  }
+
+  fprintf(f, "# HELP abbeyd_http_requests_total Requests made to the site.\n"
+             "# TYPE abbeyd_http_requests_total counter\n");
+  for (i=0; i < METRIC_ENDPOINTS; i++)
+    fprintf(f, "abbeyd_http_requests_total{endpoint=\"%s\"} %lu\n",
+            endpoints[i], (unsigned long)sum.requests[i]);
+
+  fprintf(f, "# HELP abbeyd_http_request_errors_total Requests that failed "
+             "or got an error status.\n"
+             "# TYPE abbeyd_http_request_errors_total counter\n");
+  for (i=0; i < METRIC_ENDPOINTS; i++)
+    fprintf(f, "abbeyd_http_request_errors_total{endpoint=\"%s\"} %lu\n",
+            endpoints[i], (unsigned long)sum.errors[i]);
+
+  fprintf(f, "# HELP abbeyd_http_request_duration_seconds Time taken by "
+             "requests to the site.\n"
+             "# TYPE abbeyd_http_request_duration_seconds histogram\n");
+  for (i=0; i < METRIC_ENDPOINTS; i++) {
+    if (sum.http[i].count)
+      metrics_hist(f, "abbeyd_http_request_duration_seconds", "endpoint",
+                   endpoints[i], &sum.http[i]);
+  }
+
+  fprintf(f, "# HELP abbeyd_booking_decisions_total Booking decisions by "
+             "outcome.\n"
+             "# TYPE abbeyd_booking_decisions_total counter\n");
+  for (i=0; i < METRIC_DECISIONS; i++)
+    fprintf(f, "abbeyd_booking_decisions_total{decision=\"%s\"} %lu\n",
+            decisions[i], (unsigned long)sum.decisions[i]);
+
+  fprintf(f, "# HELP abbeyd_db_duration_seconds Time taken by database "
+             "statements.\n"
+             "# TYPE abbeyd_db_duration_seconds histogram\n");
+  metrics_hist(f, "abbeyd_db_duration_seconds", NULL, NULL, &sum.db);
+
+  fprintf(f, "# HELP abbeyd_loop_lag_seconds Time taken by each pass of an "
+             "event loop.\n"
+             "# TYPE abbeyd_loop_lag_seconds histogram\n");
+  metrics_hist(f, "abbeyd_loop_lag_seconds", NULL, NULL, lag);
+
+  fprintf(f, "# HELP abbeyd_waitq_depth Classes on the waiting list.\n"
+             "# TYPE abbeyd_waitq_depth gauge\n"
+             "abbeyd_waitq_depth %d\n", waitq_size());
+
+  fprintf(f, "# HELP abbeyd_clock_offset_seconds Seconds the site's clock "
+             "is ahead of ours.\n"
+             "# TYPE abbeyd_clock_offset_seconds gauge\n"
+             "abbeyd_clock_offset_seconds %d\n", website_clock_skew());
+
+  fprintf(f, "# HELP abbeyd_quiet_deferrals_total Housekeeping held back "
+             "near a wake up.\n"
+             "# TYPE abbeyd_quiet_deferrals_total counter\n"
+             "abbeyd_quiet_deferrals_total %d\n", quiet_deferrals());
+
+  fprintf(f, "# HELP abbeyd_log_suppressed_total Repeated log lines left "
+             "out.\n"
+             "# TYPE abbeyd_log_suppressed_total counter\n"
+             "abbeyd_log_suppressed_total %lu\n",
+             (unsigned long)log_suppressed());
+
+  if (fclose(f) != 0) {
+    ELOGERR(WARNING, "Cannot render metrics");
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+
+/* Enough of HTTP for a scraper, the reply goes once the headers end */
+static void metrics_request(
+    client_t c,
+    char *line,
+    void *data)
+{
+  char *body;
+  size_t len;
+
+  if (*line)
+    return;
+
+  body = metrics_render(&len);
+  if (!body) {
+    client_printf(c, "HTTP/1.0 500 Internal Server Error\r\n"
+                     "Content-Length: 0\r\nConnection: close\r\n\r\n");
+    client_end(c);
+    return;
+  }
+
+  client_printf(c, "HTTP/1.0 200 OK\r\n"
+                   "Content-Type: text/plain; version=0.0.4\r\n"
+                   "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+  client_write(c, body, len);
+  client_end(c);
+  free(body);
+}
+
+
+
+void metrics_init(
+    void)
+{
+  metrics_listen(config_get_metrics());
+}
+
+
+/* Serve on another address, an empty one stops serving */
+void metrics_listen(
+    const char *addr)
+{
+  listener_close(listener);
+  listener = NULL;
+
+  if (addr && *addr)
+    listener = listener_open("metrics", addr, metrics_request, NULL);
+}
+
+
+/* Only once every thread that records has stopped */
+void metrics_destroy(
+    void)
+{
+  struct metrics_thread *m;
+
+  listener_close(listener);
+  listener = NULL;
+
+  pthread_mutex_lock(&lock);
+  while ((m = LIST_FIRST(&threads))) {
+    LIST_REMOVE(m, l);
+    free(m);
+  }
+  pthread_mutex_unlock(&lock);
+  mine = NULL;
+}
+
+
+void metric_request(
+    enum metric_endpoint ep,
+    double seconds,
+    bool ok)
+{
+  struct metrics_thread *m = metrics_self();
+
+  metric_bump(&m->requests[ep]);
+  if (!ok)
+    metric_bump(&m->errors[ep]);
+  hist_add(&m->http[ep], seconds);
+}
+
+
+void metric_decision(
+    const char *decision)
+{
+  struct metrics_thread *m = metrics_self();
+  size_t i;
+
+  for (i=0; i < METRIC_DECISIONS - 1; i++) {
+    if (strcmp(decisions[i], decision) == 0)
+      break;
+  }
+  metric_bump(&m->decisions[i]);
+}
+
+
+void metric_db(
+    double seconds)
+{
+  hist_add(&metrics_self()->db, seconds);
+}
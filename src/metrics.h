@@ -0,0 +1,31 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "common.h"
+
+/* The site requests we count, each as its own label */
+enum metric_endpoint {
+  METRIC_LOGIN,
+  METRIC_SENDLOGIN,
+  METRIC_LOGOUT,
+  METRIC_LOCATIONS,
+  METRIC_CLUB,
+  METRIC_CONFIGURATION,
+  METRIC_SUBTYPES,
+  METRIC_TIMETABLE,
+  METRIC_PRICE,
+  METRIC_BOOK,
+  METRIC_WAIT,
+  METRIC_COMMIT,
+  METRIC_WARM,
+  METRIC_ENDPOINTS,
+};
+
+void metrics_init(void);
+void metrics_listen(const char *addr);
+void metrics_destroy(void);
+
+void metric_request(enum metric_endpoint ep, double seconds, bool ok);
+void metric_decision(const char *decision);
+void metric_db(double seconds);
+#endif
@@ -0,0 +1,817 @@
+#include "common.h"
+#include "series.h"
+#include <ev.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <json-c/json.h>
+#include <sqlite3.h>
+
+/* A stand in for the booking site, enough of it for abbeyd to log in,
+ * read the timetable and book, served on localhost over plain HTTP.
+ * Point abbeyd at it with base_url = http://127.0.0.1:8099
+ *
+ *   abbeyd-mock [-p port] [-l location] [-n classes] [-d days]
+ *               [-w seconds] [-s shards] [-t seconds] [-b abbeyd]
+ *
+ * It holds a set of classes starting days after a release instant, on
+ * the first minute at least -w seconds away. Until then they are listed
+ * as full and bookings for them are turned away. On exit it prints how
+ * long after the release each class got into the basket and was
+ * confirmed, in milliseconds.
+ *
+ * With -b it is a benchmark: it writes a config and an empty database to
+ * a directory of its own, runs the given abbeyd against itself and stops
+ * once every class is confirmed or -t seconds after the release */
+
+#define MOCK_PORT         8099
+#define MOCK_LOCATION     "Newmarket"
+#define MOCK_CLASSES      10
+#define MOCK_DAYS         1
+#define MOCK_WARMUP       30
+#define MOCK_TIMEOUT      60
+#define MOCK_CLUB         12
+#define MOCK_MEMBER       999
+#define MOCK_FIRST_ID     1001
+#define MOCK_REQUEST_MAX  65536
+
+#define MOCK_SCHEMA "CREATE TABLE IF NOT EXISTS bookings (username text, " \
+                    "bookingid int, name text, date text, booked text, " \
+                    "slots int, cancelled int default 0)"
+
+struct mock_class {
+  int id;
+  char name[32];
+  time_t start;
+  ev_tstamp basket;
+  ev_tstamp confirmed;
+  bool cold;
+};
+
+struct conn {
+  int fd;
+  bool closing;
+  int served;
+  char *in;
+  size_t inlen;
+  size_t insize;
+  char *out;
+  size_t outlen;
+  size_t outpos;
+  size_t outsize;
+  ev_io rio;
+  ev_io wio;
+  LIST_ENTRY(conn) l;
+};
+
+static struct mock_class *classes = NULL;
+static int nclasses = MOCK_CLASSES;
+static const char *location = MOCK_LOCATION;
+static time_t release_at;
+static int refused = 0;
+static int requests = 0;
+static int connections = 0;
+static bool relisted = false;
+static LIST_HEAD(conn_list, conn) conns = LIST_HEAD_INITIALIZER(conns);
+
+static pid_t child = -1;
+static char benchdir[] = "/tmp/abbeyd-bench.XXXXXX";
+static ev_child child_watch;
+static ev_timer timeout;
+
+static bool released(void);
+static struct mock_class * mock_find(int id);
+static void mock_classes(int days);
+static void conn_free(struct conn *c);
+static void conn_send(struct conn *c, const char *buf, size_t len);
+static void conn_reply(struct conn *c, bool head, int status,
+                       const char *extra, json_object *body);
+static json_object * mock_success(bool ok, const char *why);
+static json_object * mock_timetable(void);
+static json_object * mock_locations(void);
+static json_object * mock_book(struct conn *c, const char *body);
+static json_object * mock_confirm(void);
+static bool path_is(const char *path, const char *end);
+static void mock_route(struct conn *c, const char *method, char *path,
+                       const char *body);
+static bool mock_request(struct conn *c);
+static void conn_read_event(EV_P_ ev_io *w, int revents);
+static void conn_write_event(EV_P_ ev_io *w, int revents);
+static void accept_event(EV_P_ ev_io *w, int revents);
+static void stop_event(EV_P_ ev_signal *w, int revents);
+static void child_event(EV_P_ ev_child *w, int revents);
+static void timeout_event(EV_P_ ev_timer *w, int revents);
+static int mock_listen(int port);
+static void bench_start(const char *abbeyd, int port, int shards,
+                        int days);
+static int report(void);
+
+
+
+static bool released(
+    void)
+{
+  return ev_time() >= (ev_tstamp)release_at;
+}
+
+
+static struct mock_class * mock_find(
+    int id)
+{
+  if (id < MOCK_FIRST_ID || id >= MOCK_FIRST_ID + nclasses)
+    return NULL;
+  return &classes[id - MOCK_FIRST_ID];
+}
+
+
+/* Each starts the given calendar days after the release, at its time of
+ * day, the way abbeyd counts back from a class to its release */
+static void mock_classes(
+    int days)
+{
+  struct tm tm;
+  int i;
+
+  classes = calloc(nclasses, sizeof(struct mock_class));
+  if (!classes)
+    err(EXIT_FAILURE, "Cannot allocate classes");
+
+  localtime_r(&release_at, &tm);
+  tm.tm_mday += days;
+  tm.tm_isdst = -1;
+
+  for (i=0; i < nclasses; i++) {
+    classes[i].id = MOCK_FIRST_ID + i;
+    snprintf(classes[i].name, sizeof(classes[i].name), "Bench %d", i + 1);
+    classes[i].start = mktime(&tm);
+  }
+}
+
+
+static void conn_free(
+    struct conn *c)
+{
+  ev_io_stop(EV_DEFAULT, &c->rio);
+  ev_io_stop(EV_DEFAULT, &c->wio);
+  close(c->fd);
+  LIST_REMOVE(c, l);
+  free(c->in);
+  free(c->out);
+  free(c);
+}
+
+
+static void conn_send(
+    struct conn *c,
+    const char *buf,
+    size_t len)
+{
+  size_t size;
+  char *p;
+
+  if (c->outlen + len > c->outsize) {
+    size = c->outsize ? c->outsize : 4096;
+    while (size < c->outlen + len)
+      size *= 2;
+    p = realloc(c->out, size);
+    if (!p)
+      err(EXIT_FAILURE, "Cannot allocate output");
+    c->out = p;
+    c->outsize = size;
+  }
+
+  memcpy(c->out + c->outlen, buf, len);
+  c->outlen += len;
+  ev_io_start(EV_DEFAULT, &c->wio);
+}
+
+
+/* The Date header is in GMT as a real server sends it */
+static void conn_reply(
+    struct conn *c,
+    bool head,
+    int status,
+    const char *extra,
+    json_object *body)
+{
+  const char *text = body ? json_object_to_json_string_ext(body,
+                                              JSON_C_TO_STRING_PLAIN) : "";
+  char hdr[1024], date[64];
+  time_t now = time(NULL);
+  struct tm tm;
+  int len;
+
+  gmtime_r(&now, &tm);
+  strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+  len = snprintf(hdr, sizeof(hdr), "HTTP/1.1 %d %s\r\n"
+                 "Date: %s\r\n"
+                 "Content-Type: application/json\r\n"
+                 "Content-Length: %zu\r\n"
+                 "%s%s\r\n", status, status == 200 ? "OK" : "Not Found",
+                 date, strlen(text), extra ? extra : "",
+                 c->closing ? "Connection: close\r\n" : "");
+  conn_send(c, hdr, len);
+  if (!head)
+    conn_send(c, text, strlen(text));
+  json_object_put(body);
+}
+
+
+static json_object * mock_success(
+    bool ok,
+    const char *why)
+{
+  json_object *obj = json_object_new_object();
+
+  json_object_object_add(obj, "Success", json_object_new_boolean(ok));
+  json_object_object_add(obj, "ErrorMessage", json_object_new_string(why));
+  return obj;
+}
+
+
+/* Full with no waiting list until the release, then one place each */
+static json_object * mock_timetable(
+    void)
+{
+  json_object *obj, *results, *cl;
+  bool open = released();
+  struct tm tm;
+  char start[32];
+  int i;
+
+  obj = json_object_new_object();
+  results = json_object_new_array();
+
+  for (i=0; i < nclasses; i++) {
+    localtime_r(&classes[i].start, &tm);
+    strftime(start, sizeof(start), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    cl = json_object_new_object();
+    json_object_object_add(cl, "ActivityInstanceID",
+                           json_object_new_int(classes[i].id));
+    json_object_object_add(cl, "FacilityLocationID",
+                           json_object_new_int(MOCK_CLUB));
+    json_object_object_add(cl, "ResourceScheduleId",
+                           json_object_new_int(classes[i].id + 50000));
+    json_object_object_add(cl, "AvailibleSlots",
+                json_object_new_int(open && !classes[i].basket ? 1 : 0));
+    json_object_object_add(cl, "WaitingListCapacity",
+                           json_object_new_int(0));
+    json_object_object_add(cl, "OnClass",
+                json_object_new_boolean(classes[i].confirmed > 0.));
+    json_object_object_add(cl, "OnWaitingList", json_object_new_boolean(0));
+    json_object_object_add(cl, "ActivityName",
+                           json_object_new_string(classes[i].name));
+    json_object_object_add(cl, "StartDatetime", json_object_new_string(start));
+    json_object_array_add(results, cl);
+  }
+
+  json_object_object_add(obj, "Results", results);
+  return obj;
+}
+
+
+static json_object * mock_locations(
+    void)
+{
+  json_object *root, *loc, *children;
+
+  loc = json_object_new_object();
+  json_object_object_add(loc, "Name", json_object_new_string(location));
+  json_object_object_add(loc, "Id", json_object_new_int(5));
+  json_object_object_add(loc, "Children", json_object_new_array());
+
+  children = json_object_new_array();
+  json_object_array_add(children, loc);
+
+  root = json_object_new_object();
+  json_object_object_add(root, "Name", json_object_new_string("All"));
+  json_object_object_add(root, "Id", json_object_new_int(1));
+  json_object_object_add(root, "Children", children);
+
+  loc = json_object_new_array();
+  json_object_array_add(loc, root);
+  return loc;
+}
+
+
+/* A booking that had to open its connection is marked cold. Those armed
+ * ahead of the release all go out on warm ones before the timetable is
+ * asked for again, any left over are booked from that timetable */
+static json_object * mock_book(
+    struct conn *c,
+    const char *body)
+{
+  struct mock_class *cl;
+  const char *p;
+
+  p = body ? strstr(body, "ActivityInstanceId=") : NULL;
+  cl = p ? mock_find(atoi(p + strlen("ActivityInstanceId="))) : NULL;
+  if (!cl)
+    return mock_success(false, "No such class");
+
+  if (!released()) {
+    refused++;
+    return mock_success(false, "This class is not yet open for booking");
+  }
+  if (cl->basket)
+    return mock_success(false, "You are already booked on this class");
+
+  cl->basket = ev_time();
+  cl->cold = c->served == 1 && !relisted;
+  return mock_success(true, "");
+}
+
+
+static json_object * mock_confirm(
+    void)
+{
+  ev_tstamp now = ev_time();
+  int i, left = 0;
+
+  for (i=0; i < nclasses; i++) {
+    if (classes[i].basket && !classes[i].confirmed)
+      classes[i].confirmed = now;
+    if (!classes[i].confirmed)
+      left++;
+  }
+
+  if (child > 0 && !left)
+    ev_break(EV_DEFAULT, EVBREAK_ALL);
+  return json_object_new_object();
+}
+
+
+/* Matched on the end of the path and without case, the site is loose
+ * about both */
+static bool path_is(
+    const char *path,
+    const char *end)
+{
+  size_t pl = strlen(path), el = strlen(end);
+  return pl >= el && strcasecmp(path + pl - el, end) == 0;
+}
+
+
+static void mock_route(
+    struct conn *c,
+    const char *method,
+    char *path,
+    const char *body)
+{
+  bool head = strcmp(method, "HEAD") == 0;
+  json_object *reply = NULL;
+
+  requests++;
+  c->served++;
+  path[strcspn(path, "?")] = 0;
+
+  if (path_is(path, "/account/login") || path_is(path, "/account/logout"))
+    reply = json_object_new_object();
+  else if (path_is(path, "/account/processloginrequest")) {
+    conn_reply(c, head, 200, "Set-Cookie: session=mock; Path=/\r\n",
+               mock_success(true, ""));
+    return;
+  }
+  else if (path_is(path, "/filteredlocationhierarchy"))
+    reply = mock_locations();
+  else if (path_is(path, "/FacilityLocation")) {
+    reply = json_object_new_array();
+    json_object_array_add(reply, json_object_new_int(MOCK_CLUB));
+  }
+  else if (path_is(path, "/Timetable/Configuration")) {
+    reply = json_object_new_object();
+    json_object_object_add(reply, "OnlineUserId",
+                           json_object_new_int(MOCK_MEMBER));
+  }
+  else if (path_is(path, "/GetClassTimeTable")) {
+    relisted = released();
+    reply = mock_timetable();
+  }
+  else if (path_is(path, "/OnlineBookingPrice")) {
+    reply = json_object_new_object();
+    json_object_object_add(reply, "FeeTotal", json_object_new_double(0.));
+  }
+  else if (path_is(path, "/AddClassBookingToBasket"))
+    reply = mock_book(c, body);
+  else if (path_is(path, "/AddToWaitingList"))
+    reply = mock_success(false, "There is no waiting list for this class");
+  else if (path_is(path, "/confirmbasket"))
+    reply = mock_confirm();
+  else if (strcmp(path, "/") == 0 || *path == 0)
+    reply = json_object_new_object();
+  else {
+    conn_reply(c, head, 404, NULL, NULL);
+    return;
+  }
+
+  conn_reply(c, head, 200, NULL, reply);
+}
+
+
+/* Answers the first whole request in the buffer, false if there is not
+ * one yet. Bodies are only ever sized by Content-Length */
+static bool mock_request(
+    struct conn *c)
+{
+  char *end, *line, *hdr, *save, *method, *path, *version, *body;
+  size_t hlen, blen = 0;
+
+  end = memmem(c->in, c->inlen, "\r\n\r\n", 4);
+  if (!end)
+    return false;
+  *end = 0;
+  hlen = end - c->in + 4;
+
+  for (hdr = strstr(c->in, "\r\n"); hdr; hdr = strstr(hdr + 2, "\r\n")) {
+    if (strncasecmp(hdr + 2, "Content-Length:", 15) == 0)
+      blen = strtoul(hdr + 17, NULL, 10);
+    else if (strncasecmp(hdr + 2, "Connection: close", 17) == 0)
+      c->closing = true;
+  }
+
+  if (hlen + blen > MOCK_REQUEST_MAX) {
+    c->closing = true;
+    conn_reply(c, false, 404, NULL, NULL);
+    return false;
+  }
+  if (c->inlen < hlen + blen) {
+    *end = '\r';
+    return false;
+  }
+
+  body = strndup(c->in + hlen, blen);
+  if (!body)
+    err(EXIT_FAILURE, "Cannot allocate request");
+
+  line = strtok_r(c->in, "\r\n", &hdr);
+  method = line ? strtok_r(line, " ", &save) : NULL;
+  path = method ? strtok_r(NULL, " ", &save) : NULL;
+  version = path ? strtok_r(NULL, " ", &save) : NULL;
+
+  if (!version) {
+    c->closing = true;
+    conn_reply(c, false, 404, NULL, NULL);
+  }
+  else {
+    if (strcmp(version, "HTTP/1.0") == 0)
+      c->closing = true;
+    mock_route(c, method, path, body);
+  }
+  free(body);
+
+  memmove(c->in, c->in + hlen + blen, c->inlen - hlen - blen);
+  c->inlen -= hlen + blen;
+  return !c->closing;
+}
+
+
+static void conn_read_event(
+    EV_P_ ev_io *w,
+    int revents)
+{
+  struct conn *c = w->data;
+  ssize_t rc;
+  char *p;
+
+  if (c->insize - c->inlen < 4096) {
+    p = realloc(c->in, c->insize + 8192);
+    if (!p)
+      err(EXIT_FAILURE, "Cannot allocate input");
+    c->in = p;
+    c->insize += 8192;
+  }
+
+  rc = read(c->fd, c->in + c->inlen, c->insize - c->inlen);
+  if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
+  if (rc <= 0) {
+    conn_free(c);
+    return;
+  }
+  c->inlen += rc;
+
+  while (mock_request(c))
+    ;
+
+  if (c->closing)
+    ev_io_stop(EV_A_ &c->rio);
+  else if (c->inlen >= MOCK_REQUEST_MAX)
+    conn_free(c);
+}
+
+
+static void conn_write_event(
+    EV_P_ ev_io *w,
+    int revents)
+{
+  struct conn *c = w->data;
+  ssize_t rc;
+
+  while (c->outpos < c->outlen) {
+    rc = write(c->fd, c->out + c->outpos, c->outlen - c->outpos);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (rc <= 0) {
+      conn_free(c);
+      return;
+    }
+    c->outpos += rc;
+  }
+
+  c->outpos = c->outlen = 0;
+  ev_io_stop(EV_A_ &c->wio);
+  if (c->closing)
+    conn_free(c);
+}
+
+
+static void accept_event(
+    EV_P_ ev_io *w,
+    int revents)
+{
+  struct conn *c;
+  int fd, one = 1;
+
+  while ((fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) > -1) {
+    c = calloc(1, sizeof(struct conn));
+    if (!c)
+      err(EXIT_FAILURE, "Cannot allocate connection");
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->fd = fd;
+    ev_io_init(&c->rio, conn_read_event, fd, EV_READ);
+    ev_io_init(&c->wio, conn_write_event, fd, EV_WRITE);
+    c->rio.data = c->wio.data = c;
+    LIST_INSERT_HEAD(&conns, c, l);
+    connections++;
+    ev_io_start(EV_A_ &c->rio);
+  }
+}
+
+
+static void stop_event(
+    EV_P_ ev_signal *w,
+    int revents)
+{
+  ev_break(EV_A_ EVBREAK_ALL);
+}
+
+
+static void child_event(
+    EV_P_ ev_child *w,
+    int revents)
+{
+  warnx("abbeyd exited with status %d, see %s/abbeyd.log", w->rstatus,
+        benchdir);
+  child = -1;
+  ev_break(EV_A_ EVBREAK_ALL);
+}
+
+
+static void timeout_event(
+    EV_P_ ev_timer *w,
+    int revents)
+{
+  warnx("Timed out waiting for every class to be confirmed");
+  ev_break(EV_A_ EVBREAK_ALL);
+}
+
+
+static int mock_listen(
+    int port)
+{
+  struct sockaddr_in sin = {0};
+  int fd, one = 1;
+
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    err(EXIT_FAILURE, "Cannot create socket");
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+      listen(fd, 64) < 0)
+    err(EXIT_FAILURE, "Cannot listen on port %d", port);
+  return fd;
+}
+
+
+/* One section per class so each has a release of its own, as a user
+ * watching several classes would */
+static void bench_start(
+    const char *abbeyd,
+    int port,
+    int shards,
+    int days)
+{
+  char path[PATH_MAX], day[16], when[16], wake[16];
+  sqlite3 *db;
+  struct tm tm;
+  time_t t;
+  FILE *f;
+  int i;
+
+  if (!mkdtemp(benchdir))
+    err(EXIT_FAILURE, "Cannot make %s", benchdir);
+
+  snprintf(path, sizeof(path), "%s/bookings.db", benchdir);
+  if (sqlite3_open(path, &db) != SQLITE_OK ||
+      sqlite3_exec(db, MOCK_SCHEMA, NULL, NULL, NULL) != SQLITE_OK)
+    errx(EXIT_FAILURE, "Cannot create %s: %s", path, sqlite3_errmsg(db));
+  sqlite3_close(db);
+
+  /* The daily wake up kept well away from the release */
+  t = release_at + 43200;
+  localtime_r(&t, &tm);
+  strftime(wake, sizeof(wake), "%H:%M:%S", &tm);
+
+  snprintf(path, sizeof(path), "%s/abbeyd.ini", benchdir);
+  f = fopen(path, "w");
+  if (!f)
+    err(EXIT_FAILURE, "Cannot write %s", path);
+
+  fprintf(f, "[main]\n"
+             "login = bench@localhost\n"
+             "password = bench\n"
+             "base_url = http://127.0.0.1:%d\n"
+             "location = %s\n"
+             "db_path = %s/bookings.db\n"
+             "logfile = %s/abbeyd.log\n"
+             "event_log = %s/events.log\n"
+             "waketime = %s\n"
+             "waiting_list_retry_timeout = 3600\n"
+             "release_days = %d\n"
+             "shards = %d\n"
+             "verbose = 1\n", port, location, benchdir, benchdir, benchdir,
+             wake, days, shards);
+
+  for (i=0; i < nclasses; i++) {
+    localtime_r(&classes[i].start, &tm);
+    strftime(day, sizeof(day), "%A", &tm);
+    strftime(when, sizeof(when), "%H:%M", &tm);
+    fprintf(f, "\n[%s]\nday = %s\nname = %s\ntime = %s\n", classes[i].name,
+            day, classes[i].name, when);
+  }
+  if (fclose(f) != 0)
+    err(EXIT_FAILURE, "Cannot write %s", path);
+
+  child = fork();
+  if (child < 0)
+    err(EXIT_FAILURE, "Cannot fork");
+  if (child == 0) {
+    execl(abbeyd, abbeyd, path, (char *)NULL);
+    err(EXIT_FAILURE, "Cannot run %s", abbeyd);
+  }
+
+  ev_child_init(&child_watch, child_event, child, 0);
+  ev_child_start(EV_DEFAULT, &child_watch);
+  printf("Running %s with %s\n", abbeyd, path);
+}
+
+
+/* Fails unless every class was confirmed and those sent together at the
+ * release went on connections that were already open */
+static int report(
+    void)
+{
+  struct series basket = {0}, confirmed = {0};
+  struct series *s[] = { &basket, &confirmed };
+  const char *names[] = { "basket", "confirmed" };
+  int i, cold = 0;
+
+  for (i=0; i < nclasses; i++) {
+    if (classes[i].cold)
+      cold++;
+    if (classes[i].basket)
+      series_add(&basket, (classes[i].basket - release_at) * 1000.);
+    if (classes[i].confirmed)
+      series_add(&confirmed, (classes[i].confirmed - release_at) * 1000.);
+  }
+
+  printf("\n%d requests on %d connections, %d bookings turned away before "
+         "the release\n", requests, connections, refused);
+  printf("\n%-17s %8s %10s %10s %10s %10s\n", "from release (ms)", "count",
+         "min", "p50", "p99", "max");
+  for (i=0; i < 2; i++) {
+    if (!s[i]->n)
+      continue;
+    series_sort(s[i]);
+    printf("%-17s %8zu %10.2f %10.2f %10.2f %10.2f\n", names[i], s[i]->n,
+           s[i]->v[0], series_quantile(s[i], 0.50),
+           series_quantile(s[i], 0.99),
+           s[i]->v[s[i]->n - 1]);
+  }
+  if (confirmed.n < (size_t)nclasses)
+    printf("%d of %d classes were not confirmed\n",
+           nclasses - (int)confirmed.n, nclasses);
+  if (cold)
+    printf("%d of %d classes were booked at the release on a new "
+           "connection\n", cold, nclasses);
+
+  i = confirmed.n == (size_t)nclasses && !cold ? EXIT_SUCCESS : EXIT_FAILURE;
+  series_free(&basket);
+  series_free(&confirmed);
+  return i;
+}
+
+
+int main(
+    int argc,
+    char **argv)
+{
+  const char *abbeyd = NULL;
+  int port = MOCK_PORT, days = MOCK_DAYS, warmup = MOCK_WARMUP;
+  int shards = 0, wait = MOCK_TIMEOUT, c, rc;
+  ev_signal sigint, sigterm;
+  struct conn *cn;
+  char buf[64];
+  struct tm tm;
+  ev_io lio;
+
+  while ((c = getopt(argc, argv, "p:l:n:d:w:s:t:b:h")) != -1) {
+    switch (c) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'l':
+      location = optarg;
+      break;
+    case 'n':
+      nclasses = atoi(optarg);
+      break;
+    case 'd':
+      days = atoi(optarg);
+      break;
+    case 'w':
+      warmup = atoi(optarg);
+      break;
+    case 's':
+      shards = atoi(optarg);
+      break;
+    case 't':
+      wait = atoi(optarg);
+      break;
+    case 'b':
+      abbeyd = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-p port] [-l location] [-n classes] "
+              "[-d days] [-w seconds] [-s shards] [-t seconds] [-b abbeyd]\n",
+              argv[0]);
+      return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (port <= 0 || port > 65535 || nclasses <= 0 || days <= 0 || warmup < 0)
+    errx(EXIT_FAILURE, "Port, classes and days must be positive");
+
+  /* The first whole minute far enough off, release_days works in minutes */
+  release_at = ((time(NULL) + warmup) / 60 + 1) * 60;
+  mock_classes(days);
+
+  ev_io_init(&lio, accept_event, mock_listen(port), EV_READ);
+  ev_io_start(EV_DEFAULT, &lio);
+  ev_signal_init(&sigint, stop_event, SIGINT);
+  ev_signal_init(&sigterm, stop_event, SIGTERM);
+  ev_signal_start(EV_DEFAULT, &sigint);
+  ev_signal_start(EV_DEFAULT, &sigterm);
+  signal(SIGPIPE, SIG_IGN);
+
+  localtime_r(&release_at, &tm);
+  strftime(buf, sizeof(buf), TIME_FORMAT, &tm);
+  printf("Serving %d classes at %s on 127.0.0.1:%d, released at %s\n",
+         nclasses, location, port, buf);
+
+  if (abbeyd) {
+    bench_start(abbeyd, port, shards, days);
+    ev_timer_init(&timeout, timeout_event,
+                  (ev_tstamp)release_at + wait - ev_time(), 0.);
+    ev_timer_start(EV_DEFAULT, &timeout);
+  }
+  fflush(stdout);
+
+  ev_run(EV_DEFAULT, 0);
+
+  if (child > 0) {
+    ev_child_stop(EV_DEFAULT, &child_watch);
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+  }
+  while ((cn = LIST_FIRST(&conns)))
+    conn_free(cn);
+  close(lio.fd);
+
+  rc = report();
+  if (abbeyd)
+    printf("\nThe config, database and logs are in %s\n", benchdir);
+  free(classes);
+  return rc;
+}
@@ -0,0 +1,125 @@
+#include "common.h"
+#include "logging.h"
+#include "shards.h"
+#include "offload.h"
+#include "stall.h"
+#include <ev.h>
+
+LOGSET("offload");
+
+/* Anything longer than this held up whatever was waiting on it */
+#define OFFLOAD_SLOW 10.0
+
+/* A job is blocking work run on the shards, which may fork more work
+ * counted against it. When the last piece finishes the done callback
+ * runs on the default loop, so callers never block it themselves */
+struct offload_job {
+  shard_fn done;
+  void *data;
+  int shard;
+  int refs;
+  ev_tstamp started;
+};
+
+struct offload_part {
+  offload_job_t job;
+  offload_fn work;
+  void *data;
+};
+
+static unsigned int next = 0;
+
+static void offload_push(offload_job_t job, offload_fn work, void *data);
+static void offload_part_event(EV_P_ void *data);
+static void offload_done_event(EV_P_ void *data);
+
+
+
+static void offload_push(
+    offload_job_t job,
+    offload_fn work,
+    void *data)
+{
+  struct offload_part *part = calloc(1, sizeof(struct offload_part));
+  if (!part) {
+    ELOGERR(CRITICAL, "Cannot allocate offload job");
+    exit(EXIT_FAILURE);
+  }
+
+  part->job = job;
+  part->work = work;
+  part->data = data;
+
+  __atomic_add_fetch(&job->refs, 1, __ATOMIC_RELAXED);
+  shards_push(job->shard, offload_part_event, part);
+}
+
+
+/* Runs on a shard */
+static void offload_part_event(
+    EV_P_ void *data)
+{
+  struct offload_part *part = data;
+  offload_job_t job = part->job;
+
+  part->work(job, part->data);
+  free(part);
+
+  if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    shards_complete(offload_done_event, job);
+}
+
+
+/* Runs on the default loop */
+static void offload_done_event(
+    EV_P_ void *data)
+{
+  offload_job_t job = data;
+  ev_tstamp took = ev_time() - job->started;
+
+  STALL_TAG();
+
+  if (took > OFFLOAD_SLOW)
+    ELOG(WARNING, "Offloaded job took %.3f seconds", took);
+
+  job->done(EV_A_ job->data);
+  free(job);
+}
+
+
+
+/* Run work on the given shard, or any if negative, then done on the
+ * default loop once it and everything it forked has finished */
+void offload(
+    int shard,
+    offload_fn work,
+    shard_fn done,
+    void *data)
+{
+  offload_job_t job = calloc(1, sizeof(struct offload_job));
+  if (!job) {
+    ELOGERR(CRITICAL, "Cannot allocate offload job");
+    exit(EXIT_FAILURE);
+  }
+
+  if (shard < 0)
+    shard = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % shards_count();
+
+  job->done = done;
+  job->data = data;
+  job->shard = shard;
+  job->started = ev_time();
+
+  offload_push(job, work, data);
+}
+
+
+/* From inside a jobs work, queue more work that must finish before the
+ * job is done. Idle shards may steal it */
+void offload_fork(
+    offload_job_t job,
+    offload_fn work,
+    void *data)
+{
+  offload_push(job, work, data);
+}
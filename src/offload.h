@@ -0,0 +1,11 @@
+#ifndef _OFFLOAD_H_
+#define _OFFLOAD_H_
+
+#include "shards.h"
+
+typedef struct offload_job * offload_job_t;
+typedef void (*offload_fn)(offload_job_t job, void *data);
+
+void offload(int shard, offload_fn work, shard_fn done, void *data);
+void offload_fork(offload_job_t job, offload_fn work, void *data);
+#endif
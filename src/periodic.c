@@ -4,6 +4,9 @@
 #include "website.h"
 #include "bookings.h"
 #include "periodic.h"
+#include "release.h"
+#include "quiet.h"
+#include "stall.h"
 #include <ev.h>
 
 LOGSET("periodic");
@@ -13,6 +16,7 @@ static ev_periodic pe = {0};
 static int periodic_timer_adjustment = 0;
 
 static void log_next_wakeup(void);
+static void calibrate_periodic(void);
 static void calibrate_periodic_timer(EV_P_ ev_timer *w, int revents);
 static void check_bookings_event(EV_P_ ev_periodic *w,  int revents);
 
@@ -35,6 +39,16 @@ static void log_next_wakeup(
 static void calibrate_periodic_timer(
     EV_P_ ev_timer *w,
     int revents)
+{
+  STALL_TAG();
+  if (quiet_defer("timezone calibration", calibrate_periodic))
+    return;
+  calibrate_periodic();
+}
+
+
+static void calibrate_periodic(
+    void)
 {
   /* Fetch the current time difference reported by website */
   int td = website_server_time_diff();
@@ -62,6 +76,7 @@ static void check_bookings_event(
     EV_P_ ev_periodic *w,
     int revents)
 {
+  STALL_TAG();
   bookings_check();
 }
 
@@ -76,11 +91,13 @@ void periodic_init(
 
   /* Arm the periodical timer */
   ev_periodic_init(&pe, check_bookings_event, (ev_tstamp)waket, 86400.0, 0);
+  ev_set_priority(&pe, EV_MAXPRI);
   ev_periodic_start(EV_DEFAULT, &pe);
   log_next_wakeup();
 
   /* Arm the timezone adjustment poller */
   ev_timer_init(&tz, calibrate_periodic_timer, 10.0, TIMEZONE_CHECK);
+  ev_set_priority(&tz, EV_MINPRI);
   ev_timer_start(EV_DEFAULT, &tz);
 }
 
@@ -98,12 +115,23 @@ void periodic_reset(
 
   /* Re-arm the timer */
   ev_periodic_stop(EV_DEFAULT, &pe);
-  ev_periodic_set(&pe, (float)waket, 86400.0, 0);
+  ev_periodic_set(&pe, (ev_tstamp)waket, 86400.0, 0);
   ev_periodic_start(EV_DEFAULT, &pe);
   log_next_wakeup();
 
   periodic_timer_adjustment = website_server_time_diff();
   log_next_wakeup();
+
+  /* Class releases follow the same clock */
+  release_reset();
+}
+
+
+/* When the daily booking pass next runs */
+ev_tstamp periodic_next_at(
+    void)
+{
+  return ev_is_active(&pe) ? ev_periodic_at(&pe) : 0.;
 }
 
 
@@ -1,8 +1,11 @@
 #ifndef _PERIODIC_H_
 #define _PERIODIC_H_
 
+#include <ev.h>
+
 void periodic_init(void);
 void periodic_reset(void); /* Re-read timer from config */
 void periodic_destroy(void);
+ev_tstamp periodic_next_at(void);
 
 #endif
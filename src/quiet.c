@@ -0,0 +1,167 @@
+#include "common.h"
+#include "config.h"
+#include "logging.h"
+#include "periodic.h"
+#include "release.h"
+#include "quiet.h"
+#include "stall.h"
+#include <ev.h>
+
+LOGSET("quiet");
+
+#define QUIET_MAX 16
+
+/* Housekeeping that wanted to run too close to a booking wake up. Each
+ * is held once, however many times it asks, and run after the window */
+struct deferred {
+  const char *name;
+  quiet_fn fn;
+  int count;
+};
+
+static struct deferred deferred[QUIET_MAX];
+static int ndeferred = 0;
+static int total = 0;
+static ev_timer after = {0};
+
+static ev_tstamp quiet_until(ev_tstamp now);
+static void quiet_end_event(EV_P_ ev_timer *w, int revents);
+
+
+
+/* When the quiet window we are in ends, or zero if we are not in one */
+static ev_tstamp quiet_until(
+    ev_tstamp now)
+{
+  ev_tstamp period = config_get_quiet_period();
+  ev_tstamp wakes[4];
+  ev_tstamp end = 0.;
+  int i;
+
+  if (period <= 0.)
+    return 0.;
+
+  wakes[0] = periodic_next_at();
+  wakes[1] = wakes[0] - 86400.;
+  wakes[2] = release_next_at();
+  wakes[3] = release_last_at();
+
+  for (i=0; i < 4; i++) {
+    if (wakes[i] <= 0.)
+      continue;
+    if (now > wakes[i] - period && now < wakes[i] + period &&
+        wakes[i] + period > end)
+      end = wakes[i] + period;
+  }
+
+  return end;
+}
+
+
+static void quiet_end_event(
+    EV_P_ ev_timer *w,
+    int revents)
+{
+  struct deferred run[QUIET_MAX];
+  ev_tstamp end;
+  int i, n;
+
+  STALL_TAG();
+
+  /* Another release may have come up in the meantime */
+  if ((end = quiet_until(ev_time())) > 0.) {
+    ev_timer_set(w, end - ev_time(), 0.);
+    ev_timer_start(EV_A_ w);
+    return;
+  }
+
+  /* Take the list first, anything run may defer itself again */
+  n = ndeferred;
+  memcpy(run, deferred, sizeof(struct deferred) * n);
+  ndeferred = 0;
+
+  for (i=0; i < n; i++) {
+    ELOG(INFO, "Running %s, deferred %d times for a release", run[i].name,
+         run[i].count);
+    run[i].fn();
+  }
+}
+
+
+
+void quiet_init(
+    void)
+{
+  ev_init(&after, quiet_end_event);
+  ev_set_priority(&after, EV_MINPRI);
+}
+
+
+void quiet_destroy(
+    void)
+{
+  ev_timer_stop(EV_DEFAULT, &after);
+  if (total)
+    ELOG(VERBOSE, "Deferred housekeeping %d times", total);
+  ndeferred = 0;
+}
+
+
+bool quiet_now(
+    void)
+{
+  return quiet_until(ev_time()) > 0.;
+}
+
+
+/* Called by housekeeping before it does anything. If we are near a
+ * booking wake up fn is held until afterwards and this returns true, in
+ * which case the caller should do nothing */
+bool quiet_defer(
+    const char *name,
+    quiet_fn fn)
+{
+  ev_tstamp now = ev_time();
+  ev_tstamp end = quiet_until(now);
+  int i;
+
+  if (end <= 0.)
+    return false;
+
+  total++;
+
+  for (i=0; i < ndeferred; i++) {
+    if (deferred[i].fn == fn) {
+      deferred[i].count++;
+      ELOG(VERBOSE, "Still deferring %s", name);
+      return true;
+    }
+  }
+
+  if (ndeferred == QUIET_MAX) {
+    ELOG(WARNING, "Too much deferred housekeeping, running %s now", name);
+    return false;
+  }
+
+  deferred[ndeferred].name = name;
+  deferred[ndeferred].fn = fn;
+  deferred[ndeferred].count = 1;
+  ndeferred++;
+
+  ELOG(INFO, "Deferring %s for %.1f seconds until after the release",
+       name, end - now);
+
+  if (!ev_is_active(&after)) {
+    ev_timer_set(&after, end - now, 0.);
+    ev_timer_start(EV_DEFAULT, &after);
+  }
+
+  return true;
+}
+
+
+int quiet_deferrals(
+    void)
+{
+  return total;
+}
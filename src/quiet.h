@@ -0,0 +1,12 @@
+#ifndef _QUIET_H_
+#define _QUIET_H_
+
+typedef void (*quiet_fn)(void);
+
+void quiet_init(void);
+void quiet_destroy(void);
+
+bool quiet_now(void);
+bool quiet_defer(const char *name, quiet_fn fn);
+int quiet_deferrals(void);
+#endif
@@ -0,0 +1,507 @@
+#include "common.h"
+#include "config.h"
+#include "logging.h"
+#include "website.h"
+#include "class.h"
+#include "rule.h"
+#include "bookings.h"
+#include "hist.h"
+#include "database.h"
+#include "release.h"
+#include "stall.h"
+#include <ev.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+LOGSET("release");
+
+/* In precise mode we wake this early on the loop, arm the bookings on a
+ * shard, sleep until just before the release then spin through the rest */
+#define RELEASE_LEAD 10.0
+#define RELEASE_SPIN 0.002
+
+/* How many booking timings we want before trusting them, RELEASE_SAMPLES
+ * is how many are kept */
+#define RELEASE_SAMPLES_MIN 5
+#define RELEASE_QUANTILE 0.1
+
+/* Release window tuning */
+#define RELEASE_RT_PRIORITY 10
+#define RELEASE_NICE -10
+#define RELEASE_STACK_PREFAULT (256 * 1024)
+
+/* Classes open for booking release_days before they start. Each config
+ * entry has its next release instant kept in a min-heap, with a single
+ * periodic armed at the earliest, so firing is O(log n) in the number
+ * of entries and nothing ticks in between */
+struct release {
+  ev_tstamp at;
+  class_t cl;
+};
+
+static struct release *heap = NULL;
+static int heap_len = 0;
+static int heap_size = 0;
+static ev_periodic pe = {0};
+static ev_tstamp last_at = 0.;
+static struct hist fire_error;
+static struct hist arrival_error;
+static struct hist wake_latency;
+static struct hist sleep_latency;
+static int windows = 0;
+
+/* What the shard was running as before its release window */
+static __thread struct {
+  bool active;
+  bool sched;
+  bool niced;
+  bool pinned;
+  int policy;
+  struct sched_param param;
+  int nice;
+  cpu_set_t cpus;
+} window;
+
+static void heap_swap(int a, int b);
+static void heap_up(int i);
+static void heap_down(int i);
+static void heap_push(ev_tstamp at, class_t cl);
+static void heap_pop(void);
+static ev_tstamp release_next(class_t cl, ev_tstamp after);
+static void release_arm(void);
+static void release_event(EV_P_ ev_periodic *w, int revents);
+static int release_compare(const void *a, const void *b);
+static void release_prefault(void);
+
+
+
+static void heap_swap(
+    int a,
+    int b)
+{
+  struct release tmp = heap[a];
+  heap[a] = heap[b];
+  heap[b] = tmp;
+}
+
+
+static void heap_up(
+    int i)
+{
+  while (i > 0 && heap[(i-1)/2].at > heap[i].at) {
+    heap_swap(i, (i-1)/2);
+    i = (i-1)/2;
+  }
+}
+
+
+static void heap_down(
+    int i)
+{
+  int c;
+
+  while ((c = 2*i + 1) < heap_len) {
+    if (c+1 < heap_len && heap[c+1].at < heap[c].at)
+      c++;
+    if (heap[i].at <= heap[c].at)
+      break;
+    heap_swap(i, c);
+    i = c;
+  }
+}
+
+
+static void heap_push(
+    ev_tstamp at,
+    class_t cl)
+{
+  struct release *tmp;
+
+  if (heap_len == heap_size) {
+    tmp = realloc(heap, sizeof(struct release) * (heap_size ? heap_size*2 : 16));
+    if (!tmp) {
+      ELOGERR(CRITICAL, "Cannot allocate release schedule");
+      exit(EXIT_FAILURE);
+    }
+    heap = tmp;
+    heap_size = heap_size ? heap_size*2 : 16;
+  }
+
+  heap[heap_len].at = at;
+  heap[heap_len].cl = cl;
+  heap_len++;
+  heap_up(heap_len-1);
+}
+
+
+/* Removes the top, the caller owns its class */
+static void heap_pop(
+    void)
+{
+  heap_len--;
+  heap[0] = heap[heap_len];
+  heap_down(0);
+}
+
+
+/* The first release instant of the config entry later than after */
+static ev_tstamp release_next(
+    class_t cl,
+    ev_tstamp after)
+{
+  struct tm tm;
+  time_t t = (time_t)after;
+  time_t rel;
+  int i;
+
+  localtime_r(&t, &tm);
+
+  /* Walk forward from the day the release may fall on */
+  for (i=0; i < 8; i++) {
+    struct tm start = tm;
+    start.tm_mday += config_get_release_days() + i;
+    start.tm_hour = cl->time.tm_hour;
+    start.tm_min = cl->time.tm_min;
+    start.tm_sec = 0;
+    start.tm_isdst = -1;
+    mktime(&start);
+
+    if (start.tm_wday != cl->time.tm_wday)
+      continue;
+
+    /* Count back in calendar days so daylight savings hold the time.
+     * mktime already takes in the timezone, so only the skew is added */
+    start.tm_mday -= config_get_release_days();
+    start.tm_isdst = -1;
+    rel = mktime(&start) - website_clock_skew();
+    if (rel > after)
+      return (ev_tstamp)rel;
+  }
+
+  /* Already past this weeks, so next weeks */
+  return release_next(cl, after + 86400.0);
+}
+
+
+static void release_arm(
+    void)
+{
+  struct tm tm;
+  char timestr[48] = {0};
+  time_t next;
+  ev_tstamp lead = config_get_precise_release() ? RELEASE_LEAD : 0.;
+
+  ev_periodic_stop(EV_DEFAULT, &pe);
+  if (heap_len == 0)
+    return;
+
+  ev_periodic_set(&pe, heap[0].at - lead, 0., 0);
+  ev_periodic_start(EV_DEFAULT, &pe);
+
+  next = (time_t)heap[0].at;
+  localtime_r(&next, &tm);
+  strftime(timestr, 48, TIME_FORMAT " %Z", &tm);
+  ELOG(VERBOSE, "Next release is %s at %s", heap[0].cl->class_name, timestr);
+}
+
+
+static void release_event(
+    EV_P_ ev_periodic *w,
+    int revents)
+{
+  class_t cl, *due;
+  ev_tstamp at;
+  ev_tstamp now = ev_now(EV_A);
+  bool precise = config_get_precise_release();
+  char buf[256];
+  int i, n;
+
+  STALL_TAG();
+
+  hist_add(&wake_latency, ev_time() - ev_periodic_at(w));
+  ELOG(VERBOSE, "%s", hist_print(&wake_latency, buf, sizeof(buf)));
+
+  due = malloc(sizeof(class_t) * (heap_len ? heap_len : 1));
+  if (!due) {
+    ELOGERR(CRITICAL, "Cannot allocate released classes");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Everything released at the same instant goes in one run, which arms
+   * them all, rather than each run holding the shard until it fires */
+  while (heap_len > 0 && heap[0].at - (precise ? RELEASE_LEAD : 0.) <= now) {
+    at = heap[0].at;
+    last_at = at;
+    n = 0;
+    while (heap_len > 0 && heap[0].at == at) {
+      due[n++] = heap[0].cl;
+      heap_pop();
+    }
+
+    for (i=0; i < n; i++)
+      ELOG(INFO, "%s released", due[i]->class_name);
+    if (n > 1)
+      ELOG(VERBOSE, "%d classes released together", n);
+    bookings_check_classes(due, n, precise ? at : 0.);
+
+    for (i=0; i < n; i++) {
+      cl = due[i];
+      heap_push(release_next(cl, at), cl);
+    }
+  }
+  free(due);
+
+  release_arm();
+}
+
+
+
+static int release_compare(
+    const void *a,
+    const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+
+/* How far ahead of the release to send so the booking lands as it opens.
+ * We go by the quicker end of the recent one way latencies, less the
+ * safety margin, so we would rather land late than be turned away early */
+double release_lead(
+    void)
+{
+  double oneway[RELEASE_SAMPLES];
+  double lead;
+  int n = database_get_latency("book", oneway, RELEASE_SAMPLES);
+
+  if (n < RELEASE_SAMPLES_MIN) {
+    ELOG(VERBOSE, "Only %d booking timings, sending on the release", n);
+    return 0.;
+  }
+
+  qsort(oneway, n, sizeof(double), release_compare);
+  lead = oneway[(int)(RELEASE_QUANTILE * n)] -
+         config_get_fire_margin() / 1000.;
+
+  ELOG(VERBOSE, "One way latency over %d bookings is %.6f to %.6f. "
+       "Sending %.6f seconds early", n, oneway[0], oneway[n-1],
+       lead > 0. ? lead : 0.);
+  return lead > 0. ? lead : 0.;
+}
+
+
+/* Reports where the first booking of a release is thought to have
+ * landed relative to the release, going by its own timing */
+void release_outcome(
+    const char *name,
+    ev_tstamp at,
+    ev_tstamp sent,
+    struct website_timing *timing,
+    int booked,
+    int armed)
+{
+  char buf[256];
+  double arrival = sent + timing->pretransfer +
+                   (timing->ttfb - timing->pretransfer) / 2. - at;
+
+  hist_add(&arrival_error, arrival > 0. ? arrival : -arrival);
+  ELOG(INFO, "Release of %s sent %.3fms %s, landed about %+.3fms from opening. "
+       "Booked %d of %d", name, (at > sent ? at - sent : sent - at) * 1000.,
+       at > sent ? "early" : "late", arrival * 1000., booked, armed);
+  ELOG(VERBOSE, "%s", hist_print(&arrival_error, buf, sizeof(buf)));
+}
+
+
+/* Blocks the calling shard until the release instant, sleeping on the
+ * realtime clock until just short of it then spinning. Returns how late
+ * we were */
+double release_wait(
+    ev_tstamp at)
+{
+  struct timespec ts;
+  ev_tstamp wake = at - RELEASE_SPIN;
+  ev_tstamp now;
+  double error;
+  char buf[256];
+
+  ts.tv_sec = (time_t)wake;
+  ts.tv_nsec = (long)((wake - (ev_tstamp)ts.tv_sec) * 1000000000.);
+
+  while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL) == EINTR);
+  hist_add(&sleep_latency, ev_time() - wake);
+  while ((now = ev_time()) < at);
+
+  error = now - at;
+  hist_add(&fire_error, error);
+  ELOG(VERBOSE, "Fired %.6f seconds after release%s. %s", error,
+       window.active ? " in release window" : "",
+       hist_print(&fire_error, buf, sizeof(buf)));
+  ELOG(VERBOSE, "%s", hist_print(&sleep_latency, buf, sizeof(buf)));
+
+  return error;
+}
+
+
+/* Touch the stack we are about to need so it is resident and locked */
+static void release_prefault(
+    void)
+{
+  volatile char stack[RELEASE_STACK_PREFAULT];
+  size_t i;
+
+  for (i=0; i < sizeof(stack); i += 4096)
+    stack[i] = 0;
+}
+
+
+/* On the shard about to fire a release, lock memory, raise its priority
+ * and pin it for the burst. Each step is best effort, containers often
+ * deny them. Does nothing unless release_window is set */
+void release_window_enter(
+    void)
+{
+  struct sched_param rt = { .sched_priority = RELEASE_RT_PRIORITY };
+  pid_t tid = syscall(SYS_gettid);
+  cpu_set_t cpus;
+  int cpu = config_get_release_cpu();
+
+  if (!config_get_release_window() || window.active)
+    return;
+  memset(&window, 0, sizeof(window));
+  window.active = true;
+
+  /* Locking is for the whole process, the first window in takes it */
+  if (__atomic_fetch_add(&windows, 1, __ATOMIC_ACQ_REL) == 0) {
+    if (mlockall(MCL_CURRENT|MCL_FUTURE) < 0)
+      ELOGERR(WARNING, "Cannot lock memory for release window");
+  }
+  release_prefault();
+
+  pthread_getschedparam(pthread_self(), &window.policy, &window.param);
+  if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &rt) == 0) {
+    window.sched = true;
+  }
+  else {
+    errno = 0;
+    window.nice = getpriority(PRIO_PROCESS, tid);
+    if (errno == 0 && setpriority(PRIO_PROCESS, tid, RELEASE_NICE) == 0)
+      window.niced = true;
+    else
+      ELOG(WARNING, "Cannot raise priority for release window");
+  }
+
+  if (cpu >= 0) {
+    pthread_getaffinity_np(pthread_self(), sizeof(window.cpus), &window.cpus);
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0)
+      window.pinned = true;
+    else
+      ELOG(WARNING, "Cannot pin release window to cpu %d", cpu);
+  }
+
+  ELOG(VERBOSE, "Entered release window:%s%s%s", window.sched ? " fifo" : "",
+       window.niced ? " niced" : "", window.pinned ? " pinned" : "");
+}
+
+
+void release_window_leave(
+    void)
+{
+  pid_t tid = syscall(SYS_gettid);
+
+  if (!window.active)
+    return;
+
+  if (window.pinned)
+    pthread_setaffinity_np(pthread_self(), sizeof(window.cpus), &window.cpus);
+  if (window.sched)
+    pthread_setschedparam(pthread_self(), window.policy, &window.param);
+  if (window.niced)
+    setpriority(PRIO_PROCESS, tid, window.nice);
+
+  if (__atomic_sub_fetch(&windows, 1, __ATOMIC_ACQ_REL) == 0)
+    munlockall();
+
+  window.active = false;
+  ELOG(VERBOSE, "Left release window");
+}
+
+
+ev_tstamp release_next_at(
+    void)
+{
+  return heap_len > 0 ? heap[0].at : 0.;
+}
+
+
+ev_tstamp release_last_at(
+    void)
+{
+  return last_at;
+}
+
+
+void release_init(
+    void)
+{
+  hist_init(&fire_error, "fire error");
+  hist_init(&arrival_error, "arrival error");
+  hist_init(&wake_latency, "loop wake latency");
+  hist_init(&sleep_latency, "sleep wake latency");
+  ev_periodic_init(&pe, release_event, 0., 0., 0);
+  ev_set_priority(&pe, EV_MAXPRI);
+  release_reset();
+}
+
+
+void release_reset(
+    void)
+{
+  class_t co, cl;
+  ev_tstamp now = ev_time();
+
+  release_destroy();
+
+  if (config_get_release_days() <= 0)
+    return;
+
+  LIST_FOREACH(co, config_get_classes(), l) {
+    /* A rule spanning many minutes has no one release to wait for, the
+     * periodic passes pick those classes up instead */
+    if (co->rule && !rule_single(co->rule)) {
+      ELOG(VERBOSE, "Section [%s] covers many times, not timing its release",
+           co->entry_name);
+      continue;
+    }
+
+    cl = class_dup(co);
+    if (!cl)
+      continue;
+    heap_push(release_next(cl, now), cl);
+  }
+
+  ELOG(INFO, "Scheduled %d class releases %d days ahead", heap_len,
+       config_get_release_days());
+  release_arm();
+}
+
+
+void release_destroy(
+    void)
+{
+  int i;
+
+  ev_periodic_stop(EV_DEFAULT, &pe);
+
+  for (i=0; i < heap_len; i++) {
+    class_destroy(heap[i].cl);
+    free(heap[i].cl);
+  }
+  free(heap);
+  heap = NULL;
+  heap_len = 0;
+  heap_size = 0;
+}
@@ -0,0 +1,23 @@
+#ifndef _RELEASE_H_
+#define _RELEASE_H_
+
+#include <ev.h>
+#include "class.h"
+#include "website.h"
+
+/* How many recent timings of each request to learn the sites latency
+ * from, no more are kept */
+#define RELEASE_SAMPLES 50
+
+void release_init(void);
+void release_reset(void); /* Rebuild from config */
+void release_destroy(void);
+double release_wait(ev_tstamp at);
+double release_lead(void);
+void release_window_enter(void);
+void release_window_leave(void);
+ev_tstamp release_next_at(void);
+ev_tstamp release_last_at(void);
+void release_outcome(const char *name, ev_tstamp at, ev_tstamp sent,
+                     struct website_timing *timing, int booked, int armed);
+#endif
@@ -0,0 +1,439 @@
+#include "common.h"
+#include "logging.h"
+#include "rule.h"
+#include <fnmatch.h>
+#include <regex.h>
+
+LOGSET("rule");
+
+#define RULE_LOCATIONS_MAX 16
+
+/* What a class section asks for, compiled once when the config is read.
+ * Times become a bitmap over the minutes of the week so any number of
+ * days and ranges costs one bit test per timetable entry, the name is a
+ * string, a glob or a compiled regex */
+enum rule_kind {
+  RULE_EXACT,
+  RULE_GLOB,
+  RULE_REGEX,
+};
+
+struct rule {
+  int refs;
+  enum rule_kind kind;
+  char *pattern;
+  regex_t re;
+  int nlocations;
+  int locations[RULE_LOCATIONS_MAX];
+  rule_mask minutes;
+};
+
+static int rule_minute(struct tm *tm);
+static int parse_day(const char *s, int len);
+static bool parse_days(const char *section, const char *spec, uint8_t *days);
+static bool parse_clock(const char *s, int *minute);
+static bool parse_times(const char *section, uint8_t daymask, const char *spec,
+                        rule_mask m);
+static bool parse_locations(const char *section, const char *spec, rule_t r);
+
+
+
+static int rule_minute(
+    struct tm *tm)
+{
+  if (tm->tm_wday < 0 || tm->tm_wday > 6 || tm->tm_hour < 0 ||
+      tm->tm_hour > 23 || tm->tm_min < 0 || tm->tm_min > 59)
+    return -1;
+  return tm->tm_wday * 1440 + tm->tm_hour * 60 + tm->tm_min;
+}
+
+
+/* A day name, either in full or its three letter abbreviation */
+static int parse_day(
+    const char *s,
+    int len)
+{
+  static const char *names[] = { "sunday", "monday", "tuesday", "wednesday",
+                                 "thursday", "friday", "saturday" };
+  int i;
+
+  while (len > 0 && isspace(*s)) {
+    s++;
+    len--;
+  }
+  while (len > 0 && isspace(s[len-1]))
+    len--;
+  if (len < 3)
+    return -1;
+
+  for (i=0; i < 7; i++) {
+    if ((len == 3 || len == (int)strlen(names[i])) &&
+        strncasecmp(s, names[i], len) == 0)
+      return i;
+  }
+  return -1;
+}
+
+
+/* A comma separated list of days, ranges such as Mon-Fri (which may
+ * wrap over the weekend), weekdays, weekends or any */
+static bool parse_days(
+    const char *section,
+    const char *spec,
+    uint8_t *days)
+{
+  const char *p = spec, *end, *dash;
+  int from, to, len;
+
+  *days = 0;
+
+  while (*p) {
+    while (isspace(*p) || *p == ',')
+      p++;
+    if (!*p)
+      break;
+
+    end = p + strcspn(p, ",");
+    len = end - p;
+    while (len > 0 && isspace(p[len-1]))
+      len--;
+
+    if ((len == 1 && *p == '*') ||
+        (len == 3 && strncasecmp(p, "any", 3) == 0) ||
+        (len == 5 && strncasecmp(p, "daily", 5) == 0))
+      *days |= 0x7f;
+    else if (len == 8 && strncasecmp(p, "weekdays", 8) == 0)
+      *days |= 0x3e;
+    else if (len == 8 && strncasecmp(p, "weekends", 8) == 0)
+      *days |= 0x41;
+    else if ((dash = memchr(p, '-', len))) {
+      from = parse_day(p, dash - p);
+      to = parse_day(dash + 1, p + len - dash - 1);
+      if (from < 0 || to < 0)
+        goto fail;
+      for (; from != to; from = (from + 1) % 7)
+        *days |= 1 << from;
+      *days |= 1 << to;
+    }
+    else {
+      from = parse_day(p, len);
+      if (from < 0)
+        goto fail;
+      *days |= 1 << from;
+    }
+
+    p = end;
+  }
+
+  if (*days)
+    return true;
+
+fail:
+  ELOG(ERROR, "Incorrect day of week defined in section [%s]", section);
+  return false;
+}
+
+
+static bool parse_clock(
+    const char *s,
+    int *minute)
+{
+  struct tm tmp = {0};
+  char *p;
+
+  p = strptime(s, "%H:%M", &tmp);
+  if (!p)
+    return false;
+  while (isspace(*p))
+    p++;
+  if (*p != 0 && *p != '-' && *p != ',')
+    return false;
+
+  *minute = tmp.tm_hour * 60 + tmp.tm_min;
+  return true;
+}
+
+
+/* A comma separated list of times, HH:MM or a range HH:MM-HH:MM taking
+ * in both ends. A range that ends before it starts runs past midnight */
+static bool parse_times(
+    const char *section,
+    uint8_t daymask,
+    const char *spec,
+    rule_mask m)
+{
+  const char *p = spec, *dash;
+  int from, to, d, i, len;
+
+  while (*p) {
+    while (isspace(*p) || *p == ',')
+      p++;
+    if (!*p)
+      break;
+
+    len = strcspn(p, ",");
+    if (*p == '*') {
+      /* The whole day, nothing else may follow it */
+      for (i=1; i < len; i++)
+        if (!isspace(p[i]))
+          goto fail;
+      from = 0;
+      to = 1439;
+    }
+    else {
+      if (!parse_clock(p, &from))
+        goto fail;
+      dash = memchr(p, '-', len);
+      to = from;
+      if (dash && !parse_clock(dash + 1, &to))
+        goto fail;
+      if (to < from)
+        to += 1440;
+    }
+
+    for (d=0; d < 7; d++) {
+      if (!(daymask & (1 << d)))
+        continue;
+      for (i=from; i <= to; i++) {
+        int bit = (d * 1440 + i) % RULE_MINUTES;
+        m[bit / 64] |= 1ull << (bit % 64);
+      }
+    }
+
+    p += len;
+  }
+  return true;
+
+fail:
+  ELOG(ERROR, "Incorrect time defined in section [%s]", section);
+  return false;
+}
+
+
+static bool parse_locations(
+    const char *section,
+    const char *spec,
+    rule_t r)
+{
+  const char *p = spec;
+  char *end;
+  long id;
+
+  while (*p) {
+    while (isspace(*p) || *p == ',')
+      p++;
+    if (!*p)
+      break;
+
+    id = strtol(p, &end, 10);
+    if (end == p || id < 0 || r->nlocations == RULE_LOCATIONS_MAX) {
+      ELOG(ERROR, "Incorrect location defined in section [%s]", section);
+      return false;
+    }
+    r->locations[r->nlocations++] = id;
+    p = end;
+  }
+  return true;
+}
+
+
+
+/* Compile the keys of a class section. The name is matched exactly
+ * unless it is a glob (has any of *?[) or a /regex/. Location, if
+ * given, lists the FacilityLocationIDs the class may be held at */
+rule_t rule_compile(
+    const char *section,
+    const char *name,
+    const char *days,
+    const char *times,
+    const char *location)
+{
+  char errbuf[256];
+  uint8_t daymask;
+  size_t len;
+  int rc;
+  rule_t r;
+
+  if (!name) {
+    ELOG(ERROR, "Cannot create class name for section [%s]", section);
+    return NULL;
+  }
+  if (!days) {
+    ELOG(ERROR, "Incorrect day of week defined in section [%s]", section);
+    return NULL;
+  }
+  if (!times) {
+    ELOG(ERROR, "Incorrect time defined in section [%s]", section);
+    return NULL;
+  }
+
+  r = calloc(1, sizeof(struct rule));
+  if (!r) {
+    ELOGERR(ERROR, "Cannot allocate rule for section [%s]", section);
+    return NULL;
+  }
+  r->refs = 1;
+
+  len = strlen(name);
+  if (len > 2 && name[0] == '/' && name[len-1] == '/') {
+    r->kind = RULE_REGEX;
+    r->pattern = strndup(name + 1, len - 2);
+  }
+  else {
+    r->kind = strpbrk(name, "*?[") ? RULE_GLOB : RULE_EXACT;
+    r->pattern = strdup(name);
+  }
+  if (!r->pattern) {
+    ELOGERR(ERROR, "Cannot allocate rule for section [%s]", section);
+    goto fail;
+  }
+
+  if (r->kind == RULE_REGEX) {
+    rc = regcomp(&r->re, r->pattern, REG_EXTENDED|REG_NOSUB);
+    if (rc) {
+      regerror(rc, &r->re, errbuf, sizeof(errbuf));
+      ELOG(ERROR, "Incorrect name pattern in section [%s]: %s", section, errbuf);
+      r->kind = RULE_EXACT;
+      goto fail;
+    }
+  }
+
+  if (!parse_days(section, days, &daymask))
+    goto fail;
+  if (!parse_times(section, daymask, times, r->minutes))
+    goto fail;
+  if (location && !parse_locations(section, location, r))
+    goto fail;
+
+  return r;
+
+fail:
+  rule_unref(r);
+  return NULL;
+}
+
+
+rule_t rule_ref(
+    rule_t r)
+{
+  if (r)
+    __atomic_add_fetch(&r->refs, 1, __ATOMIC_RELAXED);
+  return r;
+}
+
+
+void rule_unref(
+    rule_t r)
+{
+  if (!r || __atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  if (r->kind == RULE_REGEX)
+    regfree(&r->re);
+  free(r->pattern);
+  free(r);
+}
+
+
+/* Does this timetable entry satisfy the rule */
+bool rule_match(
+    rule_t r,
+    class_t we)
+{
+  int i, minute = rule_minute(&we->time);
+
+  if (minute < 0 || !(r->minutes[minute / 64] & (1ull << (minute % 64))))
+    return false;
+
+  if (r->nlocations) {
+    for (i=0; i < r->nlocations; i++) {
+      if (r->locations[i] == we->clubid)
+        break;
+    }
+    if (i == r->nlocations)
+      return false;
+  }
+
+  switch (r->kind) {
+  case RULE_EXACT:
+    return strcmp(r->pattern, we->class_name) == 0;
+  case RULE_GLOB:
+    return fnmatch(r->pattern, we->class_name, 0) == 0;
+  case RULE_REGEX:
+    return regexec(&r->re, we->class_name, 0, NULL, 0) == 0;
+  }
+  return false;
+}
+
+
+bool rule_equal(
+    rule_t a,
+    rule_t b)
+{
+  if (a == b)
+    return true;
+  if (!a || !b)
+    return false;
+
+  return a->kind == b->kind && strcmp(a->pattern, b->pattern) == 0 &&
+         a->nlocations == b->nlocations &&
+         memcmp(a->locations, b->locations, sizeof(int) * a->nlocations) == 0 &&
+         memcmp(a->minutes, b->minutes, sizeof(rule_mask)) == 0;
+}
+
+
+/* True if the rule names exactly one minute of the week, the only kind
+ * whose release time can be known in advance */
+bool rule_single(
+    rule_t r)
+{
+  int i, n = 0;
+
+  for (i=0; i < RULE_WORDS; i++)
+    n += __builtin_popcountll(r->minutes[i]);
+  return n == 1;
+}
+
+
+/* The earliest minute of the week the rule covers */
+void rule_first(
+    rule_t r,
+    struct tm *tm)
+{
+  int i;
+
+  for (i=0; i < RULE_WORDS; i++) {
+    if (r->minutes[i])
+      break;
+  }
+  if (i == RULE_WORDS)
+    return;
+
+  i = i * 64 + __builtin_ctzll(r->minutes[i]);
+  tm->tm_wday = i / 1440;
+  tm->tm_hour = (i % 1440) / 60;
+  tm->tm_min = i % 60;
+}
+
+
+/* Masks gather the minutes of several rules so that a timetable entry
+ * no rule could want is passed over with one test */
+void rule_mask_add(
+    rule_mask m,
+    rule_t r)
+{
+  int i;
+
+  for (i=0; i < RULE_WORDS; i++)
+    m[i] |= r->minutes[i];
+}
+
+
+bool rule_mask_test(
+    const rule_mask m,
+    class_t we)
+{
+  int minute = rule_minute(&we->time);
+
+  return minute >= 0 && (m[minute / 64] & (1ull << (minute % 64)));
+}
@@ -0,0 +1,26 @@
+#ifndef _RULE_H_
+#define _RULE_H_
+
+#include "common.h"
+#include "class.h"
+
+/* One bit for every minute of the week, Sunday 00:00 first */
+#define RULE_MINUTES (7 * 24 * 60)
+#define RULE_WORDS ((RULE_MINUTES + 63) / 64)
+
+typedef uint64_t rule_mask[RULE_WORDS];
+typedef struct rule * rule_t;
+
+rule_t rule_compile(const char *section, const char *name, const char *days,
+                    const char *times, const char *location);
+rule_t rule_ref(rule_t r);
+void rule_unref(rule_t r);
+
+bool rule_match(rule_t r, class_t we);
+bool rule_equal(rule_t a, rule_t b);
+bool rule_single(rule_t r);
+void rule_first(rule_t r, struct tm *tm);
+
+void rule_mask_add(rule_mask m, rule_t r);
+bool rule_mask_test(const rule_mask m, class_t we);
+#endif
@@ -0,0 +1,66 @@
+#include "common.h"
+#include "series.h"
+
+static int compare_double(const void *a, const void *b);
+
+
+
+static int compare_double(
+    const void *a,
+    const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+
+void series_add(
+    struct series *s,
+    double v)
+{
+  double *p;
+
+  if (s->n == s->size) {
+    s->size = s->size ? s->size * 2 : 256;
+    p = realloc(s->v, s->size * sizeof(double));
+    if (!p)
+      err(EXIT_FAILURE, "Cannot allocate samples");
+    s->v = p;
+  }
+  s->v[s->n++] = v;
+}
+
+
+void series_sort(
+    struct series *s)
+{
+  if (s->n)
+    qsort(s->v, s->n, sizeof(double), compare_double);
+}
+
+
+/* Nearest rank, the series must be sorted */
+double series_quantile(
+    struct series *s,
+    double q)
+{
+  size_t rank;
+
+  if (!s->n)
+    return 0.;
+
+  rank = q * s->n;
+  if (rank < q * s->n || rank < 1)
+    rank++;
+  if (rank > s->n)
+    rank = s->n;
+  return s->v[rank - 1];
+}
+
+
+void series_free(
+    struct series *s)
+{
+  free(s->v);
+  memset(s, 0, sizeof(struct series));
+}
@@ -0,0 +1,17 @@
+#ifndef _SERIES_H_
+#define _SERIES_H_
+
+#include "common.h"
+
+/* Every sample kept, for the tools that report exact percentiles */
+struct series {
+  double *v;
+  size_t n;
+  size_t size;
+};
+
+void series_add(struct series *s, double v);
+void series_sort(struct series *s);
+double series_quantile(struct series *s, double q);
+void series_free(struct series *s);
+#endif
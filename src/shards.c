@@ -0,0 +1,418 @@
+#include "common.h"
+#include "logging.h"
+#include "shards.h"
+#include "stall.h"
+#include <ev.h>
+#include <sched.h>
+#include <signal.h>
+
+LOGSET("shards");
+
+#define SHARDS_MAX 64
+
+/* A queue of calls to make on a loop, fed from any thread and
+ * drained by the loop that owns it when its async watcher fires */
+struct shard_msg {
+  shard_fn fn;
+  void *data;
+  STAILQ_ENTRY(shard_msg) l;
+};
+
+STAILQ_HEAD(shard_msgq, shard_msg);
+
+struct mailbox {
+  pthread_mutex_t lock;
+  struct shard_msgq q;
+  struct ev_loop *loop;
+  ev_async wake;
+  ev_idle *work;
+};
+
+/* Tasks sit on the deque of the shard they were pushed to. The owner
+ * takes from the head, idle shards steal from the tail, so a burst
+ * pushed to one shard is spread over every core that has nothing to do */
+struct shard_task {
+  shard_fn fn;
+  void *data;
+  TAILQ_ENTRY(shard_task) l;
+};
+
+TAILQ_HEAD(shard_taskq, shard_task);
+
+struct shard {
+  int id;
+  int cpu;
+  pthread_t thread;
+  struct mailbox mb;
+  pthread_mutex_t tlock;
+  struct shard_taskq tasks;
+  ev_idle work;
+  volatile int busy;
+};
+
+static struct shard *shards = NULL;
+static int nshards = 0;
+static struct mailbox home;
+static __thread int self = -1;
+
+static void mailbox_init(struct mailbox *mb, struct ev_loop *loop);
+static void mailbox_post(struct mailbox *mb, shard_fn fn, void *data);
+static void mailbox_drain_event(EV_P_ ev_async *w, int revents);
+static void mailbox_destroy(struct mailbox *mb);
+static void shard_stop_event(EV_P_ void *data);
+static struct shard_task * shard_take(struct shard *sh, bool steal);
+static void shard_work_event(EV_P_ ev_idle *w, int revents);
+static void * shard_thread(void *data);
+
+
+
+static void mailbox_init(
+    struct mailbox *mb,
+    struct ev_loop *loop)
+{
+  pthread_mutex_init(&mb->lock, NULL);
+  STAILQ_INIT(&mb->q);
+  mb->loop = loop;
+  mb->work = NULL;
+
+  ev_async_init(&mb->wake, mailbox_drain_event);
+  mb->wake.data = mb;
+  ev_set_priority(&mb->wake, EV_MAXPRI);
+  ev_async_start(loop, &mb->wake);
+}
+
+
+static void mailbox_post(
+    struct mailbox *mb,
+    shard_fn fn,
+    void *data)
+{
+  struct shard_msg *msg = calloc(1, sizeof(struct shard_msg));
+  if (!msg) {
+    ELOGERR(CRITICAL, "Cannot allocate shard message");
+    exit(EXIT_FAILURE);
+  }
+
+  msg->fn = fn;
+  msg->data = data;
+
+  pthread_mutex_lock(&mb->lock);
+  STAILQ_INSERT_TAIL(&mb->q, msg, l);
+  pthread_mutex_unlock(&mb->lock);
+
+  ev_async_send(mb->loop, &mb->wake);
+}
+
+
+static void mailbox_drain_event(
+    EV_P_ ev_async *w,
+    int revents)
+{
+  struct mailbox *mb = w->data;
+  struct shard_msgq q;
+  struct shard_msg *msg;
+
+  STALL_TAG();
+
+  /* Take everything queued so far, callers can post whilst we run */
+  pthread_mutex_lock(&mb->lock);
+  STAILQ_INIT(&q);
+  STAILQ_CONCAT(&q, &mb->q);
+  pthread_mutex_unlock(&mb->lock);
+
+  while ((msg = STAILQ_FIRST(&q))) {
+    STAILQ_REMOVE_HEAD(&q, l);
+    msg->fn(EV_A_ msg->data);
+    free(msg);
+  }
+
+  /* We may have been woken to look for tasks */
+  if (mb->work)
+    ev_idle_start(EV_A_ mb->work);
+}
+
+
+static void mailbox_destroy(
+    struct mailbox *mb)
+{
+  struct shard_msg *msg;
+
+  ev_async_stop(mb->loop, &mb->wake);
+
+  while ((msg = STAILQ_FIRST(&mb->q))) {
+    STAILQ_REMOVE_HEAD(&mb->q, l);
+    free(msg);
+  }
+  pthread_mutex_destroy(&mb->lock);
+}
+
+
+static void shard_stop_event(
+    EV_P_ void *data)
+{
+  ev_break(EV_A_ EVBREAK_ALL);
+}
+
+
+static struct shard_task * shard_take(
+    struct shard *sh,
+    bool steal)
+{
+  struct shard_task *task;
+
+  pthread_mutex_lock(&sh->tlock);
+  if (steal)
+    task = TAILQ_LAST(&sh->tasks, shard_taskq);
+  else
+    task = TAILQ_FIRST(&sh->tasks);
+
+  if (task)
+    TAILQ_REMOVE(&sh->tasks, task, l);
+  pthread_mutex_unlock(&sh->tlock);
+
+  return task;
+}
+
+
+/* Runs one task per loop iteration whilst there is work about, first
+ * from our own deque then from whoever else has some */
+static void shard_work_event(
+    EV_P_ ev_idle *w,
+    int revents)
+{
+  struct shard *sh = w->data;
+  struct shard_task *task;
+  int i;
+
+  task = shard_take(sh, false);
+  for (i=1; !task && i < nshards; i++)
+    task = shard_take(&shards[(sh->id + i) % nshards], true);
+
+  if (!task) {
+    ev_idle_stop(EV_A_ w);
+    return;
+  }
+
+  sh->busy = 1;
+  task->fn(EV_A_ task->data);
+  sh->busy = 0;
+  free(task);
+}
+
+
+static void * shard_thread(
+    void *data)
+{
+  struct shard *sh = data;
+  cpu_set_t cpus;
+  char name[16] = {0};
+
+  self = sh->id;
+
+  snprintf(name, sizeof(name), "abbeyd/%d", sh->id);
+  pthread_setname_np(pthread_self(), name);
+
+  /* Pin to our core, not fatal if the container denies us it */
+  CPU_ZERO(&cpus);
+  CPU_SET(sh->cpu, &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+    ELOG(WARNING, "Cannot pin shard %d to cpu %d", sh->id, sh->cpu);
+
+  ELOG(VERBOSE, "Shard %d running on cpu %d", sh->id, sh->cpu);
+  ev_run(sh->mb.loop, 0);
+  ELOG(VERBOSE, "Shard %d stopped", sh->id);
+
+  return NULL;
+}
+
+
+
+/* Start nshards worker threads, each with its own event loop pinned to
+ * a core. A value of zero or less uses one shard per online cpu */
+void shards_init(
+    int n)
+{
+  int i, ncpu;
+  sigset_t all, old;
+  struct ev_loop *loop;
+
+  ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpu < 1)
+    ncpu = 1;
+
+  if (n <= 0)
+    n = ncpu;
+  if (n > SHARDS_MAX)
+    n = SHARDS_MAX;
+
+  mailbox_init(&home, EV_DEFAULT);
+
+  shards = calloc(n, sizeof(struct shard));
+  if (!shards) {
+    ELOGERR(CRITICAL, "Cannot allocate shards");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Signals are for the default loop only, workers inherit the mask */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+
+  for (i=0; i < n; i++) {
+    shards[i].id = i;
+    shards[i].cpu = i % ncpu;
+
+    loop = ev_loop_new(EVFLAG_AUTO);
+    if (!loop) {
+      ELOG(CRITICAL, "Cannot create event loop for shard %d", i);
+      exit(EXIT_FAILURE);
+    }
+    mailbox_init(&shards[i].mb, loop);
+
+    pthread_mutex_init(&shards[i].tlock, NULL);
+    TAILQ_INIT(&shards[i].tasks);
+    ev_idle_init(&shards[i].work, shard_work_event);
+    shards[i].work.data = &shards[i];
+    shards[i].mb.work = &shards[i].work;
+
+    if (pthread_create(&shards[i].thread, NULL, shard_thread, &shards[i])) {
+      ELOGERR(CRITICAL, "Cannot start shard %d", i);
+      exit(EXIT_FAILURE);
+    }
+    nshards++;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  ELOG(INFO, "Started %d shards over %d cpus", nshards, ncpu);
+}
+
+
+void shards_destroy(
+    void)
+{
+  int i;
+  struct shard_task *task;
+
+  /* Stop everyone first so they wind down in parallel */
+  shards_broadcast(shard_stop_event, NULL);
+
+  for (i=0; i < nshards; i++) {
+    pthread_join(shards[i].thread, NULL);
+
+    while ((task = TAILQ_FIRST(&shards[i].tasks))) {
+      TAILQ_REMOVE(&shards[i].tasks, task, l);
+      free(task);
+    }
+    pthread_mutex_destroy(&shards[i].tlock);
+
+    ev_idle_stop(shards[i].mb.loop, &shards[i].work);
+    mailbox_destroy(&shards[i].mb);
+    ev_loop_destroy(shards[i].mb.loop);
+  }
+
+  free(shards);
+  shards = NULL;
+  nshards = 0;
+
+  mailbox_destroy(&home);
+  ELOG(VERBOSE, "Shards stopped");
+}
+
+
+int shards_count(
+    void)
+{
+  return nshards;
+}
+
+
+/* The shard the calling thread is, or -1 from the default loop */
+int shards_self(
+    void)
+{
+  return self;
+}
+
+
+/* Maps a key (such as an account login) to the shard that owns it */
+int shards_for_key(
+    const char *key)
+{
+  uint32_t hash = 2166136261u;
+
+  assert(nshards > 0);
+
+  while (key && *key) {
+    hash ^= (unsigned char)*key++;
+    hash *= 16777619u;
+  }
+
+  return hash % nshards;
+}
+
+
+/* Run fn on the given shards loop */
+void shards_submit(
+    int shard,
+    shard_fn fn,
+    void *data)
+{
+  assert(shard >= 0 && shard < nshards);
+  mailbox_post(&shards[shard].mb, fn, data);
+}
+
+
+/* Queue fn as a task on the given shard. Unlike shards_submit, any idle
+ * shard may steal and run it, so tasks must not depend on each other */
+void shards_push(
+    int shard,
+    shard_fn fn,
+    void *data)
+{
+  struct shard *sh;
+  struct shard_task *task;
+  int i;
+
+  assert(shard >= 0 && shard < nshards);
+  sh = &shards[shard];
+
+  task = calloc(1, sizeof(struct shard_task));
+  if (!task) {
+    ELOGERR(CRITICAL, "Cannot allocate shard task");
+    exit(EXIT_FAILURE);
+  }
+  task->fn = fn;
+  task->data = data;
+
+  pthread_mutex_lock(&sh->tlock);
+  TAILQ_INSERT_TAIL(&sh->tasks, task, l);
+  pthread_mutex_unlock(&sh->tlock);
+
+  /* Wake the owner and anyone idle enough to steal it */
+  ev_async_send(sh->mb.loop, &sh->mb.wake);
+  for (i=0; i < nshards; i++) {
+    if (i != shard && !shards[i].busy)
+      ev_async_send(shards[i].mb.loop, &shards[i].mb.wake);
+  }
+}
+
+
+/* Run fn on every shards loop, data is shared between them */
+void shards_broadcast(
+    shard_fn fn,
+    void *data)
+{
+  int i;
+
+  for (i=0; i < nshards; i++)
+    mailbox_post(&shards[i].mb, fn, data);
+}
+
+
+/* Run fn on the default loop, used to hand results back from a shard */
+void shards_complete(
+    shard_fn fn,
+    void *data)
+{
+  mailbox_post(&home, fn, data);
+}
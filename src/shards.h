@@ -0,0 +1,18 @@
+#ifndef _SHARDS_H_
+#define _SHARDS_H_
+
+#include <ev.h>
+
+typedef void (*shard_fn)(EV_P_ void *data);
+
+void shards_init(int nshards);
+void shards_destroy(void);
+
+int shards_count(void);
+int shards_self(void);
+int shards_for_key(const char *key);
+void shards_submit(int shard, shard_fn fn, void *data);
+void shards_push(int shard, shard_fn fn, void *data);
+void shards_broadcast(shard_fn fn, void *data);
+void shards_complete(shard_fn fn, void *data);
+#endif
@@ -3,6 +3,7 @@
 #include "bookings.h"
 #include "logging.h"
 #include "config.h"
+#include "stall.h"
 #include <ev.h>
 
 LOGSET("bookings");
@@ -22,6 +23,7 @@ static void recheck_bookings_event(
     EV_P_ ev_signal *w,
     int revents)
 {
+   STALL_TAG();
    ELOG(INFO, "Received signal to recheck bookings");
    bookings_check();
 }
@@ -30,6 +32,7 @@ static void end_service_event(
     EV_P_ ev_signal *w,
     int revents)
 {
+  STALL_TAG();
   ELOG(INFO, "Received signal to terminate");
   ev_break(EV_A_ EVBREAK_ALL);
 }
@@ -38,6 +41,7 @@ static void reload_config_event(
     EV_P_ ev_signal *w,
     int revents)
 {
+  STALL_TAG();
   ELOG(INFO, "Received signal to reload config file");
   config_reload();
 }
@@ -0,0 +1,160 @@
+#include "common.h"
+#include "config.h"
+#include "logging.h"
+#include "hist.h"
+#include "stall.h"
+#include <ev.h>
+
+LOGSET("stall");
+
+/* An ev_check runs as soon as the loop wakes and an ev_prepare just
+ * before it blocks again, so the time between them is what the loops
+ * callbacks took. Each loop runs on one thread, so per loop state can
+ * live in thread locals */
+struct stall {
+  const char *name;
+  ev_check check;
+  ev_prepare prepare;
+};
+
+static struct hist lag;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static __thread struct stall *self = NULL;
+static __thread ev_tstamp woke = 0.;
+static __thread ev_tstamp tagged = 0.;
+static __thread const char *tag = NULL;
+static __thread const char *worst = NULL;
+static __thread ev_tstamp worst_took = 0.;
+
+static void stall_hist_init(void);
+static void stall_close(ev_tstamp now);
+static void stall_check_event(EV_P_ ev_check *w, int revents);
+static void stall_prepare_event(EV_P_ ev_prepare *w, int revents);
+
+
+
+static void stall_hist_init(
+    void)
+{
+  hist_init(&lag, "loop lag");
+}
+
+
+/* Ends whatever the current tag is, keeping it if it was the longest */
+static void stall_close(
+    ev_tstamp now)
+{
+  if (now - tagged > worst_took) {
+    worst_took = now - tagged;
+    worst = tag ? tag : "untagged";
+  }
+  tagged = now;
+  tag = NULL;
+}
+
+
+static void stall_check_event(
+    EV_P_ ev_check *w,
+    int revents)
+{
+  woke = tagged = ev_time();
+  tag = NULL;
+  worst = NULL;
+  worst_took = 0.;
+}
+
+
+static void stall_prepare_event(
+    EV_P_ ev_prepare *w,
+    int revents)
+{
+  struct stall *st = w->data;
+  ev_tstamp now = ev_time();
+  ev_tstamp took;
+  char buf[256];
+
+  /* Before the first wake up there is nothing to measure */
+  if (woke == 0.)
+    return;
+
+  stall_close(now);
+  took = now - woke;
+  hist_add(&lag, took);
+
+  if (took * 1000. > config_get_stall_warning()) {
+    ELOG(WARNING, "%s loop stalled for %.3f seconds, longest in %s "
+         "(%.3f seconds)", st->name, took, worst, worst_took);
+    ELOG(VERBOSE, "%s", hist_print(&lag, buf, sizeof(buf)));
+  }
+
+  woke = 0.;
+}
+
+
+
+/* Measure every iteration of the loop, which must be run by the calling
+ * thread */
+void stall_attach(
+    EV_P_ const char *name)
+{
+  struct stall *st;
+
+  pthread_once(&once, stall_hist_init);
+
+  st = calloc(1, sizeof(struct stall));
+  if (!st) {
+    ELOGERR(CRITICAL, "Cannot allocate stall detector");
+    exit(EXIT_FAILURE);
+  }
+  st->name = name;
+
+  /* First in and last out so everything else is inside the measurement */
+  ev_check_init(&st->check, stall_check_event);
+  ev_set_priority(&st->check, EV_MAXPRI);
+  ev_check_start(EV_A_ &st->check);
+
+  ev_prepare_init(&st->prepare, stall_prepare_event);
+  ev_set_priority(&st->prepare, EV_MINPRI);
+  st->prepare.data = st;
+  ev_prepare_start(EV_A_ &st->prepare);
+
+  /* Our own watchers dont keep the loop alive */
+  ev_unref(EV_A);
+  ev_unref(EV_A);
+
+  self = st;
+}
+
+
+void stall_detach(
+    EV_P)
+{
+  if (!self)
+    return;
+
+  ev_ref(EV_A);
+  ev_ref(EV_A);
+  ev_check_stop(EV_A_ &self->check);
+  ev_prepare_stop(EV_A_ &self->prepare);
+  free(self);
+  self = NULL;
+}
+
+
+void stall_tag(
+    const char *name)
+{
+  if (woke == 0.)
+    return;
+
+  stall_close(ev_time());
+  tag = name;
+}
+
+
+struct hist * stall_hist(
+    void)
+{
+  pthread_once(&once, stall_hist_init);
+  return &lag;
+}
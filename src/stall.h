@@ -0,0 +1,15 @@
+#ifndef _STALL_H_
+#define _STALL_H_
+
+#include <ev.h>
+#include "hist.h"
+
+/* Put at the top of a watcher callback so any stall it causes is
+ * blamed on it by name */
+#define STALL_TAG() stall_tag(__func__)
+
+void stall_attach(EV_P_ const char *name);
+void stall_detach(EV_P);
+void stall_tag(const char *name);
+struct hist * stall_hist(void);
+#endif
@@ -0,0 +1,250 @@
+#include "common.h"
+#include "class.h"
+#include "website.h"
+#include "logging.h"
+#include "timetable.h"
+#include <ev.h>
+
+LOGSET("timetable");
+
+/* A snapshot is reused by anyone asking for the same location within
+ * this many seconds, so everything woken in the same refresh shares
+ * one fetch and one parse */
+#define TIMETABLE_MAX_AGE 5.0
+
+/* One parsed GetClassTimeTable response. Once published a snapshot is
+ * never modified, consumers copy out anything they need to keep. The
+ * personal fields (booked, waiting) are those of the logged in account */
+struct timetable {
+  char *location;
+  int ndays;
+  unsigned int generation;
+  ev_tstamp requested;
+  ev_tstamp received;
+  ev_tstamp fetched;
+  int refs;
+  bool fetching;
+  class_list_t classes;
+  LIST_ENTRY(timetable) l;
+};
+
+LIST_HEAD(timetable_list, timetable);
+
+/* Shards fetch concurrently, the cache and refcounts are under lock.
+ * Whoever finds no snapshot fetches it, anyone else asking for that
+ * location meanwhile waits on ready rather than fetching it again */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+static struct timetable_list cache;
+static unsigned int generation = 0;
+
+static void timetable_free(timetable_t tt);
+static void timetable_release(timetable_t tt);
+static void timetable_evict(timetable_t tt);
+static timetable_t timetable_lookup(const char *location, int ndays);
+
+
+
+static void timetable_free(
+    timetable_t tt)
+{
+  if (!tt)
+    return;
+
+  ELOG(DEBUG, "Freeing timetable snapshot for %s", tt->location);
+  class_free_timetable(tt->classes);
+  free(tt->classes);
+  free(tt->location);
+  free(tt);
+}
+
+
+/* Called with the lock held */
+static void timetable_release(
+    timetable_t tt)
+{
+  assert(tt->refs > 0);
+  tt->refs--;
+  if (tt->refs == 0)
+    timetable_free(tt);
+}
+
+
+/* Drop the caches reference, the snapshot lives on until its last user
+ * puts it back */
+static void timetable_evict(
+    timetable_t tt)
+{
+  LIST_REMOVE(tt, l);
+  timetable_release(tt);
+}
+
+
+static timetable_t timetable_lookup(
+    const char *location,
+    int ndays)
+{
+  timetable_t tt, ne;
+  ev_tstamp now = ev_time();
+
+  tt = LIST_FIRST(&cache);
+  while (tt) {
+    ne = LIST_NEXT(tt, l);
+
+    if (strcmp(tt->location, location) == 0) {
+      if (tt->fetching)
+        return tt;
+
+      if (tt->generation == generation &&
+          tt->ndays >= ndays &&
+          now - tt->fetched < TIMETABLE_MAX_AGE) {
+        return tt;
+      }
+
+      /* Superseded by the fetch we are about to do */
+      timetable_evict(tt);
+    }
+    tt = ne;
+  }
+
+  return NULL;
+}
+
+
+
+void timetable_init(
+    void)
+{
+  ELOG(VERBOSE, "Initializing");
+  LIST_INIT(&cache);
+}
+
+
+void timetable_destroy(
+    void)
+{
+  timetable_t tt, ne;
+
+  pthread_mutex_lock(&lock);
+  tt = LIST_FIRST(&cache);
+  while (tt) {
+    ne = LIST_NEXT(tt, l);
+    timetable_evict(tt);
+    tt = ne;
+  }
+  pthread_mutex_unlock(&lock);
+  ELOG(VERBOSE, "Timetable cache destroyed");
+}
+
+
+/* Returns a reference to the current timetable snapshot for location,
+ * fetching it only if no fresh snapshot exists. Release the reference
+ * with timetable_put */
+timetable_t timetable_get(
+    const char *location,
+    int ndays)
+{
+  timetable_t tt = NULL;
+  class_list_t classes = NULL;
+
+  pthread_mutex_lock(&lock);
+  while ((tt = timetable_lookup(location, ndays)) && tt->fetching)
+    pthread_cond_wait(&ready, &lock);
+
+  if (tt) {
+    ELOG(VERBOSE, "Using shared timetable for %s fetched %.3f seconds ago",
+         location, ev_time() - tt->fetched);
+    tt->refs++;
+    pthread_mutex_unlock(&lock);
+    return tt;
+  }
+
+  tt = calloc(1, sizeof(struct timetable));
+  if (!tt) {
+    ELOGERR(WARNING, "Cannot allocate timetable");
+    pthread_mutex_unlock(&lock);
+    return NULL;
+  }
+
+  tt->location = strdup(location);
+  if (!tt->location) {
+    ELOGERR(WARNING, "Cannot allocate timetable location");
+    free(tt);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+  }
+
+  /* Publish a placeholder so concurrent callers wait for our fetch.
+   * One reference for the cache, one for the caller */
+  tt->ndays = ndays;
+  tt->generation = generation;
+  tt->fetching = true;
+  tt->refs = 2;
+  LIST_INSERT_HEAD(&cache, tt, l);
+  pthread_mutex_unlock(&lock);
+
+  tt->requested = ev_time();
+  classes = website_get_timetable(ndays, &tt->received);
+
+  pthread_mutex_lock(&lock);
+  tt->classes = classes;
+  tt->fetched = ev_time();
+  tt->fetching = false;
+
+  /* Failures are not cached, the next caller tries again */
+  if (!classes) {
+    timetable_evict(tt);
+    timetable_release(tt);
+    tt = NULL;
+  }
+  pthread_cond_broadcast(&ready);
+  pthread_mutex_unlock(&lock);
+
+  return tt;
+}
+
+
+void timetable_put(
+    timetable_t tt)
+{
+  if (!tt)
+    return;
+
+  pthread_mutex_lock(&lock);
+  timetable_release(tt);
+  pthread_mutex_unlock(&lock);
+}
+
+
+class_list_t timetable_classes(
+    timetable_t tt)
+{
+  assert(tt);
+  return tt->classes;
+}
+
+
+/* Mark all snapshots stale, for instance after we have booked something
+ * and the personal fields no longer reflect the website */
+void timetable_invalidate(
+    void)
+{
+  ELOG(DEBUG, "Invalidating timetable snapshots");
+  pthread_mutex_lock(&lock);
+  generation++;
+  pthread_mutex_unlock(&lock);
+}
+
+
+/* When the snapshot was asked for, when the response arrived and when
+ * it was parsed */
+void timetable_times(
+    timetable_t tt,
+    double *requested,
+    double *received,
+    double *parsed)
+{
+  *requested = tt->requested;
+  *received = tt->received;
+  *parsed = tt->fetched;
+}
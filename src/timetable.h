@@ -0,0 +1,17 @@
+#ifndef _TIMETABLE_H_
+#define _TIMETABLE_H_
+
+#include "class.h"
+
+typedef struct timetable * timetable_t;
+
+void timetable_init(void);
+void timetable_destroy(void);
+
+timetable_t timetable_get(const char *location, int ndays);
+void timetable_put(timetable_t tt);
+class_list_t timetable_classes(timetable_t tt);
+void timetable_invalidate(void);
+void timetable_times(timetable_t tt, double *requested, double *received,
+                     double *parsed);
+#endif
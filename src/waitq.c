@@ -4,6 +4,10 @@
 #include "website.h"
 #include "waitq.h"
 #include "logging.h"
+#include "offload.h"
+#include "quiet.h"
+#include "stall.h"
+#include "events.h"
 #include <ev.h>
 
 LOGSET("waitq");
@@ -12,54 +16,147 @@ static ev_timer timer;
 static struct class_list head;
 static int list_size = 0;
 
-static void rebook_waitlist(
-    EV_P_ ev_timer *w,
-    int revents)
-{
-  ELOG(VERBOSE, "Checking rebookings");
-  bool commit = false;
-  class_t cl, ne;
-  cl = LIST_FIRST(&head);
+/* A copy of the queue to rebook off the loop, the real one may be
+ * flushed and refilled whilst this is out */
+struct rebook_run {
+  struct class_list tries;
+  struct class_list booked;
+  struct event_list events;
+  bool committed;
+  ev_tstamp committed_at;
+};
 
-  if (!database_start())
-    return;
+static bool rebooking = false;
+
+static void rebook_work(offload_job_t job, void *data);
+static void rebook_done(EV_P_ void *data);
+
+
+/* Runs on a shard */
+static void rebook_work(
+    offload_job_t job,
+    void *data)
+{
+  struct rebook_run *run = data;
+  struct event ev, *cp;
+  ev_tstamp started = ev_time();
+  class_t cl;
 
   /* Iterate the list trying to book each entry */
-  while (cl) {
-    ne = LIST_NEXT(cl, l);
+  while ((cl = LIST_FIRST(&run->tries))) {
+    LIST_REMOVE(cl, l);
 
-    /* Remove from queue if we booked it */
     if (website_book(cl)) {
-      commit = true;
-      database_add(cl);
-
       ELOG(INFO, "%s has been booked", class_print(cl));
+      LIST_INSERT_HEAD(&run->booked, cl, l);
 
-      LIST_REMOVE(cl, l);
-      list_size--;
-      ELOG(VERBOSE, "Number of bookings left: %d", list_size);
+      event_begin(&ev, cl, started, 0., 0.);
+      event_mark(&ev, EVENT_BOOK);
+      if ((cp = event_copy(&ev, "rebooked")))
+        STAILQ_INSERT_TAIL(&run->events, cp, l);
+    }
+    else {
+      ELOGKEY(VERBOSE, cl->id, "%s booking failed: %s", class_print(cl),
+              website_errbuf());
       class_destroy(cl);
       free(cl);
     }
-    else {
-      ELOG(VERBOSE, "%s booking failed: %s", class_print(cl), website_errbuf());
+  }
+
+  if (!LIST_EMPTY(&run->booked)) {
+    run->committed = website_commit();
+    run->committed_at = ev_time();
+  }
+}
+
+
+/* Runs on the default loop */
+static void rebook_done(
+    EV_P_ void *data)
+{
+  struct rebook_run *run = data;
+  class_t cl, en, ne;
+
+  STALL_TAG();
+
+  rebooking = false;
+
+  event_flush(&run->events, run->committed ? run->committed_at : 0.);
+
+  if (!run->committed || !database_start())
+    goto fin;
+
+  /* Remove from queue what we booked */
+  LIST_FOREACH(cl, &run->booked, l) {
+    database_add(cl);
+
+    en = LIST_FIRST(&head);
+    while (en) {
+      ne = LIST_NEXT(en, l);
+      if (en->id == cl->id) {
+        LIST_REMOVE(en, l);
+        list_size--;
+        class_destroy(en);
+        free(en);
+      }
+      en = ne;
     }
-    cl = ne;
   }
+  ELOGKEY(VERBOSE, 0, "Number of bookings left: %d", list_size);
+  database_commit();
 
   /* Disable if theres nothing to wait on */
   if (list_size <= 0) {
     ELOG(INFO, "No more waitlist bookings. Stopped rebooker");
-    ev_timer_stop(EV_A_ w);
+    ev_timer_stop(EV_A_ &timer);
   }
 
-  if (commit) {
-    database_commit();
-    website_commit();
+fin:
+  class_free_timetable(&run->tries);
+  class_free_timetable(&run->booked);
+  free(run);
+}
+
+
+static void rebook_waitlist(
+    void)
+{
+  struct rebook_run *run;
+  class_t cl, dup;
+
+  /* Still waiting on the last attempt */
+  if (rebooking)
+    return;
+
+  ELOGKEY(VERBOSE, 0, "Checking rebookings");
+
+  run = calloc(1, sizeof(struct rebook_run));
+  if (!run) {
+    ELOGERR(ERROR, "Cannot allocate rebook run");
+    return;
   }
-  else {
-    database_rollback();
+  LIST_INIT(&run->tries);
+  LIST_INIT(&run->booked);
+  STAILQ_INIT(&run->events);
+
+  LIST_FOREACH(cl, &head, l) {
+    if ((dup = class_dup(cl)))
+      LIST_INSERT_HEAD(&run->tries, dup, l);
   }
+
+  rebooking = true;
+  offload(-1, rebook_work, rebook_done, run);
+}
+
+
+static void rebook_waitlist_event(
+    EV_P_ ev_timer *w,
+    int revents)
+{
+  STALL_TAG();
+  if (quiet_defer("waitq rebook", rebook_waitlist))
+    return;
+  rebook_waitlist();
 }
 
 
@@ -124,7 +221,27 @@ void waitq_init(
 {
   ELOG(VERBOSE, "Initializing");
   float retry = (float)config_get_waitlist_timeout();
-  ev_timer_init(&timer, rebook_waitlist, retry, retry);
+  ev_timer_init(&timer, rebook_waitlist_event, retry, retry);
   ev_set_priority(&timer, EV_MINPRI);
   LIST_INIT(&head);
 }
+
+
+/* How many classes are waiting for a place */
+int waitq_size(
+    void)
+{
+  return list_size;
+}
+
+
+/* Visit each class waiting for a place, in the order they are tried */
+void waitq_foreach(
+    waitq_fn fn,
+    void *data)
+{
+  class_t cl;
+
+  LIST_FOREACH(cl, &head, l)
+    fn(cl, data);
+}
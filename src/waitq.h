@@ -1,8 +1,12 @@
 #ifndef _WAITQ_H_
 #define _WAITQ_H_
 
+typedef void (*waitq_fn)(class_t cl, void *data);
+
 void waitq_init(void);
 void waitq_destroy(void);
 void waitq_flush(void);
 bool waitq_add(class_t cl);
+int waitq_size(void);
+void waitq_foreach(waitq_fn fn, void *data);
 #endif
@@ -3,14 +3,18 @@
 #include "class.h"
 #include "website.h"
 #include "logging.h"
+#include "shards.h"
+#include "database.h"
+#include "quiet.h"
+#include "metrics.h"
 
+#include "stall.h"
 #include <ev.h>
 #include <json-c/json.h>
 #include <curl/curl.h>
 
 LOGSET("website");
 
-#define WEBSITE_BASE "https://abbeycroft.legendonlineservices.co.uk"
 #define WEBSITE_LOGIN "/enterprise/account/login"
 #define WEBSITE_SENDLOGIN "/enterprise/account/processloginrequest"
 #define WEBSITE_MEMBERDETAILS "/enterprise/cschome/getaccountdetails"
@@ -28,18 +32,255 @@ LOGSET("website");
 #define WEBSITE_SUBTYPES "/enterprise/Bookings/ActivitySubTypeCategories"
 
 #define RELOGIN_TIMER 900.0
-
+/* Connections kept open for the release bookings fired together */
+#define WEBSITE_CONNECTIONS 16
+/* Idle connections the pool keeps. Past this the oldest are closed, so
+ * it leaves room for the shards' own on top of those warmed */
+#define WEBSITE_POOL (WEBSITE_CONNECTIONS * 2)
+/* Request timings held by each thread until they are saved */
+#define WEBSITE_TIMINGS 64
+
+/* Requests are made from the shards as well as the default loop, so
+ * response state is per thread. Each thread also takes its own copy of
+ * the site handle to duplicate requests from, the shared one is only
+ * touched under sitelock */
 static CURL *site;
-static char *buffer = NULL;
-static char errbuf[CURL_ERROR_SIZE] = {0};
-static size_t bufsz = 0;
+static CURLSH *share;
+static pthread_mutex_t sharelocks[CURL_LOCK_DATA_LAST];
+static pthread_mutex_t sitelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t sitekey;
+static __thread CURL *tsite = NULL;
+static __thread char *buffer = NULL;
+static __thread char errbuf[CURL_ERROR_SIZE] = {0};
+static __thread size_t bufsz = 0;
 static int time_diff;
+/* The site's clock less ours, both as seconds since the epoch */
+static int clock_skew;
 static int memberid = -1;
 static int clubid = -1;
 static int courtid = -1;
 static int facilitylistid = -1;
+/* Read once at start, the shards build URLs from it without a lock */
+static char *base_url = NULL;
 static ev_timer relog;
 
+/* Timings are recorded in memory by the thread that made the request and
+ * saved to the database from the default loop once a pass is over, so no
+ * request waits on the database. The oldest are dropped if it fills */
+struct timing_ring {
+  pthread_mutex_t lock;
+  struct latency samples[WEBSITE_TIMINGS];
+  int head;
+  int len;
+  LIST_ENTRY(timing_ring) l;
+};
+
+static pthread_mutex_t ringlock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(timing_rings, timing_ring) rings =
+                                            LIST_HEAD_INITIALIZER(rings);
+static __thread struct timing_ring *ring = NULL;
+
+/* A booking request built ahead of time, ready to go on the wire. It
+ * keeps its own response as several are in flight at once */
+struct website_shot {
+  CURL *cu;
+  int classid;
+  char *buf;
+  size_t len;
+  char errbuf[CURL_ERROR_SIZE];
+};
+
+/* Every handle is duplicated from site so shares its connection pool,
+ * DNS and TLS sessions, connections outlive the handles that made them */
+static void share_lock(
+    CURL *cu,
+    curl_lock_data data,
+    curl_lock_access access,
+    void *userp)
+{
+  pthread_mutex_lock(&sharelocks[data]);
+}
+
+
+static void share_unlock(
+    CURL *cu,
+    curl_lock_data data,
+    void *userp)
+{
+  pthread_mutex_unlock(&sharelocks[data]);
+}
+
+
+static void website_count(
+    CURL *cu,
+    enum metric_endpoint ep,
+    CURLcode rc)
+{
+  curl_off_t total = 0;
+  long code = 0;
+
+  curl_easy_getinfo(cu, CURLINFO_TOTAL_TIME_T, &total);
+  curl_easy_getinfo(cu, CURLINFO_RESPONSE_CODE, &code);
+  metric_request(ep, total / 1000000., rc == CURLE_OK && code < 400);
+}
+
+
+/* Every request goes through here to be counted and timed */
+static CURLcode website_perform(
+    CURL *cu,
+    enum metric_endpoint ep)
+{
+  CURLcode rc;
+
+  rc = curl_easy_perform(cu);
+  website_count(cu, ep, rc);
+  return rc;
+}
+
+
+/* Sends every request at once and waits for them all, their results go
+ * in rcs. Each goes out on a pooled connection where there is one */
+static void website_perform_all(
+    CURL **cus,
+    CURLcode *rcs,
+    int n,
+    enum metric_endpoint ep)
+{
+  CURLM *multi;
+  CURLMsg *msg;
+  int i, running = 0, left;
+
+  for (i=0; i < n; i++)
+    rcs[i] = CURLE_FAILED_INIT;
+
+  multi = curl_multi_init();
+  if (!multi) {
+    ELOG(ERROR, "Cannot allocate a multi request");
+    return;
+  }
+  curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long)WEBSITE_POOL);
+
+  for (i=0; i < n; i++)
+    curl_multi_add_handle(multi, cus[i]);
+
+  do {
+    if (curl_multi_perform(multi, &running) != CURLM_OK)
+      break;
+    if (running && curl_multi_wait(multi, NULL, 0, 1000, NULL) != CURLM_OK)
+      break;
+  } while (running);
+
+  while ((msg = curl_multi_info_read(multi, &left))) {
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+    for (i=0; i < n; i++) {
+      if (cus[i] == msg->easy_handle)
+        rcs[i] = msg->data.result;
+    }
+  }
+
+  for (i=0; i < n; i++) {
+    curl_multi_remove_handle(multi, cus[i]);
+    website_count(cus[i], ep, rcs[i]);
+  }
+  curl_multi_cleanup(multi);
+}
+
+
+/* Keeps how long the request took on each leg so release timing can
+ * learn how far away the site is. The endpoint must be a literal */
+static void website_record_timing(
+    CURL *cu,
+    const char *endpoint,
+    struct website_timing *timing)
+{
+  curl_off_t connect = 0, pretransfer = 0, ttfb = 0, total = 0;
+  struct latency *l;
+
+  curl_easy_getinfo(cu, CURLINFO_CONNECT_TIME_T, &connect);
+  curl_easy_getinfo(cu, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+  curl_easy_getinfo(cu, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+  curl_easy_getinfo(cu, CURLINFO_TOTAL_TIME_T, &total);
+
+  if (!ring) {
+    ring = calloc(1, sizeof(struct timing_ring));
+    if (!ring) {
+      ELOGERR(CRITICAL, "Cannot allocate request timings");
+      exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_mutex_lock(&ringlock);
+    LIST_INSERT_HEAD(&rings, ring, l);
+    pthread_mutex_unlock(&ringlock);
+  }
+
+  pthread_mutex_lock(&ring->lock);
+  l = &ring->samples[(ring->head + ring->len) % WEBSITE_TIMINGS];
+  if (ring->len == WEBSITE_TIMINGS)
+    ring->head = (ring->head + 1) % WEBSITE_TIMINGS;
+  else
+    ring->len++;
+  l->endpoint = endpoint;
+  l->at = time(NULL);
+  l->connect = connect;
+  l->pretransfer = pretransfer;
+  l->ttfb = ttfb;
+  l->total = total;
+  pthread_mutex_unlock(&ring->lock);
+
+  if (timing) {
+    timing->connect = connect / 1000000.;
+    timing->pretransfer = pretransfer / 1000000.;
+    timing->ttfb = ttfb / 1000000.;
+    timing->total = total / 1000000.;
+  }
+}
+
+
+static void website_thread_reset(
+    void)
+{
+  if (tsite)
+    curl_easy_cleanup(tsite);
+  tsite = NULL;
+  pthread_setspecific(sitekey, NULL);
+}
+
+
+static void website_reset_event(
+    EV_P_ void *data)
+{
+  website_thread_reset();
+}
+
+
+/* Returns a new request handle configured from the site handle. A copy
+ * does not carry the share, without it each one connects afresh */
+static CURL * website_handle(
+    void)
+{
+  CURL *cu;
+
+  if (!tsite) {
+    pthread_mutex_lock(&sitelock);
+    tsite = curl_easy_duphandle(site);
+    pthread_mutex_unlock(&sitelock);
+
+    if (!tsite) {
+      ELOG(ERROR, "Cannot copy website handle");
+      return NULL;
+    }
+    curl_easy_setopt(tsite, CURLOPT_ERRORBUFFER, errbuf);
+    pthread_setspecific(sitekey, tsite);
+  }
+
+  cu = curl_easy_duphandle(tsite);
+  if (cu)
+    curl_easy_setopt(cu, CURLOPT_SHARE, share);
+  return cu;
+}
+
+
 static void reset_buffer(
     void)
 {
@@ -70,6 +311,31 @@ static size_t curl_write(
    return sz;
 }
 
+
+static size_t shot_write(
+    char *data,
+    size_t size,
+    size_t nmemb,
+    void *userp)
+{
+  website_shot_t shot = userp;
+  size_t sz = size * nmemb;
+  char *p;
+
+  p = realloc(shot->buf, shot->len + sz + 1);
+  if (!p) {
+    ELOGERR(ERROR, "Cannot allocate buffer");
+    exit(EXIT_FAILURE);
+  }
+  shot->buf = p;
+
+  memcpy(&shot->buf[shot->len], data, sz);
+  shot->len += sz;
+  shot->buf[shot->len] = 0;
+
+  return sz;
+}
+
 static size_t curl_header_write(
     char *data,
     size_t size,
@@ -103,6 +369,7 @@ static size_t curl_header_write(
 
   /* Fetch our time, removing any DST hints */
   us = time(NULL);
+  clock_skew = timegm(&them_tm) - us;
   localtime_r(&us, &us_tm);
   us_tm.tm_isdst = 0;
 
@@ -441,13 +708,13 @@ static int website_get_category(
   char url[1024] = {0};
   const char *target;
 
-  snprintf(url, 1024, "%s/%s?LocationIds=%d", WEBSITE_BASE, WEBSITE_SUBTYPES, fac_id);
+  snprintf(url, 1024, "%s%s?LocationIds=%d", base_url, WEBSITE_SUBTYPES, fac_id);
   ELOG(VERBOSE, "Website Subtypes");
 
-  cu = curl_easy_duphandle(site);
+  cu = website_handle();
   curl_easy_setopt(cu, CURLOPT_URL, url);
 
-  rc = curl_easy_perform(cu);
+  rc = website_perform(cu, METRIC_SUBTYPES);
   if (rc != CURLE_OK) {
     ELOG(ERROR, "Cannot fetch URL %s: %s, %s", url, curl_easy_strerror(rc),
          errbuf);
@@ -497,13 +764,13 @@ static int website_logout(
   CURLcode rc;
   char url[1024] = {0};
 
-  snprintf(url, 1024, "%s/%s", WEBSITE_BASE, WEBSITE_LOGOUT);
+  snprintf(url, 1024, "%s%s", base_url, WEBSITE_LOGOUT);
   ELOG(VERBOSE, "Website logout");
 
-  cu = curl_easy_duphandle(site);
+  cu = website_handle();
   curl_easy_setopt(cu, CURLOPT_URL, url);
 
-  rc = curl_easy_perform(cu);
+  rc = website_perform(cu, METRIC_LOGOUT);
   if (rc != CURLE_OK) {
     ELOG(ERROR, "Cannot fetch URL %s: %s, %s", url, curl_easy_strerror(rc),
          errbuf);
@@ -529,16 +796,16 @@ static int website_login(
   char url[1024] = {0};
   char *post = NULL;
   struct curl_slist *hdrs = NULL;
-  snprintf(url, 1024, "%s/%s", WEBSITE_BASE, WEBSITE_LOGIN);
+  snprintf(url, 1024, "%s%s", base_url, WEBSITE_LOGIN);
 
   ELOG(VERBOSE, "Website login");
 
   /* Fetch the initial URL to create a session cookie, or check
      if we are already logged on */
-  cu = curl_easy_duphandle(site);
+  cu = website_handle();
   curl_easy_setopt(cu, CURLOPT_URL, url);
 
-  rc = curl_easy_perform(cu);
+  rc = website_perform(cu, METRIC_LOGIN);
   if (rc != CURLE_OK) {
     ELOG(ERROR, "Cannot fetch URL %s: %s, %s", url, curl_easy_strerror(rc), 
          errbuf);
@@ -568,7 +835,7 @@ static int website_login(
 
   /* Set the new url */
   memset(url, 0, sizeof(url));
-  snprintf(url, 1024, "%s/%s", WEBSITE_BASE, WEBSITE_SENDLOGIN);
+  snprintf(url, 1024, "%s%s", base_url, WEBSITE_SENDLOGIN);
   curl_easy_setopt(cu, CURLOPT_URL, url);
 
   /* Create login output */
@@ -578,7 +845,7 @@ static int website_login(
   curl_easy_setopt(cu, CURLOPT_POSTFIELDS, post);
 
   /* Perform the URL and check result */
-  rc = curl_easy_perform(cu);
+  rc = website_perform(cu, METRIC_SENDLOGIN);
   if (rc != CURLE_OK) {
     ELOG(ERROR, "Cannot fetch URL %s: %s, %s", url, curl_easy_strerror(rc), 
          errbuf);
@@ -619,11 +886,11 @@ static int website_memberstate(
   ELOG(VERBOSE, "website locationids");
 
   /* Try to locate website locations */
-  snprintf(url, 1024, "%s/%s", WEBSITE_BASE, WEBSITE_LOCATIONS);
-  cu = curl_easy_duphandle(site);
+  snprintf(url, 1024, "%s%s", base_url, WEBSITE_LOCATIONS);
+  cu = website_handle();
   curl_easy_setopt(cu, CURLOPT_URL, url);
 
-  rc = curl_easy_perform(cu);
+  rc = website_perform(cu, METRIC_LOCATIONS);
   if (rc != CURLE_OK) {
     ELOG(ERROR, "Cannot fetch URL %s: %s, %s", url, curl_easy_strerror(rc), 
          errbuf);
@@ -640,11 +907,11 @@ static int website_memberstate(
   reset_buffer();
 
   /* Fetch the club ID */
-  snprintf(url, 1024, "%s/%s?request=%d", WEBSITE_BASE, WEBSITE_CLUB, facilitylistid);
-  cu = curl_easy_duphandle(site);
+  snprintf(url, 1024, "%s%s?request=%d", base_url, WEBSITE_CLUB, facilitylistid);
+  cu = website_handle();
   curl_easy_setopt(cu, CURLOPT_URL, url);
 
-  rc = curl_easy_perform(cu);
+  rc = website_perform(cu, METRIC_CLUB);
   if (rc != CURLE_OK) {
     ELOG(ERROR, "Cannot fetch URL %s: %s, %s", url, curl_easy_strerror(rc),
          errbuf);
@@ -682,10 +949,10 @@ static int website_memberstate(
 
   /* Fetch the configuration page */
   memset(url, 0, sizeof(url));
-  snprintf(url, 1024, "%s/%s", WEBSITE_BASE, WEBSITE_CONFIGURATION);
+  snprintf(url, 1024, "%s%s", base_url, WEBSITE_CONFIGURATION);
   curl_easy_setopt(cu, CURLOPT_URL, url);
 
-  rc = curl_easy_perform(cu);
+  rc = website_perform(cu, METRIC_CONFIGURATION);
   if (rc != CURLE_OK) {
     ELOG(ERROR, "Cannot fetch URL %s: %s, %s", url, curl_easy_strerror(rc),
          errbuf);
@@ -719,17 +986,29 @@ fail:
 }
 
 static void website_relogin(
-    EV_P_ ev_timer *w,
-    int revents)
+    void)
 {
   ELOG(VERBOSE, "Relogging into website (refresh cookies)");
   website_logout();
   website_login();
 }
 
+static void website_relogin_event(
+    EV_P_ ev_timer *w,
+    int revents)
+{
+  STALL_TAG();
+  if (quiet_defer("relogin", website_relogin))
+    return;
+  website_relogin();
+}
+
 void website_init(
     void)
 {
+  size_t len;
+  int i;
+
   if (curl_global_init(CURL_GLOBAL_DEFAULT)) {
     ELOG(ERROR, "curl_global_init");
     exit(EXIT_FAILURE);
@@ -741,6 +1020,36 @@ void website_init(
     exit(EXIT_FAILURE);
   }
 
+  base_url = strdup(config_get_base_url());
+  if (!base_url) {
+    ELOGERR(ERROR, "Cannot allocate base_url");
+    exit(EXIT_FAILURE);
+  }
+  /* Each path brings a slash of its own */
+  len = strlen(base_url);
+  while (len && base_url[len-1] == '/')
+    base_url[--len] = 0;
+
+  for (i=0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_init(&sharelocks[i], NULL);
+
+  share = curl_share_init();
+  if (!share) {
+    ELOG(ERROR, "Cannot initialize website connection share");
+    exit(EXIT_FAILURE);
+  }
+  curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+  curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+  /* Threads free their copy of the site handle as they exit */
+  if (pthread_key_create(&sitekey, (void (*)(void *))curl_easy_cleanup)) {
+    ELOG(ERROR, "Cannot create website handle key");
+    exit(EXIT_FAILURE);
+  }
+
   /* Set cookies */
   curl_easy_setopt(site, CURLOPT_COOKIEFILE, config_get_cookies());
   curl_easy_setopt(site, CURLOPT_COOKIEJAR, config_get_cookies());
@@ -753,10 +1062,12 @@ void website_init(
   curl_easy_setopt(site, CURLOPT_HEADERDATA, NULL);
   curl_easy_setopt(site, CURLOPT_FAILONERROR, 1L);
   curl_easy_setopt(site, CURLOPT_ERRORBUFFER, errbuf);
-  curl_easy_setopt(site, CURLOPT_URL, WEBSITE_BASE);
+  curl_easy_setopt(site, CURLOPT_URL, base_url);
   //curl_easy_setopt(site, CURLOPT_VERBOSE, config_get_verbose());
   curl_easy_setopt(site, CURLOPT_VERBOSE, 0);
   curl_easy_setopt(site, CURLOPT_USERAGENT, "Abbey");
+  curl_easy_setopt(site, CURLOPT_SHARE, share);
+  curl_easy_setopt(site, CURLOPT_MAXCONNECTS, (long)WEBSITE_POOL);
 
   if (!website_login()) {
     ELOG(CRITICAL, "Initial login failed. Exiting.");
@@ -768,7 +1079,8 @@ void website_init(
     exit(EXIT_FAILURE);
   }
 
-  ev_timer_init(&relog, website_relogin, RELOGIN_TIMER, RELOGIN_TIMER);
+  ev_timer_init(&relog, website_relogin_event, RELOGIN_TIMER, RELOGIN_TIMER);
+  ev_set_priority(&relog, EV_MINPRI);
   ev_timer_start(EV_DEFAULT_ &relog);
 
   return;
@@ -776,7 +1088,8 @@ void website_init(
 
 
 class_list_t website_get_timetable(
-    int ndays)
+    int ndays,
+    double *received)
 {
   CURL *cu;
   CURLcode rc;
@@ -808,18 +1121,20 @@ class_list_t website_get_timetable(
   /* Create the URL to push */
 
   /* Fetch the timetable */
-  snprintf(url, 1024, "%s/%s?FacilityLocationIdList=%d&DateFrom=%s&DateTo=%s", WEBSITE_BASE, 
+  snprintf(url, 1024, "%s%s?FacilityLocationIdList=%d&DateFrom=%s&DateTo=%s", base_url, 
                       WEBSITE_TIMETABLE, facilitylistid, nowstr, whenstr);
-  cu = curl_easy_duphandle(site);
+  cu = website_handle();
   curl_easy_setopt(cu, CURLOPT_URL, url);
   ELOG(VERBOSE, "Timetable URL: %s", url);
 
-  rc = curl_easy_perform(cu);
+  rc = website_perform(cu, METRIC_TIMETABLE);
   if (rc != CURLE_OK) {
     ELOG(ERROR, "Cannot fetch URL %s: %s, %s", url, curl_easy_strerror(rc),
          errbuf);
     goto fail;
   }
+  website_record_timing(cu, "timetable", NULL);
+  *received = ev_time();
 
   /* Attempt to parse result as json */
   json = json_tokener_parse(buffer);
@@ -880,8 +1195,8 @@ int website_wait(
   char post[1024] = {0};
 
   /* Submit the URL */
-  snprintf(url, 1024, "%s/%s", WEBSITE_BASE, WEBSITE_WAIT);
-  cu = curl_easy_duphandle(site);
+  snprintf(url, 1024, "%s%s", base_url, WEBSITE_WAIT);
+  cu = website_handle();
   curl_easy_setopt(cu, CURLOPT_URL, url);
 
   /* Create form output */
@@ -891,7 +1206,7 @@ int website_wait(
   ELOG(VERBOSE, "form: %s\n", post);
 
   /* Submit */
-  rc = curl_easy_perform(cu);
+  rc = website_perform(cu, METRIC_WAIT);
   if (rc != CURLE_OK) {
     ELOG(WARNING, "Cannot fetch URL %s: %s, %s", url, curl_easy_strerror(rc),
          errbuf);
@@ -919,6 +1234,14 @@ int website_server_time_diff(
   return time_diff;
 }
 
+/* Seconds the site's clock is ahead of ours. Unlike the time diff it
+ * holds no timezone, the Date header is always GMT */
+int website_clock_skew(
+    void)
+{
+  return clock_skew;
+}
+
 float website_price(
     class_t cl)
 {
@@ -929,13 +1252,13 @@ float website_price(
   float price;
 
   /* Submit the URL */
-  snprintf(url, 1024, "%s/%s?ActiveInstanceId=%d&OnlineUserId=%d", 
-                      WEBSITE_BASE, WEBSITE_PRICE, cl->id, memberid);
-  cu = curl_easy_duphandle(site);
+  snprintf(url, 1024, "%s%s?ActiveInstanceId=%d&OnlineUserId=%d", 
+                      base_url, WEBSITE_PRICE, cl->id, memberid);
+  cu = website_handle();
   curl_easy_setopt(cu, CURLOPT_URL, url);
 
   /* Submit */
-  rc = curl_easy_perform(cu);
+  rc = website_perform(cu, METRIC_PRICE);
   if (rc != CURLE_OK) {
     ELOG(WARNING, "Cannot fetch URL %s: %s, %s", url, curl_easy_strerror(rc),
          errbuf);
@@ -967,8 +1290,8 @@ int website_book(
   char post[1024] = {0};
 
   /* Submit the URL */
-  snprintf(url, 1024, "%s/%s", WEBSITE_BASE, WEBSITE_BOOK);
-  cu = curl_easy_duphandle(site);
+  snprintf(url, 1024, "%s%s", base_url, WEBSITE_BOOK);
+  cu = website_handle();
   curl_easy_setopt(cu, CURLOPT_URL, url);
 
   /* Create form output */
@@ -978,12 +1301,13 @@ int website_book(
   curl_easy_setopt(cu, CURLOPT_POSTFIELDS, post);
 
   /* Submit */
-  rc = curl_easy_perform(cu);
+  rc = website_perform(cu, METRIC_BOOK);
   if (rc != CURLE_OK) {
     ELOG(WARNING, "Cannot fetch URL %s: %s, %s", url, curl_easy_strerror(rc),
          errbuf);
     goto fail;
   }
+  website_record_timing(cu, "book", NULL);
 
   /* Attempt to check if successful */
   if (!parse_json_success(buffer)) {
@@ -1001,6 +1325,132 @@ fail:
 }
 
 
+/* Builds the booking request for a class so that firing it later does
+ * nothing but send it */
+website_shot_t website_arm(
+    class_t cl)
+{
+  assert(cl);
+  char url[1024] = {0};
+  char post[1024] = {0};
+  website_shot_t shot = calloc(1, sizeof(struct website_shot));
+
+  if (!shot) {
+    ELOGERR(ERROR, "Cannot allocate booking request");
+    return NULL;
+  }
+
+  shot->classid = cl->id;
+  shot->cu = website_handle();
+  if (!shot->cu) {
+    free(shot);
+    return NULL;
+  }
+
+  snprintf(url, 1024, "%s%s", base_url, WEBSITE_BOOK);
+  snprintf(post, 1023, "ActivityInstanceId=%d", cl->id);
+  curl_easy_setopt(shot->cu, CURLOPT_URL, url);
+  curl_easy_setopt(shot->cu, CURLOPT_COPYPOSTFIELDS, post);
+  curl_easy_setopt(shot->cu, CURLOPT_WRITEFUNCTION, shot_write);
+  curl_easy_setopt(shot->cu, CURLOPT_WRITEDATA, shot);
+  curl_easy_setopt(shot->cu, CURLOPT_ERRORBUFFER, shot->errbuf);
+
+  return shot;
+}
+
+
+/* Leaves n open connections to the site in the pool, one for each
+ * request about to be sent together */
+void website_warm(
+    int n)
+{
+  CURL *cus[WEBSITE_CONNECTIONS] = {0};
+  CURLcode rcs[WEBSITE_CONNECTIONS];
+  int i, made = 0;
+
+  if (n > WEBSITE_CONNECTIONS)
+    n = WEBSITE_CONNECTIONS;
+
+  for (i=0; i < n; i++) {
+    if (!(cus[made] = website_handle()))
+      continue;
+    curl_easy_setopt(cus[made], CURLOPT_URL, base_url);
+    curl_easy_setopt(cus[made], CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(cus[made], CURLOPT_FAILONERROR, 0L);
+    curl_easy_setopt(cus[made], CURLOPT_FRESH_CONNECT, 1L);
+    made++;
+  }
+
+  website_perform_all(cus, rcs, made, METRIC_WARM);
+
+  for (i=0; i < made; i++) {
+    if (rcs[i] != CURLE_OK)
+      ELOG(WARNING, "Cannot warm connection: %s", curl_easy_strerror(rcs[i]));
+    curl_easy_cleanup(cus[i]);
+  }
+  reset_buffer();
+}
+
+
+/* Sends every armed booking at the same instant. booked is set for each
+ * the site accepted, the first shot's timing is given back */
+int website_fire(
+    website_shot_t *shots,
+    int n,
+    bool *booked,
+    struct website_timing *timing)
+{
+  CURL **cus;
+  CURLcode *rcs;
+  int i, ok = 0;
+
+  if (n <= 0)
+    return 0;
+
+  cus = calloc(n, sizeof(CURL *));
+  rcs = calloc(n, sizeof(CURLcode));
+  if (!cus || !rcs) {
+    ELOGERR(ERROR, "Cannot allocate booking requests");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i=0; i < n; i++)
+    cus[i] = shots[i]->cu;
+
+  website_perform_all(cus, rcs, n, METRIC_BOOK);
+
+  for (i=0; i < n; i++) {
+    booked[i] = false;
+    if (rcs[i] != CURLE_OK) {
+      ELOG(WARNING, "Cannot book class %d: %s, %s", shots[i]->classid,
+           curl_easy_strerror(rcs[i]), shots[i]->errbuf);
+      continue;
+    }
+    website_record_timing(shots[i]->cu, "book", i == 0 ? timing : NULL);
+
+    booked[i] = shots[i]->buf && parse_json_success(shots[i]->buf);
+    if (booked[i])
+      ok++;
+  }
+
+  free(cus);
+  free(rcs);
+  return ok;
+}
+
+
+void website_disarm(
+    website_shot_t shot)
+{
+  if (!shot)
+    return;
+
+  curl_easy_cleanup(shot->cu);
+  free(shot->buf);
+  free(shot);
+}
+
+
 int website_commit(
     void)
 {
@@ -1012,8 +1462,8 @@ int website_commit(
   ELOG(VERBOSE, "Website commit");
 
   /* Submit the URL */
-  snprintf(url, 1024, "%s/%s", WEBSITE_BASE, WEBSITE_COMMIT);
-  cu = curl_easy_duphandle(site);
+  snprintf(url, 1024, "%s%s", base_url, WEBSITE_COMMIT);
+  cu = website_handle();
   curl_easy_setopt(cu, CURLOPT_URL, url);
   curl_easy_setopt(cu, CURLOPT_POSTFIELDS, "");
 
@@ -1022,7 +1472,7 @@ int website_commit(
   curl_easy_setopt(cu, CURLOPT_HTTPHEADER, hdrs);
 
   /* Submit */
-  rc = curl_easy_perform(cu);
+  rc = website_perform(cu, METRIC_COMMIT);
   if (rc != CURLE_OK) {
     ELOG(ERROR, "Cannot fetch URL %s: %s, %s", url, curl_easy_strerror(rc),
          errbuf);
@@ -1046,16 +1496,26 @@ fail:
 void website_update_config(
     void)
 {
+  pthread_mutex_lock(&sitelock);
   curl_easy_setopt(site, CURLOPT_COOKIEFILE, config_get_cookies());
   curl_easy_setopt(site, CURLOPT_COOKIEJAR, config_get_cookies());
   // curl_easy_setopt(site, CURLOPT_VERBOSE, config_get_verbose());
+  pthread_mutex_unlock(&sitelock);
+
+  /* Everyone picks up the new settings on their next request */
+  website_thread_reset();
+  shards_broadcast(website_reset_event, NULL);
 }
 
 
 void website_destroy(
     void)
 {
+  struct timing_ring *r;
+  int i;
+
   ev_timer_stop(EV_DEFAULT, &relog);
+  website_thread_reset();
   clubid = -1;
   memberid = -1;
   bufsz = 0;
@@ -1064,12 +1524,62 @@ void website_destroy(
   memset(errbuf, 0, CURL_ERROR_SIZE);
 
   curl_easy_cleanup(site);
+  curl_share_cleanup(share);
+  for (i=0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_destroy(&sharelocks[i]);
+  free(base_url);
+  base_url = NULL;
+
+  /* Anything not saved by now goes, every thread has stopped */
+  pthread_mutex_lock(&ringlock);
+  while ((r = LIST_FIRST(&rings))) {
+    LIST_REMOVE(r, l);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+  }
+  pthread_mutex_unlock(&ringlock);
+  ring = NULL;
 
   ELOG(VERBOSE, "Website object destroyed");
   return;
 }
 
 
+/* Moves every threads timings to the database, keeping keep of each
+ * request there. Only from the default loop, between passes */
+void website_save_timings(
+    int keep)
+{
+  struct latency *all = NULL, *p;
+  struct timing_ring *r;
+  int i, n = 0, size = 0;
+
+  pthread_mutex_lock(&ringlock);
+  LIST_FOREACH(r, &rings, l) {
+    pthread_mutex_lock(&r->lock);
+    if (n + r->len > size) {
+      size = n + r->len;
+      p = realloc(all, sizeof(struct latency) * size);
+      if (!p) {
+        pthread_mutex_unlock(&r->lock);
+        ELOGERR(WARNING, "Cannot allocate request timings");
+        break;
+      }
+      all = p;
+    }
+    for (i=0; i < r->len; i++)
+      all[n++] = r->samples[(r->head + i) % WEBSITE_TIMINGS];
+    r->head = r->len = 0;
+    pthread_mutex_unlock(&r->lock);
+  }
+  pthread_mutex_unlock(&ringlock);
+
+  if (n)
+    database_add_latency(all, n, keep);
+  free(all);
+}
+
+
 char * website_errbuf(
     void)
 {
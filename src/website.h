@@ -1,15 +1,32 @@
 #ifndef _WEBSITE_H_
 #define _WEBSITE_H_
 
+typedef struct website_shot * website_shot_t;
+
+/* Seconds from the start of a request to each stage */
+struct website_timing {
+  double connect;
+  double pretransfer;
+  double ttfb;
+  double total;
+};
+
 void website_init(void);
 void website_destroy(void);
 
-class_list_t website_get_timetable(int ndays);
+class_list_t website_get_timetable(int ndays, double *received);
 int website_server_time_diff(void);
+int website_clock_skew(void);
 void website_update_config(void);
 int website_wait(class_t cl);
 int website_book(class_t cl);
 float website_price(class_t cl);
 int website_commit(void);
+website_shot_t website_arm(class_t cl);
+void website_warm(int n);
+int website_fire(website_shot_t *shots, int n, bool *booked,
+                 struct website_timing *timing);
+void website_disarm(website_shot_t shot);
+void website_save_timings(int keep);
 char * website_errbuf(void);
 #endif